@@ -0,0 +1,23 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Host stand-in for the EEPROM access, EEPROM variables are plain memory
+
+#ifndef HOST_AVR_EEPROM_H_
+#define HOST_AVR_EEPROM_H_
+
+#include <stdint.h>
+
+#define EEMEM
+
+extern uint8_t eeprom_read_byte(const uint8_t *address);
+extern void eeprom_update_byte(uint8_t *address, uint8_t value);
+extern uint16_t eeprom_read_word(const uint16_t *address);
+extern void eeprom_update_word(uint16_t *address, uint16_t value);
+
+#endif /* HOST_AVR_EEPROM_H_ */
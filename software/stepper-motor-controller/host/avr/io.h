@@ -0,0 +1,92 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Host stand-in for the ATtiny826 registers used by the firmware, the registers are plain memory
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+	volatile uint8_t DIR;
+	volatile uint8_t OUT;
+	volatile uint8_t IN;
+	volatile uint8_t INTFLAGS;
+} VPORT_t;
+
+typedef struct
+{
+	volatile uint8_t CTRLA;
+	volatile uint8_t CTRLB;
+	volatile uint8_t INTCTRL;
+	volatile uint8_t INTFLAGS;
+	volatile uint16_t CNT;
+	volatile uint16_t PER;
+} TCA_SINGLE_t;
+
+typedef struct
+{
+	TCA_SINGLE_t SINGLE;
+} TCA_t;
+
+typedef struct
+{
+	volatile uint8_t SCTRLA;
+	volatile uint8_t SCTRLB;
+	volatile uint8_t SSTATUS;
+	volatile uint8_t SADDR;
+	volatile uint8_t SDATA;
+} TWI_t;
+
+extern VPORT_t VPORTA;
+extern VPORT_t VPORTB;
+extern VPORT_t VPORTC;
+extern TCA_t TCA0;
+extern TWI_t TWI0;
+
+// Writing the input register doesn't toggle the plain memory output, the firmware toggles through this macro
+#define TOGGLE_STEP_PIN(vport, step_mask) ((vport)->OUT ^= (step_mask))
+
+#define RAMSIZE 1024 // SRAM of the ATtiny826
+
+#define PIN0_bm 0x01
+#define PIN1_bm 0x02
+#define PIN2_bm 0x04
+#define PIN3_bm 0x08
+#define PIN4_bm 0x10
+#define PIN5_bm 0x20
+#define PIN6_bm 0x40
+#define PIN7_bm 0x80
+
+#define TCA_SINGLE_OVF_bm 0x01
+#define TCA_SINGLE_ENABLE_bm 0x01
+#define TCA_SINGLE_WGMODE_NORMAL_gc (0x00 << 0)
+#define TCA_SINGLE_CLKSEL_DIV1_gc (0x00 << 1)
+#define TCA_SINGLE_CLKSEL_DIV2_gc (0x01 << 1)
+#define TCA_SINGLE_CLKSEL_DIV4_gc (0x02 << 1)
+#define TCA_SINGLE_CLKSEL_DIV8_gc (0x03 << 1)
+#define TCA_SINGLE_CLKSEL_DIV16_gc (0x04 << 1)
+#define TCA_SINGLE_CLKSEL_DIV64_gc (0x05 << 1)
+#define TCA_SINGLE_CLKSEL_DIV256_gc (0x06 << 1)
+#define TCA_SINGLE_CLKSEL_DIV1024_gc (0x07 << 1)
+
+#define TWI_DIEN_bm 0x80
+#define TWI_APIEN_bm 0x40
+#define TWI_PIEN_bm 0x20
+#define TWI_ENABLE_bm 0x01
+#define TWI_DIF_bm 0x80
+#define TWI_APIF_bm 0x40
+#define TWI_COLL_bm 0x08
+#define TWI_DIR_bm 0x02
+#define TWI_AP_bm 0x01
+#define TWI_SCMD_RESPONSE_gc (0x03 << 0)
+#define TWI_SCMD_COMPTRANS_gc (0x02 << 0)
+
+#endif /* HOST_AVR_IO_H_ */
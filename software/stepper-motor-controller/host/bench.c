@@ -0,0 +1,140 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Timing build of the command path, measures the host time of the TWI interrupt handler per command
+// and of the timer tick while commands run.
+// The times compare changes of the parser and the queue, they are not the cycles of the ATtiny826.
+// Usage: bench [<commands>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "util.h"
+#include "twi.h"
+#include "motors.h"
+#include "host.h"
+
+#define BENCH_COMMANDS 1000000 // Commands timed by default for each case
+
+typedef struct {
+	const char *name;
+	const char *command;
+	uint8_t is_queued; // The queue is cleared before it is full
+} BenchCase;
+
+static volatile unsigned long bench_sink; // Keeps the parsed values from being optimized out
+
+static const BenchCase bench_cases[] = {
+	{"run one device", "run:A200,10", 1},
+	{"run four devices", "run:A-200,10:B200,12:C-4000,300:D65535,20000", 1},
+	{"invalid run", "run:E200,10", 0},
+	{"status", "status", 0},
+	{"version", "version", 0},
+};
+
+static const BenchCase tick_cases[] = {
+	{"tick last device", "run:D65535,1", 1},
+	{"tick four devices", "run:A65535,1:B-65535,2:C65535,3:D-65535,4", 1},
+	{"tick short commands", "run:A1,1:B1,1", 1},
+};
+
+/**
+* Times parse_number() alone on a number followed by a delimiter
+*/
+static void bench_parse_number(uint32_t count)
+{
+	char number[] = "4294967295,";
+	uint64_t start = host_time_ns();
+	for(uint32_t i = 0; i < count; i++)
+	{
+		char *cursor = number;
+		unsigned long parsed = 0;
+		parse_number(&cursor, 0xFFFFFFFFUL, &parsed);
+		bench_sink = parsed;
+	}
+	uint64_t elapsed = host_time_ns() - start;
+	printf("%-20s %8.1f ns per call\n", "parse_number", (double)elapsed / count);
+}
+
+/**
+* Times one command sent alone in a write transaction, the response is not read
+*/
+static void bench_command(const BenchCase *bench_case, uint32_t count)
+{
+	const uint8_t *command = (const uint8_t*)bench_case->command;
+	size_t length = strlen(bench_case->command) + 1;
+	uint64_t elapsed = 0;
+	uint32_t done = 0;
+	clear_command_buffer();
+	while(done < count)
+	{
+		uint64_t start = host_time_ns();
+		uint32_t block = 0;
+		while(block < count - done && (!bench_case->is_queued || get_queue_capacity() > queued_commands + 1))
+		{
+			host_write(command, length);
+			block++;
+		}
+		elapsed += host_time_ns() - start;
+		done += block;
+		if(bench_case->is_queued && strcmp(write_buffer, RESPONSE_OK) != 0)
+		{
+			printf("%-20s rejected: %s\n", bench_case->name, write_buffer);
+			return;
+		}
+		clear_command_buffer();
+	}
+	printf("%-20s %8.1f ns per command\n", bench_case->name, (double)elapsed / count);
+}
+
+/**
+* Times the timer tick while the command of the case runs, the queue is refilled outside of the timed blocks
+*/
+static void bench_tick(const BenchCase *bench_case, uint32_t count)
+{
+	const uint8_t *command = (const uint8_t*)bench_case->command;
+	size_t length = strlen(bench_case->command) + 1;
+	uint64_t elapsed = 0;
+	uint32_t done = 0;
+	clear_command_buffer();
+	while(done < count)
+	{
+		while(get_queue_capacity() > queued_commands + 1)
+		{
+			host_write(command, length);
+		}
+		uint64_t start = host_time_ns();
+		uint32_t block = 0;
+		while(block < count - done && queued_commands > 0)
+		{
+			motors_tick();
+			block++;
+		}
+		elapsed += host_time_ns() - start;
+		done += block;
+	}
+	clear_command_buffer();
+	printf("%-20s %8.1f ns per tick\n", bench_case->name, (double)elapsed / count);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_COMMANDS;
+	host_init();
+	bench_parse_number(count);
+	for(size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++)
+	{
+		bench_command(&bench_cases[i], count);
+	}
+	for(size_t i = 0; i < sizeof(tick_cases) / sizeof(tick_cases[0]); i++)
+	{
+		bench_tick(&tick_cases[i], count);
+	}
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Fuzz harness of the command parser and the command dispatch, built with the address and undefined behavior sanitizers.
+// Timer ticks run between the transactions, so the running commands consume the queue like on the board.
+// Usage: fuzz [<transactions> [<seed>]]
+// With clang, build with -fsanitize=fuzzer -DFUZZ_LIBFUZZER to run LLVMFuzzerTestOneInput() under libFuzzer instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "util.h"
+#include "twi.h"
+#include "tca.h"
+#include "motors.h"
+#include "host.h"
+
+#define FUZZ_TRANSACTIONS 200000 // Transactions run by default
+#define FUZZ_DRAIN_INTERVAL 64 // Transactions between two checks of the whole queue
+#define FUZZ_MESSAGE_SIZE (TWI_BUFFER_SIZE * 2) // Longer writes are cut by the board
+#define FUZZ_TICKS_MAX 64 // Most timer ticks between two transactions
+#define FUZZ_TICKS_LONG 4096 // Timer ticks between two transactions at each check of the whole queue
+
+// Queue state of motors.c, checked after every transaction
+extern uint16_t queue_head;
+extern uint16_t queue_tail;
+extern uint16_t queue_bytes;
+extern uint8_t command_queue[];
+
+static const char *keywords[] = {
+	"run", "move", "pvt", "gear", "jog", "tick", "status", "version", "pause", "resume", "reset", "session", "setaddr"
+};
+
+static const char *numbers[] = {
+	"0", "1", "127", "128", "255", "256", "16383", "16384", "65535", "65536", "20000", "4294967295", "4294967296",
+	"9999999999", "00000000000000000001", "429496729", "4294967290"
+};
+
+static const unsigned long max_values[] = {0xFFFFFFFFUL, 0xFFFF, TICK_RATE_MAX, 0xFF, 0x7F, 0};
+
+static unsigned int random_state = 1;
+
+static unsigned int next_random()
+{
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 8) & 0xFFFFFF;
+}
+
+/**
+* Prints the input that failed a check and stops
+*/
+static void fail(const char *message, const uint8_t *data, size_t length)
+{
+	fprintf(stderr, "FAILED: %s\nInput:", message);
+	for(size_t i = 0; i < length; i++)
+	{
+		fprintf(stderr, data[i] >= ' ' && data[i] < 0x7F ? "%c" : "\\x%02x", data[i]);
+	}
+	fprintf(stderr, "\n");
+	abort();
+}
+
+/**
+* Reference of parse_number(), written for clarity with 64-bit arithmetic.
+* Returns the characters consumed, 0 if the number is not valid.
+*/
+static size_t reference_parse_number(const char *text, unsigned long max_value, unsigned long *value)
+{
+	size_t digits = strspn(text, "0123456789");
+	unsigned long long result = 0;
+	if(digits == 0)
+	{
+		return 0;
+	}
+	for(size_t i = 0; i < digits; i++)
+	{
+		result = result * 10 + (text[i] - '0');
+		if(result > 0xFFFFFFFFULL)
+		{
+			return 0;
+		}
+	}
+	if(result > max_value || (text[digits] != '\0' && strchr(":;,", text[digits]) == NULL))
+	{
+		return 0;
+	}
+	*value = result;
+	return digits + strspn(text + digits, ":;,");
+}
+
+/**
+* Compares parse_number() with the reference on one text
+*/
+static void check_parse_number(const char *text, unsigned long max_value)
+{
+	char buffer[FUZZ_MESSAGE_SIZE];
+	unsigned long value = 0;
+	unsigned long expected = 0;
+	strcpy(buffer, text);
+
+	char *cursor = buffer;
+	uint8_t is_parsed = parse_number(&cursor, max_value, &value);
+	size_t consumed = reference_parse_number(text, max_value, &expected);
+	if(is_parsed != (consumed > 0) || (is_parsed && (value != expected || (size_t)(cursor - buffer) != consumed))
+		|| (!is_parsed && cursor != buffer))
+	{
+		fail("parse_number() differs from the reference", (const uint8_t*)text, strlen(text));
+	}
+}
+
+/**
+* Appends a random piece of a command: a keyword, a number, a device, a delimiter or any byte
+*/
+static size_t append_token(char *command, size_t length, size_t size)
+{
+	char token[24];
+	switch(next_random() % 8)
+	{
+		case 0: strcpy(token, keywords[next_random() % (sizeof(keywords) / sizeof(keywords[0]))]); break;
+		case 1: strcpy(token, numbers[next_random() % (sizeof(numbers) / sizeof(numbers[0]))]); break;
+		case 2: sprintf(token, "%u", next_random() % (1 + (next_random() % 3 == 0 ? 0xFFFFFF : 300))); break;
+		case 3: sprintf(token, "%c", "ABCDabcdEe@"[next_random() % 11]); break;
+		case 4: sprintf(token, "%c", ":;,:"[next_random() % 4]); break;
+		case 5: sprintf(token, "%c", "+-/"[next_random() % 3]); break;
+		case 6: sprintf(token, "%c", (char)(1 + next_random() % 255)); break;
+		default: sprintf(token, "%c%u,%u", "ABCD"[next_random() % 4], next_random() % 500, next_random() % 300); break;
+	}
+	size_t token_length = strlen(token);
+	if(length + token_length + 1 > size)
+	{
+		return length;
+	}
+	memcpy(command + length, token, token_length + 1);
+	return length + token_length;
+}
+
+/**
+* Builds a random command, mostly well formed with random values, then mutates some bytes
+*/
+static size_t random_command(char *command, size_t size)
+{
+	size_t length = 0;
+	command[0] = '\0';
+	if(next_random() % 8 == 0)
+	{
+		length = sprintf(command, "@%u:", next_random() % 70000);
+	}
+	length += sprintf(command + length, "%s", keywords[next_random() % (sizeof(keywords) / sizeof(keywords[0]))]);
+	for(unsigned int tokens = next_random() % 14; tokens > 0; tokens--)
+	{
+		if(next_random() % 3 != 0)
+		{
+			length = append_token(command, length, size);
+		}
+		length = append_token(command, length, size);
+	}
+
+	for(unsigned int mutations = next_random() % 4 == 0 ? next_random() % 3 + 1 : 0; mutations > 0 && length > 0; mutations--)
+	{
+		size_t position = next_random() % length;
+		switch(next_random() % 3)
+		{
+			case 0: command[position] = (char)(1 + next_random() % 255); break;
+			case 1: memmove(command + position, command + position + 1, length - position); length--; break;
+			default:
+				if(length + 2 < size)
+				{
+					memmove(command + position + 1, command + position, length - position + 1);
+					command[position] = (char)(1 + next_random() % 255);
+					length++;
+				}
+				break;
+		}
+	}
+	return length;
+}
+
+/**
+* Checks the response and the queue after a transaction
+*/
+static void check_state(const uint8_t *data, size_t length)
+{
+	char response[TWI_BUFFER_SIZE];
+	host_read(response, TWI_BUFFER_SIZE);
+	if(memchr(write_buffer, '\0', TWI_BUFFER_SIZE) == NULL || memchr(response, '\0', TWI_BUFFER_SIZE) == NULL)
+	{
+		fail("response is not null terminated", data, length);
+	}
+	if(queue_bytes > COMMAND_QUEUE_SRAM_BUDGET || queued_commands > COMMAND_BUFFER_SIZE
+		|| queued_pvt_commands > queued_commands || queue_head >= COMMAND_QUEUE_SRAM_BUDGET
+		|| queue_tail >= COMMAND_QUEUE_SRAM_BUDGET
+		|| (queue_head + queue_bytes) % COMMAND_QUEUE_SRAM_BUDGET != queue_tail
+		|| (queued_commands == 0) != (queue_bytes == 0))
+	{
+		fail("queue state is not consistent", data, length);
+	}
+	if(move_device_id > MOTOR_DEVICES || (gear_mask & jog_mask) || (gear_mask >> MOTOR_DEVICES) || (jog_mask >> MOTOR_DEVICES))
+	{
+		fail("motion state is not consistent", data, length);
+	}
+}
+
+/**
+* Runs timer ticks like the timer interrupt, a command is loaded on the tick its previous command finished
+*/
+static void run_ticks(uint32_t ticks, const uint8_t *data, size_t length)
+{
+	for(uint32_t tick = 0; tick < ticks; tick++)
+	{
+		uint8_t is_running = !is_switch_activated && !is_paused && move_device_id == MOTOR_DEVICES;
+		motors_tick();
+		if(is_running && !is_active_command_running() && queued_commands > 0 && queue_bytes > 0
+			&& command_queue[queue_head] != PVT_COMMAND_MARKER)
+		{
+			// Queued run commands always have steps, the next one must be loaded at once
+			fail("a queued command was not loaded after the running one finished", data, length);
+		}
+	}
+}
+
+/**
+* Loads every queued command, the queue must be empty once the last one was loaded
+*/
+static void check_drain(const uint8_t *data, size_t length)
+{
+	while(load_next_command())
+	{
+	}
+	if(queue_bytes != 0 || queue_head != queue_tail || queued_pvt_commands != 0)
+	{
+		fail("queued commands don't add up to the queue bytes", data, length);
+	}
+	clear_command_buffer();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t length)
+{
+	static uint8_t is_initialized = 0;
+	static uint32_t transactions = 0;
+	if(!is_initialized)
+	{
+		host_init();
+		is_initialized = 1;
+	}
+
+	host_write(data, length);
+	if(transactions % 2 == 0)
+	{
+		host_loop(); // Otherwise the read runs it, with the clock stretched
+	}
+	check_state(data, length);
+	uint32_t ticks = length;
+	for(size_t i = 0; i < length; i++)
+	{
+		ticks += data[i];
+	}
+	run_ticks(++transactions % FUZZ_DRAIN_INTERVAL == 0 ? FUZZ_TICKS_LONG : ticks % FUZZ_TICKS_MAX, data, length);
+	check_state(data, length);
+	if(transactions % FUZZ_DRAIN_INTERVAL == 0)
+	{
+		check_drain(data, length);
+	}
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+int main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : FUZZ_TRANSACTIONS;
+	random_state = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+	char message[FUZZ_MESSAGE_SIZE];
+	char command[TWI_BUFFER_SIZE + 16];
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		// parse_number() on a random number, usually followed by a delimiter
+		size_t length = append_token(command, 0, sizeof(command));
+		for(unsigned int tokens = next_random() % 3; tokens > 0; tokens--)
+		{
+			length = append_token(command, length, sizeof(command));
+		}
+		check_parse_number(command, max_values[next_random() % (sizeof(max_values) / sizeof(max_values[0]))]);
+
+		// One write with several commands, sometimes more than the board processes or longer than its buffer
+		size_t message_length = 0;
+		for(unsigned int commands = 1 + next_random() % (next_random() % 16 == 0 ? 20 : 4); commands > 0; commands--)
+		{
+			length = random_command(command, sizeof(command));
+			if(message_length + length + 1 > sizeof(message))
+			{
+				break;
+			}
+			memcpy(message + message_length, command, length + 1);
+			message_length += length + 1;
+		}
+		LLVMFuzzerTestOneInput((const uint8_t*)message, message_length);
+	}
+
+	printf("%u transactions, no failures\n", count);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <time.h>
+#include "twi.h"
+#include "tca.h"
+#include "motors.h"
+#include "host.h"
+
+VPORT_t VPORTA;
+VPORT_t VPORTB;
+VPORT_t VPORTC;
+TCA_t TCA0;
+TWI_t TWI0;
+
+uint8_t eeprom_read_byte(const uint8_t *address)
+{
+	return *address;
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value)
+{
+	*address = value;
+}
+
+uint16_t eeprom_read_word(const uint16_t *address)
+{
+	return *address;
+}
+
+void eeprom_update_word(uint16_t *address, uint16_t value)
+{
+	*address = value;
+}
+
+/**
+* Starts the firmware like main() does, without limit switches activated
+*/
+void host_init()
+{
+	VPORTB.IN = LIMIT_SWITCHES_gm;
+	TWI0_init(eeprom_read_byte(&eeprom_twi_address));
+	motors_init();
+	TCA0_init(eeprom_read_word(&eeprom_tick_rate));
+	clear_command_buffer();
+}
+
+/**
+* Runs the work of the main loop once, like main() does between the interrupts
+*/
+void host_loop()
+{
+	TWI0_format_status();
+	TCA0_save_tick_rate();
+}
+
+/**
+* Runs the TWI interrupt handler with the given status and data registers.
+* A disabled interrupt stays pending with the clock stretched, the main loop runs until it enables the interrupt.
+*/
+static void host_interrupt(uint8_t status, uint8_t data)
+{
+	uint8_t enable_mask = status & TWI_DIF_bm ? TWI_DIEN_bm : TWI_APIEN_bm;
+	for(uint8_t attempt = 0; attempt < 2; attempt++)
+	{
+		if(!(TWI0.SCTRLA & enable_mask))
+		{
+			host_loop();
+		}
+		TWI0.SSTATUS = status;
+		TWI0.SDATA = data;
+		TWI0_process_interrupt();
+		if(TWI0.SCTRLA & enable_mask)
+		{
+			return; // Handled
+		}
+	}
+}
+
+/**
+* Writes the bytes to the board in one transaction, the commands are null terminated
+*/
+void host_write(const uint8_t *data, size_t length)
+{
+	host_interrupt(TWI_APIF_bm | TWI_AP_bm, 0); // Address match, the master writes
+	for(size_t i = 0; i < length; i++)
+	{
+		host_interrupt(TWI_DIF_bm, data[i]);
+	}
+	host_interrupt(TWI_APIF_bm, 0); // Stop
+}
+
+/**
+* Reads the response in one transaction, returns the bytes read
+*/
+size_t host_read(char *response, size_t length)
+{
+	host_interrupt(TWI_APIF_bm | TWI_AP_bm | TWI_DIR_bm, 0); // Address match, the master reads
+	for(size_t i = 0; i < length; i++)
+	{
+		host_interrupt(TWI_DIF_bm | TWI_DIR_bm, 0);
+		response[i] = TWI0.SDATA;
+	}
+	host_interrupt(TWI_APIF_bm, 0); // Stop
+	return length;
+}
+
+/**
+* Returns a monotonic time in nanoseconds
+*/
+uint64_t host_time_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
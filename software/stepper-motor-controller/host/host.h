@@ -0,0 +1,25 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The firmware sources are built for the host with the register stand-ins of the avr/ folder.
+// Transactions are driven through the TWI interrupt handler one byte at a time, like the I2C master does.
+
+extern void host_init();
+extern void host_loop();
+extern void host_write(const uint8_t *data, size_t length);
+extern size_t host_read(char *response, size_t length);
+extern uint64_t host_time_ns();
+
+#endif /* HOST_H_ */
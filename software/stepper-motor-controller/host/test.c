@@ -0,0 +1,204 @@
+/*
+* Copyright (c) 2023, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Behavior tests of the firmware on the host, each test starts from a fresh board.
+// Usage: test
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include "util.h"
+#include "twi.h"
+#include "tca.h"
+#include "motors.h"
+#include "host.h"
+
+#define TEST_TICKS_MAX 1000 // Ticks a test runs at most
+
+static int failures = 0;
+
+/**
+* Reports a failed check
+*/
+static void check(int condition, const char *test, const char *message)
+{
+	if(!condition)
+	{
+		printf("FAILED %s: %s\n", test, message);
+		failures++;
+	}
+}
+
+/**
+* Starts a fresh board, like after power-up
+*/
+static void reset_board()
+{
+	host_init();
+	clear_command_buffer();
+	move_device_id = MOTOR_DEVICES;
+	is_paused = 0;
+	is_switch_activated = 0;
+	gear_mask = 0;
+	jog_mask = 0;
+	memset(step_counts, 0, sizeof(step_counts[0]) * MOTOR_DEVICES);
+}
+
+/**
+* Writes the null terminated commands in one transaction and reads the response
+*/
+static void transfer(const char *commands, size_t length, char *response)
+{
+	host_write((const uint8_t*)commands, length);
+	host_loop();
+	host_read(response, TWI_BUFFER_SIZE);
+}
+
+/**
+* Commands queued back to back keep the step spacing across the junctions: the next command is loaded on the tick
+* the last step of the running one was made, so the first toggle of the next command comes after its own speed
+* in ticks, like every toggle within a command.
+*/
+static void test_junction_spacing()
+{
+	const char *test = "junction spacing";
+	const char commands[] = "run:A3,2:B2,5\0run:A2,2\0run:A-2,3:B1,4";
+	// Ticks between a toggle and the previous toggle of the same device, by the command of the toggle
+	const uint8_t speeds[][2] = {{2, 5}, {2, 0}, {3, 4}};
+	const uint8_t toggles[][2] = {{5, 3}, {4, 0}, {4, 2}}; // A and B start high, then A is low after each command
+	char response[TWI_BUFFER_SIZE];
+	uint32_t last_toggles[2] = {0, 0};
+	uint8_t outputs[2];
+	uint8_t command = 0;
+	uint8_t command_toggles[2] = {0, 0};
+	uint32_t tick;
+
+	reset_board();
+	transfer(commands, sizeof(commands), response);
+	check(strcmp(response, RESPONSE_MULTI_PREFIX "000") == 0, test, "commands not queued");
+	outputs[0] = VPORTC.OUT & MOTOR0_STEP_bm;
+	outputs[1] = VPORTC.OUT & MOTOR1_STEP_bm;
+	motors_tick(); // Loads the first command
+	last_toggles[0] = last_toggles[1] = tick_counter;
+
+	for(tick = 0; tick < TEST_TICKS_MAX && command < 3; tick++)
+	{
+		motors_tick();
+		uint8_t now[2] = {VPORTC.OUT & MOTOR0_STEP_bm, VPORTC.OUT & MOTOR1_STEP_bm};
+		for(uint8_t device_id = 0; device_id < 2; device_id++)
+		{
+			if(now[device_id] != outputs[device_id])
+			{
+				check(tick_counter - last_toggles[device_id] == speeds[command][device_id], test, "a toggle is not spaced by the speed");
+				last_toggles[device_id] = tick_counter;
+				outputs[device_id] = now[device_id];
+				command_toggles[device_id]++;
+			}
+		}
+		if(command_toggles[0] == toggles[command][0] && command_toggles[1] == toggles[command][1])
+		{
+			// The next command is loaded on the tick of the last step, its devices count their spacing from this tick
+			check(command == 2 || is_active_command_running(), test, "the next command was not loaded at the junction");
+			command++;
+			command_toggles[0] = command_toggles[1] = 0;
+			last_toggles[0] = last_toggles[1] = tick_counter;
+		}
+	}
+	check(command == 3, test, "the commands did not finish");
+	check(step_counts[0] == 7 && step_counts[1] == 3, test, "steps are not counted");
+}
+
+/**
+* The tick command changes the rate at once and the main loop saves it, the EEPROM write never runs in the interrupt
+*/
+static void test_tick_rate_saved()
+{
+	const char *test = "tick rate saved";
+	const char command[] = "tick:1000";
+	char response[TWI_BUFFER_SIZE];
+
+	reset_board();
+	eeprom_tick_rate = TICK_RATE_DEFAULT;
+	host_write((const uint8_t*)command, sizeof(command));
+	check(tick_rate == 1000 && eeprom_tick_rate == TICK_RATE_DEFAULT, test, "the rate was saved in the interrupt");
+	host_loop();
+	host_read(response, TWI_BUFFER_SIZE);
+	check(strcmp(response, RESPONSE_OK) == 0 && eeprom_tick_rate == 1000, test, "the rate was not saved by the main loop");
+	TCA0_set_tick_rate(TICK_RATE_DEFAULT);
+	eeprom_tick_rate = TICK_RATE_DEFAULT;
+}
+
+/**
+* A second batch session numbers its commands from 1 again, after a reset or a session command the board queues them
+* instead of acknowledging them as retries of the first session
+*/
+static void test_second_session()
+{
+	const char *test = "second session";
+	const char first[] = "@1:run:A100,5\0@2:run:A100,5";
+	const char second[] = "@1:run:A200,5\0@2:run:B300,5";
+	const char *starts[] = {"reset", "session"};
+	const char *acks[] = {RESPONSE_MULTI_PREFIX "00" RESPONSE_ACK "2,2", RESPONSE_MULTI_PREFIX "00" RESPONSE_ACK "2,4"};
+	char response[TWI_BUFFER_SIZE];
+
+	for(size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++)
+	{
+		// No ticks run, the commands stay queued
+		reset_board();
+		transfer(first, sizeof(first), response);
+		check(strcmp(response, acks[0]) == 0, test, "the first session was not queued");
+		transfer(starts[i], strlen(starts[i]) + 1, response);
+		check(strcmp(response, RESPONSE_OK) == 0, test, starts[i]);
+		// The reset clears the queue, the session command keeps it
+		transfer(second, sizeof(second), response);
+		check(strcmp(response, acks[i]) == 0, test, "the second session was acknowledged without queuing");
+		transfer(second, sizeof(second), response);
+		check(strcmp(response, acks[i]) == 0, test, "a retried command of the second session was queued again");
+	}
+}
+
+/**
+* The status command copies the values in the interrupt and the main loop formats them, a read before the main loop
+* ran waits for the response. The values belong to the tick of the command, the acknowledgement follows them.
+*/
+static void test_status_snapshot()
+{
+	const char *test = "status snapshot";
+	const char run[] = "run:A-5,3\0run:B7,2";
+	const char status[] = "@7:status";
+	const char status_version[] = "status\0version";
+	char expected[TWI_BUFFER_SIZE];
+	char response[TWI_BUFFER_SIZE];
+
+	reset_board();
+	transfer(run, sizeof(run), response);
+	for(uint8_t tick = 0; tick < 4; tick++)
+	{
+		motors_tick(); // Loads the first command and makes its first step
+	}
+	snprintf(expected, sizeof(expected), "\nRUN\nA:-4,3\nB:0,0\nC:0,0\nD:0,0\nSW:NONE\nBUFF:2/%u\nTICK:%u\nCLK:%lu\nCNT:1,0,0,0"
+		RESPONSE_ACK "7,2", get_queue_capacity(), tick_rate, (unsigned long)tick_counter);
+	host_write((const uint8_t*)status, sizeof(status));
+	check(write_buffer[0] == '\0', test, "the status was formatted in the interrupt");
+	motors_tick();
+	host_read(response, TWI_BUFFER_SIZE); // Runs the main loop while the clock is stretched
+	check(strcmp(response, expected) == 0, test, "the response differs from the values at the command");
+	
+	transfer(status_version, sizeof(status_version), response);
+	check(strcmp(response, RESPONSE_MULTI_PREFIX "00") == 0, test, "a later command did not replace the status");
+}
+
+int main()
+{
+	test_junction_spacing();
+	test_tick_rate_saved();
+	test_second_session();
+	test_status_snapshot();
+	printf("%d failed\n", failures);
+	return failures > 0;
+}
@@ -10,11 +10,64 @@
 #ifndef MOTORS_H_
 #define MOTORS_H_
 
+#ifndef MOTOR_DEVICES
 #define MOTOR_DEVICES 4
-#define COMMAND_BUFFER_SIZE 10
+#endif
 
-extern uint8_t head;
-extern uint8_t tail;
+#if MOTOR_DEVICES < 1 || MOTOR_DEVICES > 4
+#error "MOTOR_DEVICES must be between 1 and 4"
+#endif
+
+// Queued commands are packed in a byte ring buffer, only the devices with steps are stored.
+// Command format: header byte with the device mask in the low nibble and the directions in the high nibble,
+// followed by the steps (32-bit) and speed (16-bit) of each device in the mask.
+// Steps and speeds are stored in 7-bit groups from the least significant one, the high bit of a byte is set
+// when another byte follows, so a device with steps up to 16383 and a speed up to 127 takes three bytes.
+#ifndef COMMAND_QUEUE_SRAM_BUDGET
+#define COMMAND_QUEUE_SRAM_BUDGET 270 // Bytes of SRAM reserved for queued commands, see SRAM_STACK_RESERVE
+#endif
+#define QUEUED_STEPS_MAX_SIZE 5
+#define QUEUED_SPEED_MAX_SIZE 3
+#define QUEUED_COMMAND_MIN_SIZE 3 // One device with steps and speed up to 127
+#define QUEUED_COMMAND_MAX_SIZE (1 + (QUEUED_STEPS_MAX_SIZE + QUEUED_SPEED_MAX_SIZE) * MOTOR_DEVICES)
+#define COMMAND_BUFFER_SIZE (COMMAND_QUEUE_SRAM_BUDGET / QUEUED_COMMAND_MIN_SIZE) // Maximum queued commands
+
+// PVT commands start with a zero marker byte, followed by the header byte, the duration in ticks (16-bit),
+// and the steps (16-bit) and rate change per tick (32-bit) of each device in the mask
+#define PVT_COMMAND_MARKER 0x00
+#define PVT_DEVICE_SIZE 6
+#define PVT_COMMAND_MAX_SIZE (4 + PVT_DEVICE_SIZE * MOTOR_DEVICES)
+
+// PVT step rates are step pin toggles per tick in 8.24 fixed point
+#define PVT_RATE_ONE 0x1000000UL // One toggle per tick, the fastest rate
+#define PVT_RATE_FINISH (PVT_RATE_ONE / 64) // Lowest rate to finish the steps left after the knot duration
+
+#if COMMAND_QUEUE_SRAM_BUDGET < PVT_COMMAND_MAX_SIZE || COMMAND_BUFFER_SIZE > 255
+#error "COMMAND_QUEUE_SRAM_BUDGET does not fit the command queue"
+#endif
+
+// Pin map of the motor drivers, step and direction pins are accessed through the virtual ports
+#define MOTOR0_VPORT VPORTC
+#define MOTOR0_STEP_bm PIN0_bm
+#define MOTOR0_DIR_bm PIN1_bm
+#define MOTOR1_VPORT VPORTC
+#define MOTOR1_STEP_bm PIN2_bm
+#define MOTOR1_DIR_bm PIN3_bm
+#define MOTOR2_VPORT VPORTA
+#define MOTOR2_STEP_bm PIN4_bm
+#define MOTOR2_DIR_bm PIN5_bm
+#define MOTOR3_VPORT VPORTA
+#define MOTOR3_STEP_bm PIN6_bm
+#define MOTOR3_DIR_bm PIN7_bm
+
+// Limit switch inputs on PORTB, all pins are high when no switch is activated
+#define LIMIT_SWITCHES_gm (PIN2_bm | PIN3_bm | PIN4_bm | PIN5_bm)
+
+// Toggles the step pin, writing one to the input register toggles the output.
+// The host build replaces it, its registers are plain memory.
+#ifndef TOGGLE_STEP_PIN
+#define TOGGLE_STEP_PIN(vport, step_mask) ((vport)->IN = (step_mask))
+#endif
 
 typedef struct
 {
@@ -24,14 +77,17 @@ typedef struct
 	uint16_t counter;
 } RunCommand;
 
-extern RunCommand runCommnadsBufferA[];
-extern RunCommand runCommnadsBufferB[];
-extern RunCommand runCommnadsBufferC[];
-extern RunCommand runCommnadsBufferD[];
+extern RunCommand active_commands[];
+extern uint8_t queued_commands;
+extern uint8_t queued_pvt_commands;
 
-extern PORT_t* device_ports[];
-extern uint8_t device_step_masks[];
-extern uint8_t device_dir_masks[];
+extern uint8_t is_pvt_active;
+extern uint16_t pvt_ticks;
+extern int32_t pvt_rates[];
+extern int32_t pvt_rate_deltas[];
+extern uint32_t pvt_phases[];
+
+extern uint8_t device_dirs[];
 
 extern uint8_t is_switch_activated;
 extern uint8_t is_paused;
@@ -39,9 +95,385 @@ extern uint8_t is_paused;
 extern RunCommand moveCommand;
 extern uint8_t move_device_id;
 
+extern uint32_t tick_counter;
+extern uint16_t step_counts[];
+
+// Electronic gearing, a follower device is stepped from the step pin toggles of its leader
+#define GEAR_RATIO_MAX 255 // Largest numerator and denominator of a gear ratio
+
+extern uint8_t gear_mask;
+extern uint8_t gear_inverts;
+extern uint8_t gear_leaders[];
+extern uint8_t gear_numerators[];
+extern uint8_t gear_denominators[];
+extern uint8_t gear_errors[];
+extern uint8_t step_toggle_mask;
+
+// Continuous velocity mode, a jogging device steps until it is stopped, without queue slots
+#define JOG_ACCELERATION_DEFAULT 1000 // Steps per second squared, when the jog command has no acceleration
+
+typedef struct
+{
+	int32_t rate; // Current step rate in PVT rate units, negative counter clockwise
+	int32_t target; // Step rate the device ramps to
+	int32_t acceleration; // Step rate change per tick
+	uint32_t phase; // Step phase accumulator
+} JogState;
+
+extern uint8_t jog_mask;
+extern JogState jog_states[];
+
+// Static SRAM of the motors.c variables, checked against the device SRAM in main.c
+#define MOTORS_SRAM_SIZE (COMMAND_QUEUE_SRAM_BUDGET + 23 + (MOTOR_DEVICES + 1) * sizeof(RunCommand) \
+	+ MOTOR_DEVICES * (5 + sizeof(uint16_t) + 4 * sizeof(int32_t) + sizeof(JogState)))
+
+// Motion state modes, formatted by the status command
+#define MOTION_RUN 0
+#define MOTION_PAUSED 1
+#define MOTION_PVT 2
+#define MOTION_MOVE 3
+
+extern void motors_init();
 extern void clear_command_struct(RunCommand* run_command);
 extern void clear_command_buffer();
 extern void run_command_on_device(RunCommand* run_command, uint8_t device_id);
-extern uint8_t is_buffer_command_available(uint8_t index);
+extern uint8_t push_command(RunCommand* commands);
+extern uint8_t push_pvt_command(RunCommand* knots, uint16_t duration);
+extern uint8_t load_next_command();
+extern uint8_t rescale_command_speeds(uint16_t from_rate, uint16_t to_rate);
+extern uint8_t get_queue_capacity();
+extern uint8_t get_motion_mode();
+extern uint8_t set_gear(uint8_t follower_id, uint8_t leader_id, uint8_t numerator, uint8_t denominator, uint8_t is_inverted);
+extern void clear_gear(uint8_t follower_id);
+extern uint8_t set_jog(uint8_t device_id, uint8_t dir, uint16_t velocity, uint16_t acceleration);
+extern uint16_t rate_to_velocity(int32_t rate);
+
+/**
+* Helper function to check if the active command has steps to be executed.
+* Always inlined, the timer interrupt checks it on every tick.
+*/
+static inline __attribute__((always_inline)) uint8_t is_active_command_running()
+{
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if(active_commands[device_id].steps > 0) {
+			return 1;
+		}
+	}
+	return pvt_ticks > 0; // PVT knot duration not finished yet
+}
+
+/**
+* Sets the direction pin of a device, only when it changes.
+*/
+static inline __attribute__((always_inline)) void set_dir_pin(uint8_t dir, const uint8_t device_id,
+	VPORT_t* vport, const uint8_t dir_mask)
+{
+	if(dir != device_dirs[device_id])
+	{
+		if(dir)
+		{
+			vport->OUT |= dir_mask;
+		}
+		else
+		{
+			vport->OUT &= ~dir_mask;
+		}
+		device_dirs[device_id] = dir;
+	}
+}
+
+/**
+* Counts a step of a device after its step pin toggled, on the falling edge.
+* Returns 1 if the toggle was a step.
+*/
+static inline __attribute__((always_inline)) uint8_t count_step(const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask)
+{
+	if(vport->OUT & step_mask)
+	{
+		return 0;
+	}
+	step_counts[device_id]++;
+	return 1;
+}
+
+/**
+* Toggles the step pin of a device, counting a step on the falling edge.
+* Always inlined with constant pins, so the port accesses compile to single bit instructions.
+*/
+static inline __attribute__((always_inline)) void toggle_step_pin(RunCommand* run_command, const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask, const uint8_t dir_mask)
+{
+	set_dir_pin(run_command->dir, device_id, vport, dir_mask);
+	TOGGLE_STEP_PIN(vport, step_mask);
+	step_toggle_mask |= 1 << device_id; // Followers of the device step from this toggle
+	if(count_step(device_id, vport, step_mask)) {
+		run_command->steps--;
+	}
+}
+
+/**
+* Runs one tick of the command on a device.
+*/
+static inline __attribute__((always_inline)) void run_command_on_pins(RunCommand* run_command, const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask, const uint8_t dir_mask)
+{
+	// Skip if no steps to run
+	if(run_command->steps == 0) {
+		return;
+	}
+
+	run_command->counter++;
+
+	if(run_command->counter >= run_command->speed) {
+
+		toggle_step_pin(run_command, device_id, vport, step_mask, dir_mask);
+		run_command->counter = 0;
+	}
+}
+
+/**
+* Runs one tick of a PVT knot on a device.
+* The step rate changes linearly during the knot duration, then stays at the end rate until the knot steps are done.
+*/
+static inline __attribute__((always_inline)) void run_pvt_on_pins(RunCommand* run_command, const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask, const uint8_t dir_mask)
+{
+	// The rate follows the knot even without steps left, the next knot starts from the end rate
+	int32_t rate = pvt_rates[device_id];
+	if(pvt_ticks > 0)
+	{
+		rate += pvt_rate_deltas[device_id];
+		if(rate < 0)
+		{
+			rate = 0;
+		}
+		else if(rate > (int32_t)PVT_RATE_ONE)
+		{
+			rate = PVT_RATE_ONE;
+		}
+		pvt_rates[device_id] = rate;
+	}
+	else if(rate < (int32_t)PVT_RATE_FINISH)
+	{
+		// Knot duration is over with steps left, finish them instead of stalling
+		rate = PVT_RATE_FINISH;
+	}
+
+	// Skip if no steps to run
+	if(run_command->steps == 0) {
+		return;
+	}
+
+	pvt_phases[device_id] += rate;
+	if(pvt_phases[device_id] >= PVT_RATE_ONE) {
+		pvt_phases[device_id] -= PVT_RATE_ONE;
+		toggle_step_pin(run_command, device_id, vport, step_mask, dir_mask);
+	}
+}
+
+/**
+* Runs one tick of a geared follower device.
+* The error accumulator adds the numerator on each toggle of the leader step pin and the follower toggles
+* whenever it reaches the denominator, so the follower keeps the exact ratio to the leader position.
+*/
+static inline __attribute__((always_inline)) void run_gear_on_pins(const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask, const uint8_t dir_mask)
+{
+	const uint8_t leader_id = gear_leaders[device_id];
+	if(!(gear_mask & (1 << device_id)) || !(step_toggle_mask & (1 << leader_id)))
+	{
+		return;
+	}
+	
+	// The numerator is not larger than the denominator, the follower toggles at most once per leader toggle
+	uint16_t error = gear_errors[device_id] + gear_numerators[device_id];
+	if(error >= gear_denominators[device_id])
+	{
+		error -= gear_denominators[device_id];
+		set_dir_pin(device_dirs[leader_id] ^ ((gear_inverts >> device_id) & 1), device_id, vport, dir_mask);
+		TOGGLE_STEP_PIN(vport, step_mask);
+		count_step(device_id, vport, step_mask);
+	}
+	gear_errors[device_id] = error;
+}
+
+/**
+* Runs one tick of a jogging device.
+* The step rate ramps to the target by the acceleration on each tick, through standstill when the direction changes.
+* The device is released once it stopped with a zero target.
+*/
+static inline __attribute__((always_inline)) void run_jog_on_pins(const uint8_t device_id,
+	VPORT_t* vport, const uint8_t step_mask, const uint8_t dir_mask)
+{
+	const uint8_t device_mask = 1 << device_id;
+	if(!(jog_mask & device_mask))
+	{
+		return;
+	}
+	
+	JogState* jog = &jog_states[device_id];
+	int32_t rate = jog->rate;
+	if(rate < jog->target)
+	{
+		rate += jog->acceleration;
+		if(rate > jog->target)
+		{
+			rate = jog->target;
+		}
+	}
+	else if(rate > jog->target)
+	{
+		rate -= jog->acceleration;
+		if(rate < jog->target)
+		{
+			rate = jog->target;
+		}
+	}
+	jog->rate = rate;
+	
+	if(rate == 0)
+	{
+		if(jog->target == 0)
+		{
+			jog_mask &= ~device_mask;
+		}
+		return;
+	}
+	
+	jog->phase += rate > 0 ? rate : -rate;
+	if(jog->phase >= PVT_RATE_ONE) {
+		jog->phase -= PVT_RATE_ONE;
+		set_dir_pin(rate > 0, device_id, vport, dir_mask);
+		TOGGLE_STEP_PIN(vport, step_mask);
+		step_toggle_mask |= device_mask; // Followers of the device step from this toggle
+		count_step(device_id, vport, step_mask);
+	}
+}
+
+// Runs one tick of the command on the device with the given constant id
+#define RUN_DEVICE(run_command, id) \
+	run_command_on_pins((run_command), id, &MOTOR##id##_VPORT, MOTOR##id##_STEP_bm, MOTOR##id##_DIR_bm)
+
+// Runs one tick of the PVT knot on the device with the given constant id
+#define RUN_PVT_DEVICE(run_command, id) \
+	run_pvt_on_pins((run_command), id, &MOTOR##id##_VPORT, MOTOR##id##_STEP_bm, MOTOR##id##_DIR_bm)
+
+// Runs one tick of the jogging device with the given constant id
+#define RUN_JOG_DEVICE(id) \
+	run_jog_on_pins(id, &MOTOR##id##_VPORT, MOTOR##id##_STEP_bm, MOTOR##id##_DIR_bm)
+
+// Runs one tick of the geared follower with the given constant id
+#define RUN_GEAR_DEVICE(id) \
+	run_gear_on_pins(id, &MOTOR##id##_VPORT, MOTOR##id##_STEP_bm, MOTOR##id##_DIR_bm)
+
+/**
+* Runs one timer tick: the queued commands or the move command, then the jogging devices and the geared followers,
+* and stops on a limit switch. Always inlined in the timer interrupt, the host harness calls it between transactions.
+*/
+static inline __attribute__((always_inline)) void motors_tick()
+{
+	tick_counter++;
+	step_toggle_mask = 0;
+	
+	if(!is_switch_activated && !is_paused && move_device_id == MOTOR_DEVICES) {
+		// No switch is activated, commands are not paused, and no override move command, run commands from the buffer
+		// Unrolled for the configured devices, each call is specialized for the device pins
+		if(is_pvt_active)
+		{
+			RUN_PVT_DEVICE(&active_commands[0], 0);
+#if MOTOR_DEVICES > 1
+			RUN_PVT_DEVICE(&active_commands[1], 1);
+#endif
+#if MOTOR_DEVICES > 2
+			RUN_PVT_DEVICE(&active_commands[2], 2);
+#endif
+#if MOTOR_DEVICES > 3
+			RUN_PVT_DEVICE(&active_commands[3], 3);
+#endif
+			if(pvt_ticks > 0)
+			{
+				pvt_ticks--;
+			}
+		}
+		else
+		{
+			RUN_DEVICE(&active_commands[0], 0);
+#if MOTOR_DEVICES > 1
+			RUN_DEVICE(&active_commands[1], 1);
+#endif
+#if MOTOR_DEVICES > 2
+			RUN_DEVICE(&active_commands[2], 2);
+#endif
+#if MOTOR_DEVICES > 3
+			RUN_DEVICE(&active_commands[3], 3);
+#endif
+		}
+		
+		if(!is_active_command_running()) {
+			// Move to the next command if available
+			if(!load_next_command())
+			{
+				// Buffer ran empty, all devices stop
+				is_pvt_active = 0;
+			}
+		}
+	}
+	else if (move_device_id < MOTOR_DEVICES && moveCommand.steps > 0)
+	{
+		// Execute move command, takes precedence over commands in the buffer
+		run_command_on_device(&moveCommand, move_device_id);
+	}
+	else if (move_device_id < MOTOR_DEVICES && moveCommand.steps == 0)
+	{
+		// Reset move command
+		clear_command_struct(&moveCommand);
+		move_device_id = MOTOR_DEVICES;
+		// Update if any switches are activated
+		is_switch_activated = (VPORTB.IN & LIMIT_SWITCHES_gm) != LIMIT_SWITCHES_gm;
+		// Pause running commands, user must send resume command
+		is_paused = 1;
+	}
+	
+	if(is_switch_activated)
+	{
+		// Jogging devices stop at once on a limit switch
+		jog_mask = 0;
+	}
+	else if(jog_mask)
+	{
+		RUN_JOG_DEVICE(0);
+#if MOTOR_DEVICES > 1
+		RUN_JOG_DEVICE(1);
+#endif
+#if MOTOR_DEVICES > 2
+		RUN_JOG_DEVICE(2);
+#endif
+#if MOTOR_DEVICES > 3
+		RUN_JOG_DEVICE(3);
+#endif
+	}
+	
+	if(gear_mask)
+	{
+		// Followers step from the toggles of their leaders in this tick
+		RUN_GEAR_DEVICE(0);
+#if MOTOR_DEVICES > 1
+		RUN_GEAR_DEVICE(1);
+#endif
+#if MOTOR_DEVICES > 2
+		RUN_GEAR_DEVICE(2);
+#endif
+#if MOTOR_DEVICES > 3
+		RUN_GEAR_DEVICE(3);
+#endif
+	}
+	
+	// Stop if any of the limit switches are activated
+	if((VPORTB.IN & LIMIT_SWITCHES_gm) != LIMIT_SWITCHES_gm)
+	{
+		is_switch_activated = 1;
+	}
+}
 
 #endif /* MOTORS_H_ */
\ No newline at end of file
@@ -10,8 +10,27 @@
 #ifndef TCA_H_
 #define TCA_H_
 
+#include <avr/eeprom.h>
+
+#ifndef F_CPU
+#define F_CPU 3333333UL // Default main clock, 20 MHz oscillator divided by 6
+#endif
+
+#define TICK_RATE_DEFAULT 3333 // Timer ticks per second, period of 1000 without pre-scaler
+#define TICK_RATE_MIN 50
+#define TICK_RATE_MAX 20000
+
+// Static SRAM of the tca.c variables, checked against the device SRAM in main.c
+#define TCA_SRAM_SIZE (2 * sizeof(uint16_t) + 1)
+
+extern uint16_t EEMEM eeprom_tick_rate;
+
 extern uint16_t period;
+extern uint16_t tick_rate;
+extern uint8_t is_tick_rate_changed;
 
-void TCA0_init();
+void TCA0_init(uint16_t rate);
+uint8_t TCA0_set_tick_rate(uint16_t rate);
+void TCA0_save_tick_rate();
 
 #endif /* TCA_H_ */
\ No newline at end of file
@@ -12,11 +12,20 @@
 
 #include <avr/eeprom.h>
 
-#define RESPONSE_VERSION "FBSMC01_A001"
+#define RESPONSE_VERSION "FBSMC01_A002"
 #define RESPONSE_INVALID "INVALID"
 #define RESPONSE_OK "OK"
-#define COMMAND_DELIMITER ":;,"
 #define TWI_BUFFER_SIZE	150
+#define RESPONSE_MULTI_PREFIX "R:"
+#define MULTI_COMMAND_MAX 16 // Commands processed in one write transaction, others are ignored
+#define SEQUENCE_PREFIX '@' // Optional command prefix with a sequence number, format: @<sequence[1 - 65535]>:<command>
+#define SEQUENCE_HISTORY MULTI_COMMAND_MAX // Accepted sequence numbers remembered, a lost reply covers one transaction
+#define RESPONSE_ACK "\nACK:" // Reply suffix of sequenced transactions, format: ACK:<last_sequence>,<queue_depth>
+#define RESPONSE_ACK_MAX_SIZE 14 // Longest acknowledgement, a 5 digit sequence and a 3 digit queue depth
+#define STATUS_COUNTS_MAX_SIZE (5 + 6 * MOTOR_DEVICES - 1) // Longest step counters line of the status response
+
+// Static SRAM of the twi.c variables, checked against the device SRAM in main.c
+#define TWI_SRAM_SIZE (2 * TWI_BUFFER_SIZE + MULTI_COMMAND_MAX + 1 + SEQUENCE_HISTORY * sizeof(uint16_t) + 11)
 
 extern uint8_t EEMEM eeprom_twi_address;
 
@@ -30,8 +39,17 @@ extern void TWI0_init(uint8_t address);
 extern void TWI0_set_address(uint8_t address);
 extern void TWI0_process_interrupt();
 extern void TWI0_process_command();
+extern void TWI0_format_status();
 
-extern void process_set_address();
+extern void process_set_address(char *cursor);
+extern void process_tick(char *cursor);
 extern void set_response(char *response);
+extern void append_response(const char *text);
+extern void append_response_number(unsigned long value);
+extern void append_command_status();
+extern void append_acknowledgement(uint8_t queue_depth);
+extern uint8_t find_sequence(uint16_t sequence);
+extern void record_sequence(uint16_t sequence);
+extern void clear_sequences();
 
 #endif /* TWI_H_ */
\ No newline at end of file
@@ -10,12 +10,12 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
-#define MAX_STR_NUM_SIZE 10
+#define MAX_STR_NUM_SIZE 11 // Digits of the largest 32-bit value and the null termination
 
-extern uint8_t num_conversion_error;
-
-extern uint16_t str2num(char *str);
-extern unsigned long str2ulong(char *str);
+extern uint8_t is_delimiter(char c);
+extern void skip_delimiters(char **cursor);
+extern uint8_t match_keyword(char **cursor, const char *keyword);
+extern uint8_t parse_number(char **cursor, unsigned long max_value, unsigned long *value);
 extern char* num2str(unsigned long value);
 
 #endif /* UTIL_H_ */
\ No newline at end of file
@@ -14,8 +14,13 @@
 #include "tca.h"
 #include "motors.h"
 
-void PORTA_init();
-void PORTC_init();
+// Stack of the main loop and of one interrupt call chain, the interrupts never nest. The deepest are the TWI command
+// processing, and the status formatting of the main loop with the timer interrupt, the TWI interrupts are held during it.
+// The prescaler tables and the strings stay in the mapped flash.
+#define SRAM_STACK_RESERVE 160
+
+_Static_assert(MOTORS_SRAM_SIZE + TWI_SRAM_SIZE + TCA_SRAM_SIZE + SRAM_STACK_RESERVE <= RAMSIZE,
+	"Static variables and the stack reserve don't fit the SRAM, lower COMMAND_QUEUE_SRAM_BUDGET");
 
 ISR(TWI0_TWIS_vect)
 {
@@ -26,48 +31,7 @@ ISR(TWI0_TWIS_vect)
 ISR(TCA0_OVF_vect)
 {
 	// Processing commands at each TimerA overflow
-	
-	if(!is_switch_activated && !is_paused && move_device_id == MOTOR_DEVICES) {
-		// No switch is activated, commands are not paused, and no override move command, run commands from the buffer
-		run_command_on_device(&runCommnadsBufferA[head], 0);
-		run_command_on_device(&runCommnadsBufferB[head], 1);
-		run_command_on_device(&runCommnadsBufferC[head], 2);
-		run_command_on_device(&runCommnadsBufferD[head], 3);
-		
-		if(!is_buffer_command_available(head)) {
-			// No remaining steps, clear the other values from the buffer
-			clear_command_struct(&runCommnadsBufferA[head]);
-			clear_command_struct(&runCommnadsBufferB[head]);
-			clear_command_struct(&runCommnadsBufferC[head]);
-			clear_command_struct(&runCommnadsBufferD[head]);
-			// Move to the next command if available
-			uint8_t next_command_index = (head + 1) % COMMAND_BUFFER_SIZE;
-			if(is_buffer_command_available(next_command_index)) {
-				head = next_command_index;
-			}
-		}
-	}
-	else if (move_device_id < MOTOR_DEVICES && moveCommand.steps > 0)
-	{
-		// Execute move command, takes precedence over commands in the buffer
-		run_command_on_device(&moveCommand, move_device_id);
-	}
-	else if (move_device_id < MOTOR_DEVICES && moveCommand.steps == 0)
-	{
-		// Reset move command
-		clear_command_struct(&moveCommand);
-		move_device_id = MOTOR_DEVICES;
-		// Update if any switches are activated
-		is_switch_activated = !((PORTB.IN >> 2) == 15);
-		// Pause running commands, user must send resume command
-		is_paused = 1;
-	}
-	
-	// Stop if any of the limit switches are activated
-	if((PORTB.IN >> 2) != 15)
-	{
-		is_switch_activated = 1;
-	}
+	motors_tick();
 	
 	TCA0.SINGLE.INTFLAGS = TCA_SINGLE_OVF_bm;
 }
@@ -76,28 +40,15 @@ int main(void)
 {
 	uint8_t twi_address = eeprom_read_byte(&eeprom_twi_address);
 	TWI0_init(twi_address);
-	PORTA_init();
-	PORTC_init();
-	TCA0_init();
+	motors_init();
+	TCA0_init(eeprom_read_word(&eeprom_tick_rate));
 	clear_command_buffer();
 	sei();
 	
 	while(1)
 	{
-		// Program loop
+		// Program loop, the slow work runs here with the interrupts enabled
+		TWI0_format_status();
+		TCA0_save_tick_rate();
 	}
 }
-
-void PORTC_init()
-{
-	// Configure physical pins 12, 13, 14, and 15 as output.
-	PORTC.DIR |= PIN0_bm | PIN1_bm | PIN2_bm | PIN3_bm;
-	PORTC.OUT |= PIN0_bm | PIN1_bm | PIN2_bm | PIN3_bm;
-}
-
-void PORTA_init()
-{
-	// Configure physical pins 2, 3, 4, and 5 as output.
-	PORTA.DIR |= PIN4_bm | PIN5_bm | PIN6_bm | PIN7_bm;
-	PORTA.OUT |= PIN4_bm | PIN5_bm | PIN6_bm | PIN7_bm;
-}
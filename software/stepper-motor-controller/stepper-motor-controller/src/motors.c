@@ -8,22 +8,34 @@
 
 
 #include <avr/io.h>
+#include <string.h>
 #include "motors.h"
+#include "tca.h"
 
-uint8_t head = 0;
-uint8_t tail = 0;
+// Ring buffer of packed queued commands
+uint8_t command_queue[COMMAND_QUEUE_SRAM_BUDGET];
+uint16_t queue_head = 0; // Index of the next command to run
+uint16_t queue_tail = 0; // Index where the next command is stored
+uint16_t queue_bytes = 0; // Bytes used by the queued commands
+uint8_t queued_commands = 0; // Number of queued commands
+uint8_t queued_pvt_commands = 0; // Number of queued PVT commands, included in the queued commands
+static uint8_t last_command_size = QUEUED_COMMAND_MAX_SIZE; // Bytes of the last queued command
 
-// Buffers to store commands for each device
-RunCommand runCommnadsBufferA[COMMAND_BUFFER_SIZE];
-RunCommand runCommnadsBufferB[COMMAND_BUFFER_SIZE];
-RunCommand runCommnadsBufferC[COMMAND_BUFFER_SIZE];
-RunCommand runCommnadsBufferD[COMMAND_BUFFER_SIZE];
+// Command running on each device, loaded from the queue
+RunCommand active_commands[MOTOR_DEVICES];
+
+// Last direction set on each device, the direction pin is only written when it changes
+uint8_t device_dirs[MOTOR_DEVICES];
+
+// PVT interpolation state, valid while a PVT command is loaded
+uint8_t is_pvt_active = 0; // Indicates that the active commands are PVT knots
+uint16_t pvt_ticks = 0; // Ticks left in the knot duration
+int32_t pvt_rates[MOTOR_DEVICES]; // Current step rate of each device
+int32_t pvt_rate_deltas[MOTOR_DEVICES]; // Step rate change per tick of each device
+uint32_t pvt_phases[MOTOR_DEVICES]; // Step phase accumulator of each device
+// End rate of the last queued knot of each device, the start rate of the next knot
+static int32_t pvt_queued_rates[MOTOR_DEVICES];
 
-// Predefined ports and mask for each motor
-PORT_t* device_ports[MOTOR_DEVICES] = {&PORTC, &PORTC, &PORTA, &PORTA};
-uint8_t device_step_masks[MOTOR_DEVICES] = {PIN0_bm, PIN2_bm, PIN4_bm, PIN6_bm};
-uint8_t device_dir_masks[MOTOR_DEVICES] = {PIN1_bm, PIN3_bm, PIN5_bm, PIN7_bm};
-	
 uint8_t is_switch_activated = 0; // Indicates that a limit switch is activated
 uint8_t is_paused = 0; // Indicates if commands are paused or not
 
@@ -31,6 +43,54 @@ uint8_t is_paused = 0; // Indicates if commands are paused or not
 RunCommand moveCommand = {0, 0, 0, 0};
 uint8_t move_device_id = MOTOR_DEVICES;
 
+uint32_t tick_counter = 0; // Timer ticks since start-up
+uint16_t step_counts[MOTOR_DEVICES]; // Steps of each device since start-up, wrapping, to compute step rates
+
+// Gearing state, changed only from the TWI interrupt, which the timer interrupt never preempts
+uint8_t gear_mask = 0; // Bit per follower device
+uint8_t gear_inverts = 0; // Bit per follower turning opposite to its leader
+uint8_t gear_leaders[MOTOR_DEVICES];
+uint8_t gear_numerators[MOTOR_DEVICES];
+uint8_t gear_denominators[MOTOR_DEVICES];
+uint8_t gear_errors[MOTOR_DEVICES]; // Leader toggles not yet turned into follower toggles, times the numerator
+uint8_t step_toggle_mask = 0; // Bit per device whose step pin toggled in the current tick
+
+// Jog state, changed only from the TWI interrupt like the gears
+uint8_t jog_mask = 0; // Bit per jogging device
+JogState jog_states[MOTOR_DEVICES];
+
+_Static_assert(sizeof(command_queue) + sizeof(queue_head) + sizeof(queue_tail) + sizeof(queue_bytes)
+	+ sizeof(queued_commands) + sizeof(queued_pvt_commands) + sizeof(last_command_size) + sizeof(active_commands)
+	+ sizeof(device_dirs) + sizeof(is_pvt_active) + sizeof(pvt_ticks) + sizeof(pvt_rates) + sizeof(pvt_rate_deltas)
+	+ sizeof(pvt_phases) + sizeof(pvt_queued_rates) + sizeof(is_switch_activated) + sizeof(is_paused)
+	+ sizeof(moveCommand) + sizeof(move_device_id) + sizeof(tick_counter) + sizeof(step_counts) + sizeof(gear_mask) + sizeof(gear_inverts)
+	+ sizeof(gear_leaders) + sizeof(gear_numerators) + sizeof(gear_denominators) + sizeof(gear_errors)
+	+ sizeof(step_toggle_mask) + sizeof(jog_mask) + sizeof(jog_states) == MOTORS_SRAM_SIZE,
+	"MOTORS_SRAM_SIZE must count every motors.c variable");
+
+// Configures the step and direction pins of a device as output, set high
+#define INIT_DEVICE(id) \
+	MOTOR##id##_VPORT.DIR |= MOTOR##id##_STEP_bm | MOTOR##id##_DIR_bm; \
+	MOTOR##id##_VPORT.OUT |= MOTOR##id##_STEP_bm | MOTOR##id##_DIR_bm; \
+	device_dirs[id] = 1
+
+/**
+* Initializes the motor driver pins
+*/
+void motors_init()
+{
+	INIT_DEVICE(0);
+#if MOTOR_DEVICES > 1
+	INIT_DEVICE(1);
+#endif
+#if MOTOR_DEVICES > 2
+	INIT_DEVICE(2);
+#endif
+#if MOTOR_DEVICES > 3
+	INIT_DEVICE(3);
+#endif
+}
+
 /**
 * Helper function to clear a command
 */
@@ -47,56 +107,589 @@ void clear_command_struct(RunCommand* run_command)
 */
 void clear_command_buffer()
 {
-	for(int i = 0; i < COMMAND_BUFFER_SIZE; i++) {
-		clear_command_struct(&runCommnadsBufferA[i]);
-		clear_command_struct(&runCommnadsBufferB[i]);
-		clear_command_struct(&runCommnadsBufferC[i]);
-		clear_command_struct(&runCommnadsBufferD[i]);
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		clear_command_struct(&active_commands[device_id]);
+		pvt_rates[device_id] = 0;
+		pvt_rate_deltas[device_id] = 0;
+		pvt_phases[device_id] = 0;
+		pvt_queued_rates[device_id] = 0;
 	}
+	queue_head = 0;
+	queue_tail = 0;
+	queue_bytes = 0;
+	queued_commands = 0;
+	queued_pvt_commands = 0;
+	is_pvt_active = 0;
+	pvt_ticks = 0;
 }
 
 /**
-* Runs one steps from the command
+* Runs one steps from the command, used when the device is only known at runtime
 */
 void run_command_on_device(RunCommand* run_command, uint8_t device_id)
 {
-	// Skip if no steps to run
-	if(run_command->steps == 0) {
-		return;
+	switch(device_id)
+	{
+		case 0: RUN_DEVICE(run_command, 0); break;
+#if MOTOR_DEVICES > 1
+		case 1: RUN_DEVICE(run_command, 1); break;
+#endif
+#if MOTOR_DEVICES > 2
+		case 2: RUN_DEVICE(run_command, 2); break;
+#endif
+#if MOTOR_DEVICES > 3
+		case 3: RUN_DEVICE(run_command, 3); break;
+#endif
+		default: break;
+	}
+}
+
+/**
+* Returns the queue index following the given index
+*/
+static inline uint16_t next_queue_index(uint16_t index)
+{
+	return index + 1 < COMMAND_QUEUE_SRAM_BUDGET ? index + 1 : 0;
+}
+
+/**
+* Copies bytes to the queue, returns the index after the last byte
+*/
+static uint16_t write_queue(uint16_t index, const void* data, uint8_t size)
+{
+	const uint8_t* bytes = data;
+	for(uint8_t i = 0; i < size; i++) {
+		command_queue[index] = bytes[i];
+		index = next_queue_index(index);
+	}
+	return index;
+}
+
+/**
+* Copies bytes from the queue, returns the index after the last byte
+*/
+static uint16_t read_queue(uint16_t index, void* data, uint8_t size)
+{
+	uint8_t* bytes = data;
+	for(uint8_t i = 0; i < size; i++) {
+		bytes[i] = command_queue[index];
+		index = next_queue_index(index);
+	}
+	return index;
+}
+
+/**
+* Returns the bytes a value takes in the queue, 7 bits per byte
+*/
+static uint8_t queued_value_size(uint32_t value)
+{
+	uint8_t size = 1;
+	while(value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+/**
+* Stores a value in 7-bit groups from the least significant one, the high bit is set when another byte follows.
+* Returns the index after the last byte.
+*/
+static uint16_t write_queue_value(uint16_t index, uint32_t value)
+{
+	while(value >= 0x80) {
+		command_queue[index] = (uint8_t)value | 0x80;
+		index = next_queue_index(index);
+		value >>= 7;
+	}
+	command_queue[index] = (uint8_t)value;
+	return next_queue_index(index);
+}
+
+/**
+* Reads a value stored by write_queue_value(), returns the index after the last byte
+*/
+static uint16_t read_queue_value(uint16_t index, uint32_t* value)
+{
+	uint32_t result = 0;
+	uint8_t shift = 0;
+	uint8_t byte;
+	do {
+		byte = command_queue[index];
+		index = next_queue_index(index);
+		result |= (uint32_t)(byte & 0x7F) << shift;
+		shift += 7;
+	} while(byte & 0x80);
+	*value = result;
+	return index;
+}
+
+/**
+* Packs the command of each device into the queue, devices without steps are not stored.
+* Returns 0 if the queue is full. A command without steps is accepted and not queued.
+*/
+uint8_t push_command(RunCommand* commands)
+{
+	uint8_t header = 0;
+	uint8_t size = 1;
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if(commands[device_id].steps > 0) {
+			header |= 1 << device_id;
+			if(commands[device_id].dir) {
+				header |= 0x10 << device_id;
+			}
+			size += queued_value_size(commands[device_id].steps) + queued_value_size(commands[device_id].speed);
+		}
 	}
 	
-	run_command->counter++;
+	if(header == 0) {
+		return 1;
+	}
+	if(queued_commands >= COMMAND_BUFFER_SIZE || queue_bytes + size > COMMAND_QUEUE_SRAM_BUDGET) {
+		return 0;
+	}
 	
-	if(run_command->counter >= run_command->speed) {
-		
-		// Set direction
-		if(run_command->dir)
-		{
-			device_ports[device_id]->OUT |= device_dir_masks[device_id];
+	uint16_t index = write_queue(queue_tail, &header, 1);
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if(header & (1 << device_id)) {
+			index = write_queue_value(index, commands[device_id].steps);
+			index = write_queue_value(index, commands[device_id].speed);
+		}
+		// A PVT command after this one starts from standstill
+		pvt_queued_rates[device_id] = 0;
+	}
+	queue_tail = index;
+	queue_bytes += size;
+	queued_commands++;
+	last_command_size = size;
+	return 1;
+}
+
+/**
+* Converts a velocity in steps per second to a PVT step rate at the current tick rate
+*/
+static int32_t velocity_to_rate(uint16_t velocity)
+{
+	// Two pin toggles per step, 8.24 fixed point: rate = velocity * 2 * 2^24 / tick_rate
+	uint32_t rate = ((uint32_t)velocity << 16) / tick_rate;
+	if(rate >= (PVT_RATE_ONE >> 9))
+	{
+		return PVT_RATE_ONE;
+	}
+	return rate << 9;
+}
+
+/**
+* Converts a step rate in PVT rate units to a velocity in steps per second, the inverse of velocity_to_rate()
+*/
+uint16_t rate_to_velocity(int32_t rate)
+{
+	uint32_t magnitude = rate < 0 ? -rate : rate;
+	return ((magnitude >> 9) * tick_rate + 0x8000) >> 16; // Rounded, the rate was truncated
+}
+
+/**
+* Packs a PVT command into the queue. Each knot holds the steps (16-bit), direction and end velocity in steps per second
+* of a device in its speed value. The step rate of each device changes linearly from the end velocity of the previous
+* knot to the knot velocity over the duration. A knot without steps ends at standstill.
+* Returns 0 if the queue is full.
+*/
+uint8_t push_pvt_command(RunCommand* knots, uint16_t duration)
+{
+	uint8_t header = 0;
+	uint8_t size = 4;
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if(knots[device_id].steps > 0) {
+			header |= 1 << device_id;
+			if(knots[device_id].dir) {
+				header |= 0x10 << device_id;
+			}
+			size += PVT_DEVICE_SIZE;
+		}
+	}
+	
+	if(queued_commands >= COMMAND_BUFFER_SIZE || queue_bytes + size > COMMAND_QUEUE_SRAM_BUDGET) {
+		return 0;
+	}
+	
+	if(queued_commands == 0 && !is_pvt_active) {
+		// Nothing to continue from, the knot starts from standstill
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			pvt_queued_rates[device_id] = 0;
+		}
+	}
+	
+	const uint8_t marker = PVT_COMMAND_MARKER;
+	uint16_t index = write_queue(queue_tail, &marker, 1);
+	index = write_queue(index, &header, 1);
+	index = write_queue(index, &duration, 2);
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		int32_t end_rate = 0;
+		if(header & (1 << device_id)) {
+			end_rate = velocity_to_rate(knots[device_id].speed);
+			int32_t rate_delta = (end_rate - pvt_queued_rates[device_id]) / (int32_t)duration;
+			uint16_t steps = knots[device_id].steps;
+			index = write_queue(index, &steps, 2);
+			index = write_queue(index, &rate_delta, 4);
+		}
+		pvt_queued_rates[device_id] = end_rate;
+	}
+	queue_tail = index;
+	queue_bytes += size;
+	queued_commands++;
+	queued_pvt_commands++;
+	last_command_size = size;
+	return 1;
+}
+
+/**
+* Unpacks a queued PVT command after the marker byte into the active commands.
+* Devices continuing from a PVT command keep their step rate and phase, the others start from standstill.
+* Returns the queue index after the command.
+*/
+static uint16_t load_pvt_command(uint16_t index)
+{
+	uint8_t header;
+	index = read_queue(index, &header, 1);
+	index = read_queue(index, &pvt_ticks, 2);
+	uint8_t size = 4;
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		RunCommand* run_command = &active_commands[device_id];
+		clear_command_struct(run_command);
+		pvt_rate_deltas[device_id] = 0;
+		if(!is_pvt_active) {
+			pvt_rates[device_id] = 0;
+			pvt_phases[device_id] = 0;
+		}
+		if(header & (1 << device_id)) {
+			uint16_t steps;
+			index = read_queue(index, &steps, 2);
+			index = read_queue(index, &pvt_rate_deltas[device_id], 4);
+			run_command->steps = steps;
+			run_command->dir = (header >> (4 + device_id)) & 1;
+			size += PVT_DEVICE_SIZE;
 		}
 		else
 		{
-			device_ports[device_id]->OUT &= ~device_dir_masks[device_id];
+			pvt_rates[device_id] = 0;
 		}
-		// Toggle step pin
-		device_ports[device_id]->OUT ^= device_step_masks[device_id]; // toggle step pin
-		if((device_ports[device_id]->OUT & device_step_masks[device_id]) == 0) {
-			run_command->steps--;
+	}
+	is_pvt_active = 1;
+	queue_bytes -= size;
+	queued_pvt_commands--;
+	return index;
+}
+
+/**
+* Unpacks the next queued command into the active commands.
+* Called on the tick the last step of the running command was made, a device continuing in the next command
+* keeps its step spacing across the junction.
+* Returns 0 if the queue is empty.
+*/
+uint8_t load_next_command()
+{
+	if(queued_commands == 0) {
+		return 0;
+	}
+	
+	uint8_t header;
+	uint16_t index = read_queue(queue_head, &header, 1);
+	if(header == PVT_COMMAND_MARKER) {
+		queue_head = load_pvt_command(index);
+		queued_commands--;
+		return 1;
+	}
+	
+	is_pvt_active = 0;
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		RunCommand* run_command = &active_commands[device_id];
+		clear_command_struct(run_command);
+		if(header & (1 << device_id)) {
+			uint32_t value;
+			index = read_queue_value(index, &value);
+			run_command->steps = value;
+			index = read_queue_value(index, &value);
+			run_command->speed = value;
+			run_command->dir = (header >> (4 + device_id)) & 1;
 		}
-		run_command->counter = 0;
 	}
+	queue_bytes -= index >= queue_head ? index - queue_head : index + COMMAND_QUEUE_SRAM_BUDGET - queue_head;
+	queue_head = index;
+	queued_commands--;
+	return 1;
 }
 
 /**
-* Helper function to check if there is a command with steps to be executed.
+* Returns the motion state mode, one of the MOTION_* values
 */
-uint8_t is_buffer_command_available(uint8_t index)
+uint8_t get_motion_mode()
 {
-	if (index >= COMMAND_BUFFER_SIZE)
+	if(move_device_id < MOTOR_DEVICES)
+	{
+		return MOTION_MOVE;
+	}
+	if(is_paused)
 	{
+		return MOTION_PAUSED;
+	}
+	if(is_pvt_active)
+	{
+		return MOTION_PVT;
+	}
+	return MOTION_RUN;
+}
+
+/**
+* Scales a speed value from one timer tick rate to another, keeping the step rate
+*/
+uint16_t rescale_speed(uint16_t speed, uint16_t from_rate, uint16_t to_rate)
+{
+	uint32_t scaled = ((uint32_t)speed * to_rate + from_rate / 2) / from_rate;
+	return scaled > 0xFFFF ? 0xFFFF : scaled;
+}
+
+/**
+* Reverses the queue bytes from the first index up to the last index, not included
+*/
+static void reverse_queue(uint16_t first, uint16_t last)
+{
+	while(first + 1 < last) {
+		last--;
+		uint8_t byte = command_queue[first];
+		command_queue[first] = command_queue[last];
+		command_queue[last] = byte;
+		first++;
+	}
+}
+
+/**
+* Rotates the ring buffer in place so the queued commands start at index 0
+*/
+static void align_queue()
+{
+	reverse_queue(0, queue_head);
+	reverse_queue(queue_head, COMMAND_QUEUE_SRAM_BUDGET);
+	reverse_queue(0, COMMAND_QUEUE_SRAM_BUDGET);
+	queue_head = 0;
+	queue_tail = queue_bytes < COMMAND_QUEUE_SRAM_BUDGET ? queue_bytes : 0;
+}
+
+/**
+* Returns the bytes of a queued PVT command after the marker byte
+*/
+static uint8_t pvt_command_size(uint8_t header)
+{
+	uint8_t size = 3; // header and duration
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if(header & (1 << device_id)) {
+			size += PVT_DEVICE_SIZE;
+		}
+	}
+	return size;
+}
+
+/**
+* Checks if a queued run or PVT command has steps for the device
+*/
+static uint8_t is_device_queued(uint8_t device_id)
+{
+	uint32_t value;
+	uint16_t index = queue_head;
+	for(uint8_t i = 0; i < queued_commands; i++) {
+		uint8_t header = command_queue[index];
+		index = next_queue_index(index);
+		uint8_t is_pvt = header == PVT_COMMAND_MARKER;
+		if(is_pvt) {
+			header = command_queue[index];
+		}
+		if(header & (1 << device_id)) {
+			return 1;
+		}
+		if(is_pvt) {
+			index = (index + pvt_command_size(header)) % COMMAND_QUEUE_SRAM_BUDGET;
+			continue;
+		}
+		for(uint8_t queued_id = 0; queued_id < MOTOR_DEVICES; queued_id++) {
+			if(header & (1 << queued_id)) {
+				index = read_queue_value(index, &value); // Steps
+				index = read_queue_value(index, &value); // Speed
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+* Rescales the speeds of all queued and running commands to a new timer tick rate.
+* A rescaled speed may take another number of bytes, the queued commands are packed again in place.
+* PVT step rates are not rescaled, the tick rate must not change while PVT commands are queued or running.
+* Returns 0 without changing any speed if the rescaled commands don't fit the queue.
+*/
+uint8_t rescale_command_speeds(uint16_t from_rate, uint16_t to_rate)
+{
+	uint32_t steps;
+	uint32_t speed;
+	
+	// Size of the rescaled commands
+	align_queue();
+	uint16_t bytes = queue_bytes;
+	uint16_t index = 0;
+	for(uint8_t i = 0; i < queued_commands; i++) {
+		uint8_t header = command_queue[index++];
+		if(header == PVT_COMMAND_MARKER) {
+			index += pvt_command_size(command_queue[index]);
+			continue;
+		}
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			if(header & (1 << device_id)) {
+				index = read_queue_value(index, &steps);
+				index = read_queue_value(index, &speed);
+				bytes += queued_value_size(rescale_speed(speed, from_rate, to_rate));
+				bytes -= queued_value_size(speed);
+			}
+		}
+	}
+	if(bytes > COMMAND_QUEUE_SRAM_BUDGET) {
 		return 0;
 	}
 	
-	return runCommnadsBufferA[index].steps > 0 || runCommnadsBufferB[index].steps > 0 ||
-		runCommnadsBufferC[index].steps > 0 || runCommnadsBufferD[index].steps > 0;
-}
\ No newline at end of file
+	// All speeds grow or all shrink with the rate. Growing commands are packed from a copy at the end of the buffer,
+	// so a command is always read before the bytes it was stored in are written.
+	uint16_t read_index = 0;
+	if(bytes > queue_bytes) {
+		read_index = COMMAND_QUEUE_SRAM_BUDGET - queue_bytes;
+		memmove(&command_queue[read_index], command_queue, queue_bytes);
+	}
+	uint16_t write_index = 0;
+	for(uint8_t i = 0; i < queued_commands; i++) {
+		uint8_t header = command_queue[read_index++];
+		command_queue[write_index++] = header;
+		if(header == PVT_COMMAND_MARKER) {
+			for(uint8_t size = pvt_command_size(command_queue[read_index]); size > 0; size--) {
+				command_queue[write_index++] = command_queue[read_index++];
+			}
+			continue;
+		}
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			if(header & (1 << device_id)) {
+				read_index = read_queue_value(read_index, &steps);
+				read_index = read_queue_value(read_index, &speed);
+				write_index = write_queue_value(write_index, steps);
+				write_index = write_queue_value(write_index, rescale_speed(speed, from_rate, to_rate));
+			}
+		}
+	}
+	queue_bytes = bytes;
+	queue_tail = bytes < COMMAND_QUEUE_SRAM_BUDGET ? bytes : 0;
+	
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		RunCommand* run_command = &active_commands[device_id];
+		run_command->speed = rescale_speed(run_command->speed, from_rate, to_rate);
+		run_command->counter = rescale_speed(run_command->counter, from_rate, to_rate);
+	}
+	moveCommand.speed = rescale_speed(moveCommand.speed, from_rate, to_rate);
+	moveCommand.counter = rescale_speed(moveCommand.counter, from_rate, to_rate);
+	return 1;
+}
+
+/**
+* Returns the commands the buffer holds: the queued commands, the running one, and the commands of the size
+* of the last queued one that fit the free bytes. Commands are stored in as few bytes as their values need,
+* so the capacity follows the commands being sent instead of assuming the smallest ones.
+*/
+uint8_t get_queue_capacity()
+{
+	uint16_t free_commands = (COMMAND_QUEUE_SRAM_BUDGET - queue_bytes) / last_command_size;
+	if(free_commands > COMMAND_BUFFER_SIZE - queued_commands)
+	{
+		free_commands = COMMAND_BUFFER_SIZE - queued_commands;
+	}
+	return queued_commands + is_active_command_running() + free_commands;
+}
+
+/**
+* Engages a follower device to a leader with the ratio numerator/denominator, not larger than one.
+* Gears are changed while no command runs, followers can't lead and leaders can't follow or jog.
+* Returns 0 if the gear is not valid.
+*/
+uint8_t set_gear(uint8_t follower_id, uint8_t leader_id, uint8_t numerator, uint8_t denominator, uint8_t is_inverted)
+{
+	if(follower_id == leader_id || (gear_mask & (1 << leader_id)) || (jog_mask & (1 << follower_id))
+		|| queued_commands > 0 || is_active_command_running() || move_device_id < MOTOR_DEVICES)
+	{
+		return 0;
+	}
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		if((gear_mask & (1 << device_id)) && gear_leaders[device_id] == follower_id) {
+			return 0;
+		}
+	}
+	
+	gear_leaders[follower_id] = leader_id;
+	gear_numerators[follower_id] = numerator;
+	gear_denominators[follower_id] = denominator;
+	gear_errors[follower_id] = 0;
+	if(is_inverted)
+	{
+		gear_inverts |= 1 << follower_id;
+	}
+	else
+	{
+		gear_inverts &= ~(1 << follower_id);
+	}
+	gear_mask |= 1 << follower_id;
+	return 1;
+}
+
+/**
+* Disengages a follower device, it runs its own commands again
+*/
+void clear_gear(uint8_t follower_id)
+{
+	gear_mask &= ~(1 << follower_id);
+}
+
+/**
+* Converts an acceleration in steps per second squared to a jog step rate change per tick
+*/
+static int32_t acceleration_to_rate_delta(uint16_t acceleration)
+{
+	// rate change = acceleration * 2 * 2^24 / tick_rate^2, computed in 64 bits so slow accelerations keep their precision
+	uint32_t delta = ((uint64_t)acceleration << 25) / ((uint32_t)tick_rate * tick_rate);
+	return delta > 0 ? delta : 1;
+}
+
+/**
+* Sets the target velocity of a jogging device, in steps per second, starting the jog if the device is stopped.
+* Without acceleration the velocity changes at once, a zero velocity stops the device.
+* Returns 0 if the device can't jog, it is geared or has a running, queued or move command.
+*/
+uint8_t set_jog(uint8_t device_id, uint8_t dir, uint16_t velocity, uint16_t acceleration)
+{
+	const uint8_t device_mask = 1 << device_id;
+	if(gear_mask & device_mask)
+	{
+		return 0;
+	}
+	if(!(jog_mask & device_mask))
+	{
+		if(velocity == 0)
+		{
+			return 1;
+		}
+		// The device is not stepped by commands while it jogs
+		if(active_commands[device_id].steps > 0 || is_pvt_active || move_device_id == device_id
+			|| is_device_queued(device_id))
+		{
+			return 0;
+		}
+		jog_states[device_id].rate = 0;
+		jog_states[device_id].phase = 0;
+	}
+	
+	int32_t target = velocity_to_rate(velocity);
+	jog_states[device_id].target = dir ? target : -target;
+	jog_states[device_id].acceleration = acceleration > 0 ? acceleration_to_rate_delta(acceleration) : (int32_t)(2 * PVT_RATE_ONE);
+	jog_mask |= device_mask;
+	return 1;
+}
@@ -7,15 +7,86 @@
 */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "tca.h"
+#include "motors.h"
+
+uint16_t EEMEM eeprom_tick_rate = TICK_RATE_DEFAULT; // Default timer tick rate
 
 uint16_t period = 0x03E8; // Timer period 0x3E8 = 1000
+uint16_t tick_rate = TICK_RATE_DEFAULT; // Active timer ticks per second
+uint8_t is_tick_rate_changed = 0; // Set when the tick command changed the rate, it is saved from the main loop
+
+_Static_assert(sizeof(period) + sizeof(tick_rate) + sizeof(is_tick_rate_changed) == TCA_SRAM_SIZE, "TCA_SRAM_SIZE must count every tca.c variable");
+
+// Available pre-scaler dividers and their clock selection values, from the finest resolution
+static const uint16_t prescaler_dividers[] = {1, 2, 4, 8, 16, 64, 256, 1024};
+static const uint8_t prescaler_clksel[] = {
+	TCA_SINGLE_CLKSEL_DIV1_gc, TCA_SINGLE_CLKSEL_DIV2_gc, TCA_SINGLE_CLKSEL_DIV4_gc, TCA_SINGLE_CLKSEL_DIV8_gc,
+	TCA_SINGLE_CLKSEL_DIV16_gc, TCA_SINGLE_CLKSEL_DIV64_gc, TCA_SINGLE_CLKSEL_DIV256_gc, TCA_SINGLE_CLKSEL_DIV1024_gc
+};
 
 /**
-* Initializes the TCA0 peripheral
+* Initializes the TCA0 peripheral, falls back to the default tick rate if the rate is out of range
 */
-void TCA0_init()
+void TCA0_init(uint16_t rate)
 {
 	TCA0.SINGLE.INTCTRL = TCA_SINGLE_OVF_bm; // Enable interrupt on overflow
-	TCA0.SINGLE.CTRLB = TCA_SINGLE_WGMODE_NORMAL_gc; // Disable wave form generation	TCA0.SINGLE.PER = period; // Set the period	TCA0.SINGLE.CTRLA = TCA_SINGLE_CLKSEL_DIV1_gc | TCA_SINGLE_ENABLE_bm; // Set the pre-scaler and enable the timer
+	TCA0.SINGLE.CTRLB = TCA_SINGLE_WGMODE_NORMAL_gc; // Disable wave form generation
+	if(!TCA0_set_tick_rate(rate))
+	{
+		TCA0_set_tick_rate(TICK_RATE_DEFAULT);
+	}
+}
+
+/**
+* Sets the timer tick rate, selecting the smallest pre-scaler where the period fits 16 bits.
+* Speeds of the queued commands are rescaled to keep their step rate.
+* Must not be preempted by the timer interrupt, it is called before interrupts are enabled or from the TWI interrupt.
+* Returns 0 if the rate is out of range or the rescaled commands don't fit the queue.
+*/
+uint8_t TCA0_set_tick_rate(uint16_t rate)
+{
+	if(rate < TICK_RATE_MIN || rate > TICK_RATE_MAX)
+	{
+		return 0;
+	}
+	
+	uint8_t index = 0;
+	uint32_t new_period = F_CPU / rate;
+	while(new_period > 0xFFFF && index < sizeof(prescaler_dividers) / sizeof(prescaler_dividers[0]) - 1)
+	{
+		index++;
+		new_period = F_CPU / prescaler_dividers[index] / rate;
+	}
+	
+	if(rate != tick_rate && !rescale_command_speeds(tick_rate, rate))
+	{
+		return 0;
+	}
+	
+	period = new_period;
+	tick_rate = rate;
+	TCA0.SINGLE.CTRLA = 0; // Stop the timer while changing the period
+	TCA0.SINGLE.CNT = 0;
+	TCA0.SINGLE.PER = period; // Set the period
+	TCA0.SINGLE.CTRLA = prescaler_clksel[index] | TCA_SINGLE_ENABLE_bm; // Set the pre-scaler and enable the timer
+	return 1;
+}
+
+/**
+* Saves the tick rate to the EEPROM after the tick command changed it.
+* Called from the main loop, the timer interrupt keeps stepping during the EEPROM write of several milliseconds.
+*/
+void TCA0_save_tick_rate()
+{
+	cli();
+	uint8_t is_changed = is_tick_rate_changed;
+	uint16_t rate = tick_rate;
+	is_tick_rate_changed = 0;
+	sei();
+	if(is_changed)
+	{
+		eeprom_update_word(&eeprom_tick_rate, rate);
+	}
 }
\ No newline at end of file
@@ -13,18 +13,88 @@
 #include "twi.h"
 #include "util.h"
 #include "motors.h"
+#include "tca.h"
 
 uint8_t EEMEM eeprom_twi_address = 0x50; // Default board I2C Slave Address
 
-char read_buffer[TWI_BUFFER_SIZE];
+// Values of a device line of the status response
+#define STATUS_DEVICE_RUN 0
+#define STATUS_DEVICE_GEAR 1
+#define STATUS_DEVICE_JOG 2
+
+typedef struct
+{
+	uint8_t device_id;
+	uint8_t kind; // One of the STATUS_DEVICE_* values
+	union
+	{
+		struct
+		{
+			uint32_t steps;
+			uint16_t speed;
+			uint8_t dir;
+		} command;
+		struct
+		{
+			uint8_t leader_id;
+			uint8_t numerator;
+			uint8_t denominator;
+			uint8_t is_inverted;
+		} gear;
+		struct
+		{
+			int32_t rate;
+			int32_t target;
+		} jog;
+	};
+} StatusDevice;
+
+// Values of the status response, copied by the status command and formatted from the main loop
+typedef struct
+{
+	uint8_t mode; // One of the MOTION_* values
+	uint8_t device_count;
+	StatusDevice devices[MOTOR_DEVICES + 1]; // The move command and every device in the move mode
+	uint8_t switches;
+	uint8_t queue_depth;
+	uint8_t queue_capacity;
+	uint16_t tick_rate;
+	uint32_t clock;
+	uint16_t step_counts[MOTOR_DEVICES];
+} StatusSnapshot;
+
+// The status snapshot is stored in the read buffer, aligned for the host build
+char read_buffer[TWI_BUFFER_SIZE] __attribute__((aligned(__alignof__(StatusSnapshot))));
 char write_buffer[TWI_BUFFER_SIZE];
 
 uint8_t bytes_read = 0;
 uint8_t bytes_written = 0;
 
-// Stores validation error codes when validating commands
+// Stores validation error codes when validating commands, also the status code of the command
 uint8_t error_validation_code = 0;
 
+// Status codes of the commands received in the current write transaction
+char response_codes[MULTI_COMMAND_MAX + 1];
+uint8_t commands_received = 0;
+// Set when a run command was rejected as buffer full, later run commands of the transaction are rejected to keep the order
+uint8_t is_transaction_buffer_full = 0;
+
+// Sequence numbers of the last accepted commands, a retried command found here is acknowledged without running again
+uint16_t sequence_history[SEQUENCE_HISTORY];
+uint8_t sequence_history_index = 0;
+uint16_t last_sequence = 0; // Sequence number of the last processed command
+uint8_t is_transaction_sequenced = 0; // Set when a command of the current write transaction has a sequence number
+uint8_t is_read_command = 0; // Set by commands that only read data, they run again when retried
+volatile uint8_t is_status_pending = 0; // Set when the status snapshot waits to be formatted by the main loop
+
+_Static_assert(sizeof(read_buffer) + sizeof(write_buffer) + sizeof(bytes_read) + sizeof(bytes_written)
+	+ sizeof(error_validation_code) + sizeof(response_codes) + sizeof(commands_received)
+	+ sizeof(is_transaction_buffer_full) + sizeof(sequence_history) + sizeof(sequence_history_index)
+	+ sizeof(last_sequence) + sizeof(is_transaction_sequenced) + sizeof(is_read_command) + sizeof(is_status_pending)
+	== TWI_SRAM_SIZE,
+	"TWI_SRAM_SIZE must count every twi.c variable");
+_Static_assert(sizeof(StatusSnapshot) <= TWI_BUFFER_SIZE, "The status snapshot must fit the read buffer");
+
 /**
 * Initializes the TWI0 peripheral
 */
@@ -39,6 +109,7 @@ void TWI0_init(uint8_t address)
 	// Initialize buffers with 0
 	memset(read_buffer, '\0', TWI_BUFFER_SIZE);
 	memset(write_buffer, '\0', TWI_BUFFER_SIZE);
+	clear_sequences();
 }
 
 /**
@@ -65,6 +136,14 @@ void TWI0_process_interrupt()
 		
 		if(TWI0.SSTATUS & TWI_AP_bm)
 		{
+			if(!(TWI0.SSTATUS & TWI_DIR_bm))
+			{
+				// Master starts writing, new set of commands
+				commands_received = 0;
+				is_transaction_buffer_full = 0;
+				is_transaction_sequenced = 0;
+				bytes_read = 0;
+			}
 			TWI0.SCTRLB = TWI_SCMD_RESPONSE_gc; // send ACK after address match
 		}
 		else
@@ -80,6 +159,12 @@ void TWI0_process_interrupt()
 		if(TWI0.SSTATUS & TWI_DIR_bm)
 		{
 			// Transmit data to Master
+			if(is_status_pending)
+			{
+				// The main loop formats the response, the clock is stretched until it enables the interrupt again
+				TWI0.SCTRLA &= ~TWI_DIEN_bm;
+				return;
+			}
 			if(bytes_written < TWI_BUFFER_SIZE)
 			{
 				uint8_t data = write_buffer[bytes_written];
@@ -98,12 +183,17 @@ void TWI0_process_interrupt()
 			if(bytes_read < TWI_BUFFER_SIZE)
 			{
 				uint8_t data = TWI0.SDATA;
+				is_status_pending = 0; // The read buffer holds the status snapshot, a later command replaces the status
 				read_buffer[bytes_read] = data;
 				if(data == 0x00) {
+					// End of a command, the next command of the same transaction starts at the beginning of the buffer
 					TWI0_process_command();
 					bytes_read = 0;
 				}
-				bytes_read++;
+				else
+				{
+					bytes_read++;
+				}
 				TWI0.SCTRLB = TWI_SCMD_RESPONSE_gc; // Send ACK, data received, wait for another interrupt
 			}
 			else
@@ -124,225 +214,495 @@ void set_response(char *response)
 	strcpy(write_buffer, response); // set new text
 }
 
+/**
+* Appends a string to the response in the write buffer, the response is cut to fit the buffer.
+*/
+void append_response(const char *text)
+{
+	uint8_t length = strlen(write_buffer);
+	while(*text != '\0' && length < TWI_BUFFER_SIZE - 1)
+	{
+		write_buffer[length++] = *text++;
+	}
+	write_buffer[length] = '\0';
+}
+
+/**
+* Appends an unsigned integer value to the response
+*/
+void append_response_number(unsigned long value)
+{
+	char digits[MAX_STR_NUM_SIZE];
+	uint8_t index = MAX_STR_NUM_SIZE - 1;
+	digits[index] = '\0';
+	do
+	{
+		digits[--index] = '0' + value % 10;
+		value /= 10;
+	} while(value > 0);
+	append_response(&digits[index]);
+}
+
+
+/**
+* Converts the device letter to the device id, returns MOTOR_DEVICES if the letter is invalid.
+*/
+uint8_t parse_device_id(char device)
+{
+	uint8_t device_id = (device | 0x20) - 'a'; // lower case
+	return device_id < MOTOR_DEVICES ? device_id : MOTOR_DEVICES;
+}
+
+/**
+* Parses one device value of a run or move command at the cursor.
+* Format: <device_id[A,B,C, or D]><steps[+/- 32-bit integer]>,<speed[+16-bit integer]>
+* Returns the device id, or MOTOR_DEVICES with error_validation_code set if a value is invalid.
+*/
+uint8_t parse_device_command(char **cursor, RunCommand *run_command)
+{
+	uint8_t device_id = parse_device_id(**cursor);
+	if(device_id >= MOTOR_DEVICES)
+	{
+		error_validation_code = 2; // Invalid device id
+		return MOTOR_DEVICES;
+	}
+	if((gear_mask | jog_mask) & (1 << device_id))
+	{
+		error_validation_code = 5; // Geared followers and jogging devices don't run commands, the device is busy
+		return MOTOR_DEVICES;
+	}
+	(*cursor)++;
+	
+	// Rotation direction, 1 - clockwise, 0 - counter clockwise
+	run_command->dir = **cursor == '-' ? 0 : 1;
+	if(**cursor == '-' || **cursor == '+')
+	{
+		(*cursor)++;
+	}
+	
+	// Get steps value
+	if(!parse_number(cursor, 0xFFFFFFFFUL, &run_command->steps))
+	{
+		error_validation_code = 3; // Invalid steps value
+		return MOTOR_DEVICES;
+	}
+	
+	// Get speed value
+	unsigned long speed;
+	if(!parse_number(cursor, 0xFFFF, &speed))
+	{
+		error_validation_code = 4; // Invalid speed value
+		return MOTOR_DEVICES;
+	}
+	run_command->speed = speed;
+	run_command->counter = 0;
+	
+	return device_id;
+}
 
 /**
 * Processes the run command.
 */
-void process_run()
+void process_run(char *cursor)
 {
 	error_validation_code = 0; // Reset error code
 	
-	// Check if buffer available
-	if(tail == head && (runCommnadsBufferA->steps > 0 || runCommnadsBufferB->steps > 0 || runCommnadsBufferC->steps > 0 || runCommnadsBufferD->steps > 0)) {
+	// Command values for each device, queued once the whole command is valid
+	RunCommand commands[MOTOR_DEVICES];
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		clear_command_struct(&commands[device_id]);
+	}
+	
+	while(*cursor != '\0')
+	{
+		RunCommand run_command;
+		uint8_t device_id = parse_device_command(&cursor, &run_command);
+		if(device_id >= MOTOR_DEVICES)
+		{
+			return;
+		}
+		commands[device_id] = run_command;
+	}
+	
+	// Check if buffer available, once a command was rejected later commands of the transaction are rejected too
+	if(is_transaction_buffer_full || !push_command(commands)) {
 		error_validation_code = 1; // Buffer is full
+		is_transaction_buffer_full = 1;
+	}
+}
+
+/**
+* Processes the PVT command.
+*/
+void process_pvt(char *cursor)
+{
+	error_validation_code = 0; // Reset error code
+	
+	// Knot duration in timer ticks
+	unsigned long duration;
+	if(!parse_number(&cursor, 0xFFFF, &duration) || duration == 0)
+	{
+		error_validation_code = 5; // Invalid duration
 		return;
 	}
 	
-	// Get first part of command with device id, direction and steps
-	char *command_value = strtok(NULL, COMMAND_DELIMITER);
-	while(command_value != NULL)
+	// Knot values for each device, the speed holds the end velocity in steps per second
+	RunCommand knots[MOTOR_DEVICES];
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		clear_command_struct(&knots[device_id]);
+	}
+	
+	while(*cursor != '\0')
 	{
-		RunCommand* run_command;
-		// Get command buffer location based on device id specified
-		switch(command_value[0])
+		RunCommand knot;
+		uint8_t device_id = parse_device_command(&cursor, &knot);
+		if(device_id >= MOTOR_DEVICES)
 		{
-			case 'A':
-			case 'a': run_command = &runCommnadsBufferA[tail]; break;
-			case 'B':
-			case 'b': run_command = &runCommnadsBufferB[tail]; break;
-			case 'C':
-			case 'c': run_command = &runCommnadsBufferC[tail]; break;
-			case 'D':
-			case 'd': run_command = &runCommnadsBufferD[tail]; break;
-			default: error_validation_code = 2; return;
+			return;
 		}
-		
-		// Rotation direction, 1 - clockwise, 0 - counter clockwise
-		run_command->dir = command_value[1] == '-' ? 0 : 1;
-		uint8_t step_value_index_start = command_value[1] == '-' ? 2 : 1;
-		
-		// Get steps value
-		run_command->steps = str2ulong(&command_value[step_value_index_start]);
-		if(num_conversion_error != 0)
+		if(knot.steps > 0xFFFF)
 		{
 			error_validation_code = 3; // Invalid steps value
-			break;
-		}
-		
-		// Get speed value
-		char *speed_value = strtok(NULL, COMMAND_DELIMITER);
-		run_command->speed = str2num(speed_value);
-		if(num_conversion_error != 0)
-		{
-			error_validation_code = 4; // Invalid speed value
-			break;
+			return;
 		}
-		run_command->counter = 0;
-		
-		// Read next command value
-		command_value = strtok(NULL, COMMAND_DELIMITER);
+		knots[device_id] = knot;
 	}
 	
-	// Move tail pointer only when there is no error
-	if(error_validation_code == 0) {
-		tail = (tail + 1) % COMMAND_BUFFER_SIZE;
+	// Check if buffer available, once a command was rejected later commands of the transaction are rejected too
+	if(is_transaction_buffer_full || !push_pvt_command(knots, duration)) {
+		error_validation_code = 1; // Buffer is full
+		is_transaction_buffer_full = 1;
 	}
-
 }
 
 /**
 * Processes the move command.
 */
-void process_move()
+void process_move(char *cursor)
 {
 	error_validation_code = 0; // Reset error code
 	
-	// Get move command part with device id, direction and steps
-	char *command_value = strtok(NULL, COMMAND_DELIMITER);
-	if(command_value != NULL)
+	// Only the first device value is used
+	RunCommand run_command;
+	uint8_t device_id = parse_device_command(&cursor, &run_command);
+	if(device_id < MOTOR_DEVICES)
 	{
-		switch(command_value[0])
-		{
-			case 'A':
-			case 'a': move_device_id = 0; break;
-			case 'B':
-			case 'b': move_device_id = 1; break;
-			case 'C':
-			case 'c': move_device_id = 2; break;
-			case 'D':
-			case 'd': move_device_id = 3; break;
-			default: error_validation_code = 2; return;
-		}
+		moveCommand = run_command;
+		move_device_id = device_id;
+	}
+}
 
-		
-		// Rotation direction, 1 - clockwise, 0 - counter clockwise
-		moveCommand.dir = command_value[1] == '-' ? 0 : 1;
-		uint8_t step_value_index_start = command_value[1] == '-' ? 2 : 1;
-		
-		// Get steps value
-		moveCommand.steps = str2ulong(&command_value[step_value_index_start]);
-		if(num_conversion_error != 0)
-		{
-			error_validation_code = 3; // Invalid steps value
-			return;
-		}
-		
-		// Get speed value
-		char *speed_value = strtok(NULL, COMMAND_DELIMITER);
-		moveCommand.speed = str2num(speed_value);
-		if(num_conversion_error != 0)
-		{
-			error_validation_code = 4; // Invalid speed value
-			return;
-		}
+/**
+* Processes the gear command.
+*/
+void process_gear(char *cursor)
+{
+	error_validation_code = 0; // Reset error code
+	
+	uint8_t follower_id = parse_device_id(*cursor);
+	if(follower_id >= MOTOR_DEVICES)
+	{
+		error_validation_code = 2; // Invalid device id
+		return;
 	}
-	else
+	cursor++;
+	skip_delimiters(&cursor);
+	if(*cursor == '\0')
 	{
-		error_validation_code = 2; // Invalid command
+		// No leader, the follower is released
+		clear_gear(follower_id);
+		return;
 	}
 	
+	uint8_t leader_id = parse_device_id(*cursor);
+	if(leader_id >= MOTOR_DEVICES)
+	{
+		error_validation_code = 2; // Invalid device id
+		return;
+	}
+	cursor++;
+	skip_delimiters(&cursor);
+	
+	// Negative ratio, the follower turns opposite to the leader
+	uint8_t is_inverted = *cursor == '-';
+	if(*cursor == '-' || *cursor == '+')
+	{
+		cursor++;
+	}
+	
+	// The ratio is parsed as two values, the numerator has to end at the slash
+	unsigned long numerator;
+	unsigned long denominator;
+	char *slash = strchr(cursor, '/');
+	if(slash == NULL)
+	{
+		error_validation_code = 5; // Invalid ratio
+		return;
+	}
+	*slash = ':';
+	if(!parse_number(&cursor, GEAR_RATIO_MAX, &numerator) || cursor != slash + 1
+		|| !parse_number(&cursor, GEAR_RATIO_MAX, &denominator) || *cursor != '\0'
+		|| numerator == 0 || numerator > denominator
+		|| !set_gear(follower_id, leader_id, numerator, denominator, is_inverted))
+	{
+		error_validation_code = 5; // Invalid ratio or gear
+	}
+}
+
+/**
+* Processes the jog command.
+*/
+void process_jog(char *cursor)
+{
+	error_validation_code = 0; // Reset error code
+	
+	uint8_t device_id = parse_device_id(*cursor);
+	if(device_id >= MOTOR_DEVICES)
+	{
+		error_validation_code = 2; // Invalid device id
+		return;
+	}
+	cursor++;
+	skip_delimiters(&cursor);
+	
+	// Rotation direction, 1 - clockwise, 0 - counter clockwise
+	uint8_t dir = *cursor == '-' ? 0 : 1;
+	if(*cursor == '-' || *cursor == '+')
+	{
+		cursor++;
+	}
+	
+	unsigned long velocity;
+	unsigned long acceleration = JOG_ACCELERATION_DEFAULT;
+	if(!parse_number(&cursor, 0xFFFF, &velocity)
+		|| (*cursor != '\0' && !parse_number(&cursor, 0xFFFF, &acceleration)))
+	{
+		error_validation_code = 4; // Invalid velocity or acceleration
+		return;
+	}
+	
+	// A limit switch stops jogging, only a move command clears it
+	if((is_switch_activated && velocity > 0) || !set_jog(device_id, dir, velocity, acceleration))
+	{
+		error_validation_code = 5; // Device busy
+	}
+}
+
+/**
+* Appends a signed velocity in steps per second to the response
+*/
+void append_velocity(int32_t rate)
+{
+	if(rate < 0)
+	{
+		append_response("-");
+	}
+	append_response_number(rate_to_velocity(rate));
 }
 
 /**
-* Attaches the command values to the status string.
+* Copies the values of a device line of the status: the command values, the velocities of a jogging device
+* or the gear of a geared follower.
 */
-void attachCommand(char* status, RunCommand* run_command, uint8_t device_id)
+void snapshot_device(StatusSnapshot* status, RunCommand* run_command, uint8_t device_id)
 {
-	char device[2] = {'A', '\0'};
-	device[0] = device_id + 'A';
-	strcat(status, "\n");
-	strcat(status, device); // Device id
-	strcat(status, ":");
-	if(!run_command->dir)
-	{
-		strcat(status, "-"); // direction
-	}
-	char *steps = num2str(run_command->steps);
-	char *speed = num2str(run_command->speed);
-	strcat(status, steps); // Steps
-	strcat(status, ",");
-	strcat(status, speed); // Speed
-	free(steps);
-	free(speed);
+	StatusDevice* device = &status->devices[status->device_count++];
+	device->device_id = device_id;
+	if(gear_mask & (1 << device_id))
+	{
+		device->kind = STATUS_DEVICE_GEAR;
+		device->gear.leader_id = gear_leaders[device_id];
+		device->gear.numerator = gear_numerators[device_id];
+		device->gear.denominator = gear_denominators[device_id];
+		device->gear.is_inverted = (gear_inverts >> device_id) & 1;
+	}
+	else if(jog_mask & (1 << device_id))
+	{
+		device->kind = STATUS_DEVICE_JOG;
+		device->jog.rate = jog_states[device_id].rate;
+		device->jog.target = jog_states[device_id].target;
+	}
+	else
+	{
+		device->kind = STATUS_DEVICE_RUN;
+		device->command.steps = run_command->steps;
+		device->command.speed = run_command->speed;
+		device->command.dir = run_command->dir;
+	}
 }
 
 /**
 * Processes the status command.
+* Only the values are copied in the TWI interrupt, the timer interrupt never runs during it, so every value belongs
+* to the same tick boundary. The main loop formats the response, see TWI0_format_status().
+* The snapshot is stored in the read buffer, the status command was processed and a later command of the same
+* write replaces the status response.
 */
 void process_status()
 {
-	char *status = malloc(sizeof(char)*TWI_BUFFER_SIZE);
+	StatusSnapshot* status = (StatusSnapshot*)read_buffer;
+	status->mode = get_motion_mode();
+	status->device_count = 0;
 	
-	if(move_device_id < MOTOR_DEVICES)
+	if(status->mode == MOTION_MOVE)
 	{
-		// Moving status
-		strcat(status, "\nMOVE");
-		attachCommand(status, &moveCommand, move_device_id);
+		snapshot_device(status, &moveCommand, move_device_id);
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			// Geared followers and jogging devices keep stepping
+			if((gear_mask | jog_mask) & (1 << device_id)) {
+				snapshot_device(status, &active_commands[device_id], device_id);
+			}
+		}
 	}
 	else
 	{
-		// Run commands status
-		if(is_paused)
-		{
-			strcat(status, "\nPAUSED");
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			snapshot_device(status, &active_commands[device_id], device_id);
 		}
-		else
+	}
+	
+	status->switches = (VPORTB.IN & LIMIT_SWITCHES_gm) >> 2;
+	status->queue_depth = queued_commands + is_active_command_running();
+	status->queue_capacity = get_queue_capacity();
+	status->tick_rate = tick_rate;
+	status->clock = tick_counter;
+	for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+		status->step_counts[device_id] = step_counts[device_id];
+	}
+	
+	set_response("");
+	is_status_pending = 1;
+}
+
+/**
+* Appends a device line of the status snapshot to the response
+*/
+void append_device_status(StatusDevice* device)
+{
+	char line[4] = {'\n', 'A', ':', '\0'};
+	line[1] = device->device_id + 'A';
+	append_response(line); // Device id
+	if(device->kind == STATUS_DEVICE_GEAR)
+	{
+		// Geared follower, format: G<leader_id><+/-><numerator>/<denominator>
+		char gear[4] = {'G', 'A', '+', '\0'};
+		gear[1] = device->gear.leader_id + 'A';
+		if(device->gear.is_inverted)
 		{
-			strcat(status, "\nRUN");
+			gear[2] = '-';
 		}
-		attachCommand(status, &runCommnadsBufferA[head], 0);
-		attachCommand(status, &runCommnadsBufferB[head], 1);
-		attachCommand(status, &runCommnadsBufferC[head], 2);
-		attachCommand(status, &runCommnadsBufferD[head], 3);
+		append_response(gear);
+		append_response_number(device->gear.numerator);
+		append_response("/");
+		append_response_number(device->gear.denominator);
+		return;
+	}
+	if(device->kind == STATUS_DEVICE_JOG)
+	{
+		// Jogging device, format: J<current velocity[+/-]>,<target velocity[+/-]>
+		append_response("J");
+		append_velocity(device->jog.rate);
+		append_response(",");
+		append_velocity(device->jog.target);
+		return;
+	}
+	if(!device->command.dir && device->command.steps > 0)
+	{
+		append_response("-"); // direction, an idle device has none
+	}
+	append_response_number(device->command.steps); // Steps
+	append_response(",");
+	append_response_number(device->command.speed); // Speed
+}
+
+/**
+* Formats the status response from the snapshot of the status command
+*/
+void format_status(StatusSnapshot* status)
+{
+	switch(status->mode)
+	{
+		case MOTION_MOVE: append_response("\nMOVE"); break;
+		case MOTION_PAUSED: append_response("\nPAUSED"); break;
+		case MOTION_PVT: append_response("\nPVT"); break;
+		default: append_response("\nRUN"); break;
+	}
+	for(uint8_t i = 0; i < status->device_count; i++) {
+		append_device_status(&status->devices[i]);
 	}
 	
 	// Limit switches status
-	strcat(status, "\nSW:");
-	switch(PORTB.IN >> 2) {
-		case 15: strcat(status, "NONE"); break;
-		case 14: strcat(status, "SW0"); break;
-		case 6: strcat(status, "SW1"); break;
-		case 10: strcat(status, "SW2"); break;
-		case 2: strcat(status, "SW3"); break;
-		case 12: strcat(status, "SW4"); break;
-		case 4: strcat(status, "SW5"); break;
-		case 8: strcat(status, "SW6"); break;
-		case 0: strcat(status, "SW5"); break;
-		default: strcat(status, "UNDF"); break;
+	append_response("\nSW:");
+	switch(status->switches) {
+		case 15: append_response("NONE"); break;
+		case 14: append_response("SW0"); break;
+		case 6: append_response("SW1"); break;
+		case 10: append_response("SW2"); break;
+		case 2: append_response("SW3"); break;
+		case 12: append_response("SW4"); break;
+		case 4: append_response("SW5"); break;
+		case 8: append_response("SW6"); break;
+		case 0: append_response("SW5"); break;
+		default: append_response("UNDF"); break;
 	}
 	
-	// Buffer status
-	char *buffer_size = num2str(COMMAND_BUFFER_SIZE); // Total buffer size
+	// Buffer status, total commands currently stored in the buffer, counted exactly by the queue,
+	// and the capacity counting free bytes in commands of the size of the last queued one
+	append_response("\nBUFF:");
+	append_response_number(status->queue_depth);
+	append_response("/");
+	append_response_number(status->queue_capacity);
 	
-	// Compute total commands currently stored in the buffer
-	int16_t commands = tail - head;
-	if(commands < 0) {
-		// negative, means tail index is before head index
-		commands += COMMAND_BUFFER_SIZE;
-	}
-	else if (commands == 0 && is_buffer_command_available(head))
+	// Timer tick rate, speed values are in ticks
+	append_response("\nTICK:");
+	append_response_number(status->tick_rate);
+	
+	// Ticks since start-up, to compute step rates between two status reads
+	append_response("\nCLK:");
+	append_response_number(status->clock);
+	
+	// Wrapping step counters of the devices, the steps between two status reads include the commands that
+	// started and finished in between. Left out when the device values are so long that the line
+	// and the acknowledgement would not fit the buffer.
+	if(strlen(write_buffer) + STATUS_COUNTS_MAX_SIZE + RESPONSE_ACK_MAX_SIZE < TWI_BUFFER_SIZE)
 	{
-		// case when buffer is full
-		commands = COMMAND_BUFFER_SIZE;
+		append_response("\nCNT:");
+		for(uint8_t device_id = 0; device_id < MOTOR_DEVICES; device_id++) {
+			if(device_id > 0)
+			{
+				append_response(",");
+			}
+			append_response_number(status->step_counts[device_id]);
+		}
 	}
-	else if (commands == 1 && !is_buffer_command_available(head))
+}
+
+/**
+* Formats the status response of the last status command, called from the main loop.
+* The 32-bit divisions of the numbers take milliseconds at the main clock, the timer interrupt keeps stepping
+* meanwhile. The TWI interrupts are held, a read of the response waits with the clock stretched and a write can't
+* change the buffers until the response is complete.
+*/
+void TWI0_format_status()
+{
+	if(!is_status_pending)
 	{
-		// case when head and tail index are next to each other but no commands running
-		commands = 0;
+		return;
 	}
 	
-	char *commands_in_buffer = num2str(commands);
-	strcat(status, "\nBUFF:");
-	strcat(status,commands_in_buffer);
-	strcat(status, "/");
-	strcat(status, buffer_size);
-	
-	set_response(status);
-	
-	// Clean up
-	free(commands_in_buffer);
-	free(buffer_size);
-	free(status);
+	TWI0.SCTRLA &= ~(TWI_DIEN_bm | TWI_APIEN_bm | TWI_PIEN_bm);
+	if(is_status_pending)
+	{
+		// Not replaced by a later command before the interrupts were held
+		StatusSnapshot* status = (StatusSnapshot*)read_buffer;
+		format_status(status);
+		if(is_transaction_sequenced)
+		{
+			append_acknowledgement(status->queue_depth);
+		}
+		is_status_pending = 0;
+	}
+	TWI0.SCTRLA |= TWI_DIEN_bm | TWI_APIEN_bm | TWI_PIEN_bm; // The interrupts held meanwhile run now
 }
 
 /**
@@ -356,129 +716,339 @@ void set_error_response()
 		case 2: set_response("INVALID DEVICE ID"); break;
 		case 3: set_response("INVALID STEPS VALUE"); break;
 		case 4: set_response("INVALID SPEED VALUE"); break;
+		case 5: set_response(RESPONSE_INVALID); break;
 		default: break;
 	}
 }
 
+// Matches the full command keyword at the cursor
+#define IS_COMMAND(keyword) match_keyword(&cursor, keyword)
+
 /**
-* Processes the commands received from the master
+* Processes the commands received from the master, dispatching on the first character of the command
 */
 void TWI0_process_command()
 {
-	if(bytes_read > 0)
+	if(bytes_read > 0 && commands_received < MULTI_COMMAND_MAX)
 	{
-		char *token = strtok(read_buffer, ":");
-		
+		char *cursor = read_buffer;
+		error_validation_code = 5; // Invalid command, unless a command matches
+		is_read_command = 0;
 		
-		if(strcmp("version", token) == 0)
+		// Optional sequence number
+		uint16_t sequence = 0;
+		uint8_t is_duplicate = 0;
+		if(*cursor == SEQUENCE_PREFIX)
 		{
-			// function: version
-			// Returns the device version
-			// Format: version
-			set_response(RESPONSE_VERSION);
-		}
-		else if(strcmp("setaddr", token) == 0)
-		{
-			// function: setaddr
-			// Sets the board I2C address
-			// Format: setaddr:<new_address_value>
-			process_set_address();
-		}
-		else if (strcmp("status", token) == 0)
-		{
-			// function: status
-			// Shows current status of the board
-			// Format: status
-			process_status();
-		}
-		else if (strcmp("run", token) == 0)
-		{
-			// function: run
-			// Add command to the buffer
-			// Format: run:<device_id[A,B,C, or D]>:<steps[+/- 32-bit integer]>,<speed[+16-bit integer]>:...
-			// If user specifies multiple commands for the same device, the last one will override previous values
-			error_validation_code = 0; // reset the error code
-			process_run();
-			if (error_validation_code > 0)
+			unsigned long value;
+			cursor++;
+			is_transaction_sequenced = 1;
+			if(parse_number(&cursor, 0xFFFF, &value) && value > 0)
 			{
-				// Clear any changes in the buffer, unless overflow
-				if(error_validation_code > 1)
-				{
-					clear_command_struct(&runCommnadsBufferA[tail]);
-					clear_command_struct(&runCommnadsBufferB[tail]);
-					clear_command_struct(&runCommnadsBufferC[tail]);
-					clear_command_struct(&runCommnadsBufferD[tail]);
-				}
-				set_error_response();
+				sequence = value;
+				is_duplicate = find_sequence(sequence);
 			}
 			else
 			{
-				set_response(RESPONSE_OK);
+				cursor = ""; // Invalid sequence number, the command is not run
 			}
 		}
-		else if (strcmp("move", token) == 0)
+		
+		// A duplicate was already accepted, it is acknowledged again
+		switch(is_duplicate ? '\0' : *cursor)
 		{
-			// function: move
-			// Moves only the specified motor, this command will pause other commands and reset the limit switch
-			// Will move only the first specified motor, others will be ignored
-			// Format: move:<device_id[A,B,C, or D]>:<steps[+/- 32-bit integer]>,<speed[+16-bit integer]>
-			error_validation_code = 0; // reset the error code
-			process_move();
-			if (error_validation_code > 0)
-			{
-				clear_command_struct(&moveCommand);
-				move_device_id = MOTOR_DEVICES;
-				set_error_response();
-			}
-			else
-			{
-				set_response(RESPONSE_OK);
-			}
+			case 'v':
+				if(IS_COMMAND("version"))
+				{
+					// function: version
+					// Returns the device version
+					// Format: version
+					error_validation_code = 0;
+					is_read_command = 1;
+					set_response(RESPONSE_VERSION);
+				}
+				break;
+			case 's':
+				if(IS_COMMAND("status"))
+				{
+					// function: status
+					// Shows current status of the board
+					// BUFF:<queued and running commands>/<capacity>, the capacity adds the commands of the size of the
+					// last queued one that fit the free queue bytes, commands of more devices or larger values take more
+					// CNT:<step counters of the devices>, wrapping at 65535, left out when the status is too long to fit it
+					// A geared follower shows G<leader_id><+/-><numerator>/<denominator> instead of its command values
+					// A jogging device shows J<current velocity>,<target velocity> in steps per second instead of its command values
+					// Format: status
+					error_validation_code = 0;
+					is_read_command = 1;
+					process_status();
+				}
+				else if(IS_COMMAND("session"))
+				{
+					// function: session
+					// Starts a session of sequenced commands, the sequence numbers accepted before are forgotten
+					// The queued commands keep running, the host sends it before the first command numbered from 1
+					// Format: session
+					error_validation_code = 0;
+					clear_sequences();
+					set_response(RESPONSE_OK);
+				}
+				else if(IS_COMMAND("setaddr"))
+				{
+					// function: setaddr
+					// Sets the board I2C address
+					// Format: setaddr:<new_address_value>
+					error_validation_code = 0;
+					process_set_address(cursor);
+				}
+				break;
+			case 'r':
+				if(IS_COMMAND("run"))
+				{
+					// function: run
+					// Add command to the buffer
+					// Format: run:<device_id[A,B,C, or D]>:<steps[+/- 32-bit integer]>,<speed[+16-bit integer]>:...
+					// If user specifies multiple commands for the same device, the last one will override previous values
+					process_run(cursor);
+					if (error_validation_code > 0)
+					{
+						// Nothing was queued
+						set_error_response();
+					}
+					else
+					{
+						set_response(RESPONSE_OK);
+					}
+				}
+				else if(IS_COMMAND("resume"))
+				{
+					// function: resume
+					// Resume paused commands, no effect if already running
+					// Format: resume
+					error_validation_code = 0;
+					is_paused = 0;
+					set_response(RESPONSE_OK);
+				}
+				else if(IS_COMMAND("reset"))
+				{
+					// function: reset
+					// Clears the command buffer, cancels the move command, stops jogging devices at once and releases the geared followers
+					// The sequence numbers accepted before are forgotten, like after the session command
+					// Format: reset
+					error_validation_code = 0;
+					clear_sequences();
+					clear_command_struct(&moveCommand);
+					move_device_id = MOTOR_DEVICES;
+					clear_command_buffer();
+					gear_mask = 0;
+					jog_mask = 0;
+					is_paused = 0;
+					set_response(RESPONSE_OK);
+				}
+				break;
+			case 'g':
+				if(IS_COMMAND("gear"))
+				{
+					// function: gear
+					// Steps the follower from the step pulses of the leader with a fixed ratio, up to 1/1
+					// The follower rejects its own commands while geared, gears are set while no command runs
+					// A negative ratio turns the follower opposite to the leader, without a leader the follower is released
+					// Format: gear:<follower_id[A,B,C, or D]>:<leader_id[A,B,C, or D]>:<ratio[+/- numerator/denominator, 1 - 255]>
+					process_gear(cursor);
+					if (error_validation_code > 0)
+					{
+						set_error_response();
+					}
+					else
+					{
+						set_response(RESPONSE_OK);
+					}
+				}
+				break;
+			case 'j':
+				if(IS_COMMAND("jog"))
+				{
+					// function: jog
+					// Steps the device continuously at the velocity, ramping with the acceleration, until a zero velocity
+					// or a limit switch stops it. The velocity and direction can be changed while the device jogs
+					// The device takes no queue slots and rejects its own commands while it jogs, other devices run commands
+					// Format: jog:<device_id[A,B,C, or D]>:<velocity[+/- steps per second, 16-bit integer]>[,<acceleration[steps per second squared, 16-bit integer, 0 - immediate]>]
+					process_jog(cursor);
+					if (error_validation_code > 0)
+					{
+						set_error_response();
+					}
+					else
+					{
+						set_response(RESPONSE_OK);
+					}
+				}
+				break;
+			case 'm':
+				if(IS_COMMAND("move"))
+				{
+					// function: move
+					// Moves only the specified motor, this command will pause other commands and reset the limit switch
+					// Will move only the first specified motor, others will be ignored
+					// Format: move:<device_id[A,B,C, or D]>:<steps[+/- 32-bit integer]>,<speed[+16-bit integer]>
+					process_move(cursor);
+					if (error_validation_code > 0)
+					{
+						clear_command_struct(&moveCommand);
+						move_device_id = MOTOR_DEVICES;
+						set_error_response();
+					}
+					else
+					{
+						set_response(RESPONSE_OK);
+					}
+				}
+				break;
+			case 't':
+				if(IS_COMMAND("tick"))
+				{
+					// function: tick
+					// Sets the timer tick rate, queued command speeds are rescaled to keep their step rate
+					// Rejected while PVT commands are queued or running or a device jogs, their step rates depend on the tick rate
+					// Format: tick:<ticks_per_second[50 - 20000]>
+					error_validation_code = 0;
+					process_tick(cursor);
+				}
+				break;
+			case 'p':
+				if(IS_COMMAND("pause"))
+				{
+					// function: pause
+					// Pause all commands, no effect if already paused
+					// Format: pause
+					error_validation_code = 0;
+					is_paused = 1;
+					set_response(RESPONSE_OK);
+				}
+				else if(IS_COMMAND("pvt"))
+				{
+					// function: pvt
+					// Add a position-velocity-time knot to the buffer, the step rate of each device changes linearly
+					// from the end velocity of the previous knot to the knot velocity over the duration
+					// Format: pvt:<duration[ticks, 16-bit integer]>:<device_id[A,B,C, or D]>:<steps[+/- 16-bit integer]>,<end_velocity[steps per second, 16-bit integer]>:...
+					// A knot without devices waits for the duration
+					process_pvt(cursor);
+					if (error_validation_code > 0)
+					{
+						// Nothing was queued
+						set_error_response();
+					}
+					else
+					{
+						set_response(RESPONSE_OK);
+					}
+				}
+				break;
+			default:
+				break;
 		}
-		else if (strcmp("pause", token) == 0)
+		
+		if(is_duplicate)
 		{
-			// function: pause
-			// Pause all commands, no effect if already paused
-			// Format: pause
-			is_paused = 1;
+			error_validation_code = 0;
 			set_response(RESPONSE_OK);
 		}
-		else if (strcmp("resume", token) == 0)
+		else if(sequence > 0)
 		{
-			// function: resume
-			// Resume paused commands, no effect if already running
-			// Format: resume
-			is_paused = 0;
-			set_response(RESPONSE_OK);
+			last_sequence = sequence;
+			if(error_validation_code == 0 && !is_read_command)
+			{
+				record_sequence(sequence);
+			}
 		}
-		else if (strcmp("reset", token) == 0)
+		
+		if(error_validation_code == 5)
 		{
-			// function: reset
-			// Clears the command buffer and cancels the move command
-			// Format: reset
-			clear_command_struct(&moveCommand);
-			move_device_id = MOTOR_DEVICES;
-			clear_command_buffer();
-			is_paused = 0;
-			set_response(RESPONSE_OK);
-			head = 0;
-			tail = 0;
+			set_error_response();
 		}
-		else
+		
+		append_command_status();
+	}
+}
+
+/**
+* Records the status code of the processed command.
+* When a transaction holds several commands the response is replaced by one status digit per command.
+* Format: R:<status[0-5]>...
+* Sequenced transactions end the response with the acknowledgement, format: ACK:<last_sequence>,<queue_depth>
+*/
+void append_command_status()
+{
+	response_codes[commands_received] = '0' + error_validation_code;
+	commands_received++;
+	response_codes[commands_received] = '\0';
+	
+	if(commands_received > 1)
+	{
+		is_status_pending = 0; // The status codes replace a status response
+		set_response(RESPONSE_MULTI_PREFIX);
+		append_response(response_codes);
+	}
+	
+	if(is_transaction_sequenced && !is_status_pending)
+	{
+		// A status response appends it once formatted
+		append_acknowledgement(queued_commands + is_active_command_running());
+	}
+}
+
+/**
+* Appends the piggybacked acknowledgement, the last processed sequence number and the commands in the buffer
+*/
+void append_acknowledgement(uint8_t queue_depth)
+{
+	append_response(RESPONSE_ACK);
+	append_response_number(last_sequence);
+	append_response(",");
+	append_response_number(queue_depth);
+}
+
+/**
+* Checks if a command with the sequence number was accepted recently
+*/
+uint8_t find_sequence(uint16_t sequence)
+{
+	for(uint8_t i = 0; i < SEQUENCE_HISTORY; i++)
+	{
+		if(sequence_history[i] == sequence)
 		{
-			set_response(RESPONSE_INVALID);
+			return 1;
 		}
 	}
+	return 0;
+}
+
+/**
+* Remembers the sequence number of an accepted command, replacing the oldest one
+*/
+void record_sequence(uint16_t sequence)
+{
+	sequence_history[sequence_history_index] = sequence;
+	sequence_history_index = (sequence_history_index + 1) % SEQUENCE_HISTORY;
+}
+
+/**
+* Forgets the accepted sequence numbers, the next session numbers its commands from 1 again
+*/
+void clear_sequences()
+{
+	memset(sequence_history, 0, sizeof(sequence_history));
+	sequence_history_index = 0;
+	last_sequence = 0;
 }
 
 /**
 * Updates the I2C Slave Address
 */
-void process_set_address()
+void process_set_address(char *cursor)
 {
-	char *param_token = strtok(NULL, COMMAND_DELIMITER);
-	uint16_t param = str2num(param_token);
-	if(param > 2 && param < 120)
+	unsigned long param;
+	if(parse_number(&cursor, 119, &param) && param > 2)
 	{
 		cli();
 		eeprom_update_byte(&eeprom_twi_address, param);
@@ -489,6 +1059,26 @@ void process_set_address()
 	}
 	else
 	{
+		error_validation_code = 5; // Invalid address
 		set_response(RESPONSE_INVALID);
 	}
 }
+
+/**
+* Updates the timer tick rate
+*/
+void process_tick(char *cursor)
+{
+	unsigned long param;
+	if(!is_pvt_active && queued_pvt_commands == 0 && !jog_mask
+		&& parse_number(&cursor, TICK_RATE_MAX, &param) && TCA0_set_tick_rate(param))
+	{
+		is_tick_rate_changed = 1; // Saved from the main loop, an EEPROM write would stop the steps
+		set_response(RESPONSE_OK);
+	}
+	else
+	{
+		error_validation_code = 5; // Invalid tick rate
+		set_response(RESPONSE_INVALID);
+	}
+}
\ No newline at end of file
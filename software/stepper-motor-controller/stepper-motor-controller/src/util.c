@@ -11,56 +11,88 @@
 #include <string.h>
 #include "util.h"
 
-uint8_t num_conversion_error = 0;
+/**
+* Checks if the character separates command values
+*/
+uint8_t is_delimiter(char c)
+{
+	return c == ':' || c == ';' || c == ',';
+}
 
 /**
-* Converts a string to a 16-bit unsigned integer, 
-* sets num_conversion_error variable if an invalid character found
+* Moves the cursor past the delimiters at its position
 */
-uint16_t str2num(char *str)
+void skip_delimiters(char **cursor)
 {
-	uint16_t result = 0;
-	num_conversion_error = 0;
-	if(str != NULL) {
-		short len = strlen(str);
-		for (short i = 0; i < len; i++) {
-			if(str[i] >= '0' && str[i] <= '9')
-			{
-				result = result * 10 + (str[i] - '0');
-			}
-			else
-			{
-				num_conversion_error = 1; // invalid character detected
-				return -1;
-			}
+	while(is_delimiter(**cursor))
+	{
+		(*cursor)++;
+	}
+}
+
+/**
+* Matches the command keyword at the cursor, the keyword must be followed by a delimiter or the end of the command.
+* On success moves the cursor to the first value after the keyword and returns 1.
+*/
+uint8_t match_keyword(char **cursor, const char *keyword)
+{
+	char *position = *cursor;
+	while(*keyword != '\0')
+	{
+		if(*position != *keyword)
+		{
+			return 0;
 		}
+		position++;
+		keyword++;
 	}
-	return result;
+	
+	if(*position != '\0' && !is_delimiter(*position))
+	{
+		return 0;
+	}
+	
+	skip_delimiters(&position);
+	*cursor = position;
+	return 1;
 }
 
 /**
-* Converts a string to an unsigned long,
-* sets num_conversion_error variable if an invalid character found
+* Parses an unsigned decimal number at the cursor, up to the next delimiter or the end of the command.
+* On success stores the value, moves the cursor to the next value and returns 1.
+* Returns 0 if there are no digits, an invalid character is found, or the value exceeds max_value.
 */
-unsigned long str2ulong(char *str)
+uint8_t parse_number(char **cursor, unsigned long max_value, unsigned long *value)
 {
+	char *position = *cursor;
 	unsigned long result = 0;
-	num_conversion_error = 0;
-	if(str != NULL) {
-		short len = strlen(str);
-		for (short i = 0; i < len; i++) {
-			if(str[i] >= '0' && str[i] <= '9')
-			{
-				result = result * 10 + (str[i] - '0');
-			}
-			else
-			{
-				num_conversion_error = 1; // invalid character detected
-				return -1;
-			}
+	
+	if(*position < '0' || *position > '9')
+	{
+		return 0; // no digits
+	}
+	
+	while(*position >= '0' && *position <= '9')
+	{
+		uint8_t digit = *position - '0';
+		// Overflow check without division, 4294967295 is the largest 32-bit value
+		if(result > 429496729UL || (result == 429496729UL && digit > 5))
+		{
+			return 0;
 		}
+		result = result * 10 + digit;
+		position++;
 	}
-	return result;
+	
+	if(result > max_value || (*position != '\0' && !is_delimiter(*position)))
+	{
+		return 0; // out of range or invalid character
+	}
+	
+	skip_delimiters(&position);
+	*cursor = position;
+	*value = result;
+	return 1;
 }
 
 /**
@@ -68,7 +100,7 @@ unsigned long str2ulong(char *str)
 */
 char* num2str(unsigned long value)
 {
-	// the max value of uint16_t has 5 digits, last character is null termination
+	// the max value of uint32_t has 10 digits, last character is null termination
 	char *str_value = malloc(sizeof(char)*MAX_STR_NUM_SIZE);
 	memset(str_value, '\0', MAX_STR_NUM_SIZE);
 	str_value[0] = '0'; // Initialize with zero to now show empty data
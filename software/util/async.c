@@ -0,0 +1,281 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "async.h"
+
+static void signal_event(AsyncBus *bus)
+{
+    uint64_t count = 1;
+    if (write(bus->event_fd, &count, sizeof(count)) != sizeof(count) && bus->verbose)
+    {
+        printf("Failed to signal the completion event\n");
+    }
+}
+
+static void consume_event(AsyncBus *bus)
+{
+    // Semaphore mode, each read takes one completion
+    uint64_t count;
+    if (read(bus->event_fd, &count, sizeof(count)) != sizeof(count) && bus->verbose)
+    {
+        printf("Failed to read the completion event\n");
+    }
+}
+
+static void *async_worker(void *argument)
+{
+    AsyncBus *bus = argument;
+
+    pthread_mutex_lock(&bus->lock);
+    while (true)
+    {
+        while (bus->pending_head == NULL && !bus->is_stopping)
+        {
+            pthread_cond_wait(&bus->pending_cond, &bus->lock);
+        }
+
+        AsyncRequest *request = bus->pending_head;
+        if (request == NULL)
+        {
+            // Stopping, every submitted request was sent
+            break;
+        }
+        bus->pending_head = request->next;
+        if (bus->pending_head == NULL)
+        {
+            bus->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&bus->lock);
+
+        // The transfer runs without the lock, callers keep submitting meanwhile
+        request->is_ok = transfer_data(bus->handle, bus->address, request->message, request->response, bus->verbose);
+        request->complete_ns = monotonic_ns();
+
+        pthread_mutex_lock(&bus->lock);
+        request->next = NULL;
+        request->is_done = true;
+        if (request->callback == NULL)
+        {
+            if (bus->completed_tail != NULL)
+            {
+                bus->completed_tail->next = request;
+            }
+            else
+            {
+                bus->completed_head = request;
+            }
+            bus->completed_tail = request;
+            signal_event(bus);
+            pthread_cond_broadcast(&bus->done_cond);
+        }
+        else
+        {
+            pthread_mutex_unlock(&bus->lock);
+            request->callback(request, request->context);
+            pthread_mutex_lock(&bus->lock);
+        }
+    }
+    pthread_mutex_unlock(&bus->lock);
+
+    return NULL;
+}
+
+AsyncBus *async_open(uint8_t address, bool verbose)
+{
+    AsyncBus *bus = malloc(sizeof(AsyncBus));
+    if (bus == NULL)
+    {
+        return NULL;
+    }
+
+    bus->address = address;
+    bus->verbose = verbose;
+    bus->is_stopping = false;
+    bus->handle = open_device(address, verbose);
+    if (bus->handle < 0)
+    {
+        free(bus);
+        return NULL;
+    }
+
+    bus->event_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+    if (bus->event_fd < 0)
+    {
+        close_device(bus->handle);
+        free(bus);
+        return NULL;
+    }
+
+    bus->free_requests = NULL;
+    for (int i = ASYNC_POOL_SIZE - 1; i >= 0; i--)
+    {
+        bus->pool[i].next = bus->free_requests;
+        bus->free_requests = &bus->pool[i];
+    }
+    bus->pending_head = NULL;
+    bus->pending_tail = NULL;
+    bus->completed_head = NULL;
+    bus->completed_tail = NULL;
+
+    pthread_mutex_init(&bus->lock, NULL);
+    pthread_cond_init(&bus->pending_cond, NULL);
+    pthread_cond_init(&bus->done_cond, NULL);
+    if (pthread_create(&bus->worker, NULL, async_worker, bus) != 0)
+    {
+        if (verbose)
+        {
+            printf("Failed to start the bus worker\n");
+        }
+        pthread_cond_destroy(&bus->done_cond);
+        pthread_cond_destroy(&bus->pending_cond);
+        pthread_mutex_destroy(&bus->lock);
+        close(bus->event_fd);
+        close_device(bus->handle);
+        free(bus);
+        return NULL;
+    }
+
+    return bus;
+}
+
+void async_close(AsyncBus *bus)
+{
+    pthread_mutex_lock(&bus->lock);
+    bus->is_stopping = true;
+    pthread_cond_signal(&bus->pending_cond);
+    pthread_mutex_unlock(&bus->lock);
+    pthread_join(bus->worker, NULL);
+
+    pthread_cond_destroy(&bus->done_cond);
+    pthread_cond_destroy(&bus->pending_cond);
+    pthread_mutex_destroy(&bus->lock);
+    close(bus->event_fd);
+    close_device(bus->handle);
+    free(bus);
+}
+
+AsyncRequest *async_submit(AsyncBus *bus, const char *message, char *response,
+                           AsyncCallback callback, void *context)
+{
+    size_t length = strlen(message);
+    if (length >= MAX_BUFFER_SIZE)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bus->lock);
+    AsyncRequest *request = bus->free_requests;
+    if (request == NULL)
+    {
+        pthread_mutex_unlock(&bus->lock);
+        return NULL;
+    }
+    bus->free_requests = request->next;
+
+    memcpy(request->message, message, length + 1);
+    request->response = response != NULL ? response : request->pool_response;
+    request->is_ok = false;
+    request->is_done = false;
+    request->submit_ns = monotonic_ns();
+    request->complete_ns = 0;
+    request->callback = callback;
+    request->context = context;
+    request->next = NULL;
+
+    if (bus->pending_tail != NULL)
+    {
+        bus->pending_tail->next = request;
+    }
+    else
+    {
+        bus->pending_head = request;
+    }
+    bus->pending_tail = request;
+    pthread_cond_signal(&bus->pending_cond);
+    pthread_mutex_unlock(&bus->lock);
+
+    return request;
+}
+
+int async_event_fd(AsyncBus *bus)
+{
+    return bus->event_fd;
+}
+
+AsyncRequest *async_poll(AsyncBus *bus)
+{
+    pthread_mutex_lock(&bus->lock);
+    AsyncRequest *request = bus->completed_head;
+    if (request != NULL)
+    {
+        bus->completed_head = request->next;
+        if (bus->completed_head == NULL)
+        {
+            bus->completed_tail = NULL;
+        }
+        request->next = NULL;
+        consume_event(bus);
+    }
+    pthread_mutex_unlock(&bus->lock);
+
+    return request;
+}
+
+bool async_wait(AsyncBus *bus, AsyncRequest *request)
+{
+    pthread_mutex_lock(&bus->lock);
+    while (!request->is_done)
+    {
+        pthread_cond_wait(&bus->done_cond, &bus->lock);
+    }
+
+    // Taken out of the completed requests, it is not returned by async_poll()
+    AsyncRequest *previous = NULL;
+    for (AsyncRequest *completed = bus->completed_head; completed != NULL; completed = completed->next)
+    {
+        if (completed == request)
+        {
+            if (previous != NULL)
+            {
+                previous->next = request->next;
+            }
+            else
+            {
+                bus->completed_head = request->next;
+            }
+            if (bus->completed_tail == request)
+            {
+                bus->completed_tail = previous;
+            }
+            request->next = NULL;
+            consume_event(bus);
+            break;
+        }
+        previous = completed;
+    }
+    pthread_mutex_unlock(&bus->lock);
+
+    return request->is_ok;
+}
+
+void async_release(AsyncBus *bus, AsyncRequest *request)
+{
+    pthread_mutex_lock(&bus->lock);
+    request->next = bus->free_requests;
+    bus->free_requests = request;
+    pthread_mutex_unlock(&bus->lock);
+}
@@ -0,0 +1,135 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "i2clib.h"
+
+#define ASYNC_POOL_SIZE 64 // Requests that can be in flight on one bus
+
+typedef struct AsyncRequest AsyncRequest;
+
+// Called from the bus worker thread when a request is complete
+typedef void (*AsyncCallback)(AsyncRequest *request, void *context);
+
+struct AsyncRequest
+{
+    char message[MAX_BUFFER_SIZE];
+    char *response; // Response buffer of MAX_BUFFER_SIZE bytes, the pooled buffer or the one given by the caller
+    bool is_ok; // Set on completion, true if a response was read
+    bool is_done;
+    uint64_t submit_ns;
+    uint64_t complete_ns;
+    AsyncCallback callback;
+    void *context;
+    AsyncRequest *next;
+    char pool_response[MAX_BUFFER_SIZE];
+};
+
+typedef struct
+{
+    uint8_t address;
+    bool verbose;
+    int handle;
+    int event_fd;
+    bool is_stopping;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t pending_cond; // Signals the worker that a request was submitted
+    pthread_cond_t done_cond; // Signals the waiting callers that a request is complete
+    AsyncRequest *free_requests;
+    AsyncRequest *pending_head;
+    AsyncRequest *pending_tail;
+    AsyncRequest *completed_head;
+    AsyncRequest *completed_tail;
+    AsyncRequest pool[ASYNC_POOL_SIZE];
+} AsyncBus;
+
+/**
+ * function: async_open()
+ * 
+ * Opens a device session through the active transport and starts the worker thread that runs its transfers.
+ * Requests are taken from a pool allocated here, submitting a request does not allocate memory.
+ * Returns the bus or NULL if the device couldn't be opened.
+ * @parameter address - i2c device address
+ * @parameter verbose - print additional details
+ * 
+ */
+extern AsyncBus *async_open(uint8_t address, bool verbose);
+
+/**
+ * function: async_close()
+ * 
+ * Completes the submitted requests, stops the worker and closes the device session.
+ * Requests still held by the caller are invalid afterwards.
+ * @parameter bus - bus returned by async_open()
+ * 
+ */
+extern void async_close(AsyncBus *bus);
+
+/**
+ * function: async_submit()
+ * 
+ * Queues a message to be sent by the bus worker, see transfer_data() for the message format.
+ * On completion the callback is called from the worker thread. Without a callback the request is added
+ * to the completed requests returned by async_poll() and the event file descriptor becomes readable.
+ * Returns the request handle, or NULL if the message is too long or every pooled request is in use.
+ * @parameter bus - bus returned by async_open()
+ * @parameter message - the message to be sent to the device, copied to the request
+ * @parameter response - buffer of MAX_BUFFER_SIZE bytes for the response, NULL uses the pooled buffer
+ * @parameter callback - completion callback, may be NULL
+ * @parameter context - passed to the callback
+ * 
+ */
+extern AsyncRequest *async_submit(AsyncBus *bus, const char *message, char *response,
+                                  AsyncCallback callback, void *context);
+
+/**
+ * function: async_event_fd()
+ * 
+ * Returns an eventfd that is readable while completed requests without a callback are waiting in async_poll().
+ * @parameter bus - bus returned by async_open()
+ * 
+ */
+extern int async_event_fd(AsyncBus *bus);
+
+/**
+ * function: async_poll()
+ * 
+ * Returns the next completed request submitted without a callback, or NULL if there is none. Does not block.
+ * @parameter bus - bus returned by async_open()
+ * 
+ */
+extern AsyncRequest *async_poll(AsyncBus *bus);
+
+/**
+ * function: async_wait()
+ * 
+ * Blocks until a request submitted without a callback is complete. Returns true if a response was read.
+ * The request is not returned by async_poll() afterwards, the caller releases it.
+ * @parameter bus - bus returned by async_open()
+ * @parameter request - request returned by async_submit()
+ * 
+ */
+extern bool async_wait(AsyncBus *bus, AsyncRequest *request);
+
+/**
+ * function: async_release()
+ * 
+ * Returns a completed request to the pool. May be called from the completion callback.
+ * @parameter bus - bus returned by async_open()
+ * @parameter request - completed request
+ * 
+ */
+extern void async_release(AsyncBus *bus, AsyncRequest *request);
+
+#endif /* ASYNC_H_ */
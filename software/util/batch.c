@@ -0,0 +1,293 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "optimize.h"
+#include "batch.h"
+
+char *trim_line(char *line)
+{
+    while (*line == ' ' || *line == '\t')
+    {
+        line++;
+    }
+
+    size_t length = strlen(line);
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' ||
+                          line[length - 1] == ' ' || line[length - 1] == '\t'))
+    {
+        line[--length] = '\0';
+    }
+
+    return line;
+}
+
+typedef struct
+{
+    int handle;
+    uint8_t address;
+    bool verbose;
+    LatencyStats stats; // Latency of each transaction, including the retries
+    // Backoff adapts to the rate the board drains its buffer, it is kept between commands
+    uint32_t backoff_us;
+    int worst_status;
+    int commands;
+    int rejected;
+    int retries;
+    int transactions;
+    bool is_sequenced;
+    int next_sequence;
+    int last_ack; // Last sequence number acknowledged by the board, -1 before the first one
+    int queue_depth;
+    int lost_replies;
+} BatchState;
+
+/**
+ * Records the result of one command and prints its response.
+ */
+static void complete_command(BatchState *state, const char *response)
+{
+    int status = classify_response(response);
+    state->commands++;
+    if (status != RESPONSE_ACCEPTED)
+    {
+        state->rejected++;
+    }
+    if (status > state->worst_status)
+    {
+        state->worst_status = status;
+    }
+    printf("%s\n", response);
+}
+
+/**
+ * Waits for buffer space after a BUFFER FULL response. Returns false when the timeout was reached.
+ */
+static bool backoff(BatchState *state, uint64_t *waited_us)
+{
+    if (*waited_us >= BACKOFF_TIMEOUT_MS * 1000ULL)
+    {
+        return false;
+    }
+    usleep(state->backoff_us);
+    *waited_us += state->backoff_us;
+    state->retries++;
+    state->backoff_us = state->backoff_us * 2 < BACKOFF_MAX_US ? state->backoff_us * 2 : BACKOFF_MAX_US;
+    return true;
+}
+
+/**
+ * Sends the commands of the frame in one write, retrying the commands rejected as buffer full.
+ * The board rejects every run command after the first buffer full one in the same write, so the order is kept.
+ */
+static void send_frame(BatchState *state, CommandFrame *frame)
+{
+    char response[MAX_BUFFER_SIZE];
+    char codes[MULTI_COMMAND_MAX];
+    int start = 0;
+    int offset = 0; // Frame bytes of the commands before the start one
+    int resends = 0;
+    uint64_t waited_us = 0;
+
+    while (start < frame->commands)
+    {
+        uint64_t start_ns = monotonic_ns();
+        bool is_sent = transfer_frame(state->handle, state->address, frame->data + offset, frame->length - offset,
+                                      response, state->verbose);
+        stats_add(&state->stats, monotonic_ns() - start_ns);
+        state->transactions++;
+
+        if (state->is_sequenced)
+        {
+            // A lost reply, or a garbled one without the acknowledgement, doesn't tell which commands were queued.
+            // The same sequence numbers are sent again and the board skips the accepted commands.
+            if ((!is_sent || !parse_ack(response, &state->last_ack, &state->queue_depth)) && resends < LOST_REPLY_RETRIES)
+            {
+                resends++;
+                state->lost_replies++;
+                usleep(BACKOFF_MIN_US);
+                continue;
+            }
+        }
+
+        int count = frame->commands - start;
+        if (count == 1)
+        {
+            codes[0] = strcmp(response, RESPONSE_BUFFER_FULL) == 0 ? COMMAND_STATUS_BUFFER_FULL : COMMAND_STATUS_OK;
+        }
+        else if (parse_multi_response(response, codes) != count)
+        {
+            // Not an aggregated response, every remaining command failed with it
+            for (int i = start; i < frame->commands; i++)
+            {
+                complete_command(state, response);
+            }
+            break;
+        }
+
+        int i = 0;
+        while (i < count && codes[i] != COMMAND_STATUS_BUFFER_FULL)
+        {
+            complete_command(state, count == 1 ? response : response_for_code(codes[i]));
+            offset += strlen(frame->data + offset) + 1;
+            i++;
+        }
+        start += i;
+
+        if (start < frame->commands)
+        {
+            // Buffer full, wait for the board to run queued commands and send the rest again
+            if (!backoff(state, &waited_us))
+            {
+                for (; start < frame->commands; start++)
+                {
+                    complete_command(state, RESPONSE_BUFFER_FULL);
+                }
+            }
+        }
+        else if (waited_us == 0 && state->backoff_us > BACKOFF_MIN_US)
+        {
+            // Accepted without waiting, shorten the next backoff
+            state->backoff_us /= 2;
+        }
+    }
+
+    frame_clear(frame);
+}
+
+/**
+ * Starts a session of sequenced commands, the board forgets the sequence numbers of an earlier batch.
+ * Without it the commands numbered from 1 again would be acknowledged as retries and never run.
+ * Returns false if the board did not start the session.
+ */
+static bool start_session(BatchState *state)
+{
+    char response[MAX_BUFFER_SIZE];
+    for (int sends = 0; sends <= LOST_REPLY_RETRIES; sends++)
+    {
+        bool is_sent = transfer_data(state->handle, state->address, SESSION_COMMAND, response, state->verbose);
+        state->transactions++;
+        if (is_sent && strcmp(response, RESPONSE_OK) == 0)
+        {
+            return true;
+        }
+        if (is_sent && classify_response(response) == RESPONSE_REJECTED)
+        {
+            break; // Firmware without sessions
+        }
+        state->lost_replies++;
+        usleep(BACKOFF_MIN_US);
+    }
+    fprintf(stderr, "The board did not start a session of sequenced commands: %s\n", response);
+    return false;
+}
+
+int run_batch(FILE *input, uint8_t address, bool sequenced, bool verbose)
+{
+    char line[MAX_BUFFER_SIZE + 2];
+    char sequenced_command[MAX_BUFFER_SIZE + 16];
+    CommandFrame frame;
+    BatchState state = {
+        .address = address,
+        .verbose = verbose,
+        .backoff_us = BACKOFF_MIN_US,
+        .worst_status = RESPONSE_ACCEPTED,
+        .is_sequenced = sequenced,
+        .next_sequence = 1,
+        .last_ack = -1,
+    };
+
+    state.handle = open_device(address, verbose);
+    if (state.handle < 0)
+    {
+        fprintf(stderr, "Failed to open the device at address 0x%02x: %s\n", address, strerror(errno));
+        return RESPONSE_LIB_ERROR;
+    }
+
+    if (state.is_sequenced && !start_session(&state))
+    {
+        close_device(state.handle);
+        return RESPONSE_LIB_ERROR;
+    }
+
+    stats_init(&state.stats);
+    frame_clear(&frame);
+    uint64_t batch_start_ns = monotonic_ns();
+
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        if (strchr(line, '\n') == NULL && !feof(input))
+        {
+            // Skip the rest of a line longer than the device buffer
+            int c;
+            while ((c = fgetc(input)) != '\n' && c != EOF)
+            {
+            }
+            fprintf(stderr, "Command too long, skipped\n");
+            state.worst_status = state.worst_status > RESPONSE_REJECTED ? state.worst_status : RESPONSE_REJECTED;
+            continue;
+        }
+
+        char *command = trim_line(line);
+        if (command[0] == '#')
+        {
+            continue;
+        }
+
+        // Several commands of a line are separated by spaces, like the frames printed by util optimize
+        char *context;
+        for (command = strtok_r(command, " \t", &context); command != NULL; command = strtok_r(NULL, " \t", &context))
+        {
+            if (state.is_sequenced)
+            {
+                snprintf(sequenced_command, sizeof(sequenced_command), "%c%d:%s", SEQUENCE_PREFIX, state.next_sequence, command);
+                state.next_sequence = state.next_sequence < SEQUENCE_MAX ? state.next_sequence + 1 : 1;
+                command = sequenced_command;
+                if (strlen(command) + 1 > MAX_BUFFER_SIZE)
+                {
+                    fprintf(stderr, "Command too long, skipped\n");
+                    state.worst_status = state.worst_status > RESPONSE_REJECTED ? state.worst_status : RESPONSE_REJECTED;
+                    continue;
+                }
+            }
+
+            // Consecutive run commands are packed in one write as long as they fit the device buffer
+            if (!frame_add(&frame, command))
+            {
+                send_frame(&state, &frame);
+                frame_add(&frame, command);
+            }
+            if (!frame.is_run)
+            {
+                send_frame(&state, &frame);
+            }
+        }
+    }
+    send_frame(&state, &frame);
+
+    uint64_t elapsed_ns = monotonic_ns() - batch_start_ns;
+    close_device(state.handle);
+
+    stats_print(stderr, &state.stats, "Batch", elapsed_ns);
+    fprintf(stderr, "Commands: %d, failed: %d, transactions: %d, buffer full retries: %d\n",
+            state.commands, state.rejected, state.transactions, state.retries);
+    if (state.is_sequenced)
+    {
+        fprintf(stderr, "Lost replies: %d, last acknowledged sequence: %d, queue depth: %d\n",
+                state.lost_replies, state.last_ack, state.queue_depth);
+    }
+    stats_free(&state.stats);
+
+    return state.worst_status;
+}
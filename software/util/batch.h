@@ -0,0 +1,47 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#define BACKOFF_MIN_US 1000 // First wait after a BUFFER FULL response
+#define BACKOFF_MAX_US 250000 // Longest wait between two retries
+#define BACKOFF_TIMEOUT_MS 60000 // Give up on a command after waiting this long for buffer space
+#define LOST_REPLY_RETRIES 3 // Sends of sequenced commands again after a lost or garbled reply
+#define SESSION_COMMAND "session" // Makes the board forget the sequence numbers of an earlier batch
+
+/**
+ * function: trim_line()
+ * 
+ * Removes the line ending and surrounding spaces in place, returns the trimmed command.
+ * @parameter line - line read from the input
+ * 
+ */
+extern char *trim_line(char *line);
+
+/**
+ * function: run_batch()
+ * 
+ * Sends the commands of a stream, one per line or several separated by spaces, over one device session and
+ * prints every response.
+ * Empty lines and lines starting with '#' are skipped. Consecutive run commands are sent several per write.
+ * Commands rejected with BUFFER FULL are retried with an adaptive backoff.
+ * Sequenced commands are numbered with the @<sequence>: prefix, they are sent again when the reply is lost
+ * or has no acknowledgement, the board acknowledges the ones it already accepted without running them twice.
+ * A sequenced batch starts a session first, the numbers start from 1 again.
+ * Prints throughput and latency statistics of the transactions to stderr at the end.
+ * Returns RESPONSE_ACCEPTED if every command was accepted, otherwise the worst response class.
+ * @parameter input - stream with the commands
+ * @parameter address - i2c device address
+ * @parameter sequenced - number the commands
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int run_batch(FILE *input, uint8_t address, bool sequenced, bool verbose);
+
+#endif /* BATCH_H_ */
@@ -0,0 +1,379 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "async.h"
+#include "batch.h"
+#include "emulator.h"
+#include "fault.h"
+#include "bench.h"
+
+#define BENCH_ADDRESS 0x50
+
+static void sleep_bus_time(int bytes)
+{
+    // Address byte and data bytes, 8 bits and an acknowledge bit each
+    uint64_t duration_ns = (uint64_t)(bytes + 1) * 9 * 1000000000ULL / BENCH_BUS_CLOCK_HZ;
+    struct timespec duration = {
+        .tv_sec = duration_ns / 1000000000ULL,
+        .tv_nsec = duration_ns % 1000000000ULL,
+    };
+    nanosleep(&duration, NULL);
+}
+
+static int simulated_open(uint8_t address, bool verbose)
+{
+    return 0;
+}
+
+static int simulated_write(int handle, const char *data, int length)
+{
+    sleep_bus_time(length);
+    return length;
+}
+
+static int simulated_read(int handle, char *data, int length)
+{
+    sleep_bus_time(length);
+    memset(data, '\0', length);
+    strcpy(data, RESPONSE_OK);
+    return length;
+}
+
+static void simulated_close(int handle)
+{
+}
+
+static const I2cTransport simulated_transport = {
+    .name = "simulated device",
+    .open = simulated_open,
+    .write = simulated_write,
+    .read = simulated_read,
+    .close = simulated_close,
+};
+
+static int run_blocking(int requests, bool verbose)
+{
+    LatencyStats stats;
+    int errors = 0;
+
+    stats_init(&stats);
+    uint64_t run_start_ns = monotonic_ns();
+    for (int i = 0; i < requests; i++)
+    {
+        uint64_t start_ns = monotonic_ns();
+        char *response = send_get_data(BENCH_ADDRESS, BENCH_MESSAGE, verbose);
+        stats_add(&stats, monotonic_ns() - start_ns);
+        if (strcmp(response, RESPONSE_OK) != 0)
+        {
+            errors++;
+        }
+        free(response);
+    }
+    uint64_t elapsed_ns = monotonic_ns() - run_start_ns;
+
+    stats_print(stdout, &stats, "Blocking", elapsed_ns);
+    stats_free(&stats);
+    return errors;
+}
+
+static int run_async(int requests, int depth, int buses, bool verbose)
+{
+    AsyncBus *bus_list[buses];
+    struct pollfd poll_list[buses];
+    LatencyStats stats;
+    int submitted = 0;
+    int completed = 0;
+    int errors = 0;
+
+    for (int i = 0; i < buses; i++)
+    {
+        bus_list[i] = async_open(BENCH_ADDRESS, verbose);
+        if (bus_list[i] == NULL)
+        {
+            printf("Failed to open bus %d\n", i);
+            for (int j = 0; j < i; j++)
+            {
+                async_close(bus_list[j]);
+            }
+            return requests;
+        }
+        poll_list[i].fd = async_event_fd(bus_list[i]);
+        poll_list[i].events = POLLIN;
+    }
+
+    stats_init(&stats);
+    uint64_t run_start_ns = monotonic_ns();
+
+    // Fill the pipeline of every bus
+    for (int i = 0; i < buses; i++)
+    {
+        for (int j = 0; j < depth && submitted < requests; j++)
+        {
+            if (async_submit(bus_list[i], BENCH_MESSAGE, NULL, NULL, NULL) != NULL)
+            {
+                submitted++;
+            }
+        }
+    }
+
+    // Refill a bus with one request for each completed one
+    while (completed < submitted)
+    {
+        if (poll(poll_list, buses, -1) < 0)
+        {
+            break;
+        }
+        for (int i = 0; i < buses; i++)
+        {
+            AsyncRequest *request;
+            while ((request = async_poll(bus_list[i])) != NULL)
+            {
+                stats_add(&stats, request->complete_ns - request->submit_ns);
+                if (!request->is_ok || strcmp(request->response, RESPONSE_OK) != 0)
+                {
+                    errors++;
+                }
+                completed++;
+                async_release(bus_list[i], request);
+                if (submitted < requests && async_submit(bus_list[i], BENCH_MESSAGE, NULL, NULL, NULL) != NULL)
+                {
+                    submitted++;
+                }
+            }
+        }
+    }
+    uint64_t elapsed_ns = monotonic_ns() - run_start_ns;
+
+    for (int i = 0; i < buses; i++)
+    {
+        async_close(bus_list[i]);
+    }
+
+    char title[64];
+    snprintf(title, sizeof(title), "Async, %d bus(es), depth %d", buses, depth);
+    stats_print(stdout, &stats, title, elapsed_ns);
+    stats_free(&stats);
+    return errors + requests - completed;
+}
+
+int run_benchmark(int requests, int depth, int buses, bool verbose)
+{
+    if (depth > ASYNC_POOL_SIZE)
+    {
+        depth = ASYNC_POOL_SIZE;
+    }
+
+    set_transport(&simulated_transport);
+    printf("Simulated device at %d Hz, message %s\n", BENCH_BUS_CLOCK_HZ, BENCH_MESSAGE);
+    int errors = run_blocking(requests, verbose);
+    errors += run_async(requests, depth, buses, verbose);
+    set_transport(NULL);
+
+    printf("Errors: %d\n", errors);
+    return errors > 0 ? 1 : 0;
+}
+
+/**
+ * Sends the commands to the emulated board, up to per_write commands in one write, and waits for the
+ * board to run them. BUFFER FULL responses are retried after a backoff in virtual time.
+ */
+static int run_emulated(const char *title, int commands, int per_write, bool sequenced, uint32_t bus_clock_hz, bool verbose)
+{
+    char message[MULTI_COMMAND_MAX * MAX_BUFFER_SIZE];
+    char command[MAX_BUFFER_SIZE];
+    char response[MAX_BUFFER_SIZE];
+    char codes[MULTI_COMMAND_MAX];
+    LatencyStats stats;
+    uint64_t backoff_ns = BACKOFF_MIN_US * 1000ULL;
+    int sent = 0;
+    int errors = 0;
+    int retries = 0;
+
+    emulator_reset(BENCH_ADDRESS, bus_clock_hz, false);
+    int handle = open_device(BENCH_ADDRESS, verbose);
+    stats_init(&stats);
+    uint64_t wall_start_ns = monotonic_ns();
+
+    while (sent < commands)
+    {
+        // Commands of one write have to fit the board buffer
+        int count = 0;
+        int length = 0;
+        message[0] = '\0';
+        while (count < per_write && sent + count < commands)
+        {
+            if (sequenced)
+            {
+                snprintf(command, sizeof(command), "%c%d:%s", SEQUENCE_PREFIX, (sent + count) % SEQUENCE_MAX + 1, BENCH_EMULATOR_COMMAND);
+            }
+            else
+            {
+                strcpy(command, BENCH_EMULATOR_COMMAND);
+            }
+            if (count > 0 && length + strlen(command) + 1 > MAX_BUFFER_SIZE)
+            {
+                break;
+            }
+            if (count > 0)
+            {
+                strcat(message, "\n");
+            }
+            strcat(message, command);
+            length += strlen(command) + 1;
+            count++;
+        }
+
+        uint64_t start_ns = emulator_time_ns();
+        bool is_sent = transfer_data(handle, BENCH_ADDRESS, message, response, verbose);
+        stats_add(&stats, emulator_time_ns() - start_ns);
+        if (!is_sent)
+        {
+            errors += commands - sent;
+            break;
+        }
+        if (sequenced)
+        {
+            int sequence;
+            int depth;
+            parse_ack(response, &sequence, &depth);
+        }
+
+        if (count == 1)
+        {
+            codes[0] = strcmp(response, RESPONSE_BUFFER_FULL) == 0 ? COMMAND_STATUS_BUFFER_FULL :
+                       strcmp(response, RESPONSE_OK) == 0 ? COMMAND_STATUS_OK : COMMAND_STATUS_INVALID;
+        }
+        else if (parse_multi_response(response, codes) != count)
+        {
+            errors += count;
+            sent += count;
+            continue;
+        }
+
+        // The board rejects every run command after the first buffer full one
+        int accepted = 0;
+        while (accepted < count && codes[accepted] != COMMAND_STATUS_BUFFER_FULL)
+        {
+            errors += codes[accepted] != COMMAND_STATUS_OK ? 1 : 0;
+            accepted++;
+        }
+        sent += accepted;
+
+        if (accepted < count)
+        {
+            emulator_advance(backoff_ns);
+            retries++;
+            backoff_ns = backoff_ns * 2 < BACKOFF_MAX_US * 1000ULL ? backoff_ns * 2 : BACKOFF_MAX_US * 1000ULL;
+        }
+        else if (backoff_ns > BACKOFF_MIN_US * 1000ULL)
+        {
+            backoff_ns /= 2;
+        }
+    }
+
+    // Let the board run the queued commands
+    while (!emulator_is_idle())
+    {
+        emulator_advance(BACKOFF_MIN_US * 1000ULL);
+    }
+    uint64_t wall_elapsed_ns = monotonic_ns() - wall_start_ns;
+    uint64_t elapsed_ns = emulator_time_ns();
+    close_device(handle);
+
+    EmulatorStats board = emulator_get_stats();
+    stats_print(stdout, &stats, title, elapsed_ns);
+    printf("Commands completed: %u, buffer full retries: %d, underruns: %u, idle: %.1f%%\n",
+           board.completed, retries, board.underruns, board.ticks > 0 ? 100.0 * board.idle_ticks / board.ticks : 0.0);
+    printf("Virtual time: %.3f s, wall time: %.3f s, %.0fx real time\n",
+           elapsed_ns / 1e9, wall_elapsed_ns / 1e9, wall_elapsed_ns > 0 ? (double)elapsed_ns / wall_elapsed_ns : 0.0);
+    stats_free(&stats);
+    return errors;
+}
+
+int run_emulator_benchmark(int commands, uint32_t bus_clock_hz, bool verbose)
+{
+    set_transport(&emulator_transport);
+    printf("Emulated board at %u Hz, command %s\n", bus_clock_hz, BENCH_EMULATOR_COMMAND);
+    int errors = run_emulated("One command per write", commands, 1, false, bus_clock_hz, verbose);
+    errors += run_emulated("Packed writes", commands, MULTI_COMMAND_MAX, false, bus_clock_hz, verbose);
+    errors += run_emulated("Packed sequenced writes", commands, MULTI_COMMAND_MAX, true, bus_clock_hz, verbose);
+    set_transport(NULL);
+
+    printf("Errors: %d\n", errors);
+    return errors > 0 ? 1 : 0;
+}
+
+/**
+ * Sends the message over one session through the fault injecting transport, with the given policy.
+ */
+static int run_faulted(const char *title, int transactions, const FaultConfig *config, const I2cPolicy *policy, bool verbose)
+{
+    char response[MAX_BUFFER_SIZE];
+    LatencyStats stats;
+    int errors = 0;
+
+    set_transaction_policy(policy);
+    reset_transaction_stats();
+    fault_configure(&simulated_transport, config);
+    int handle = open_device(BENCH_ADDRESS, verbose);
+    stats_init(&stats);
+
+    uint64_t run_start_ns = monotonic_ns();
+    for (int i = 0; i < transactions; i++)
+    {
+        uint64_t start_ns = monotonic_ns();
+        if (!transfer_data(handle, BENCH_ADDRESS, BENCH_MESSAGE, response, verbose))
+        {
+            errors++;
+        }
+        stats_add(&stats, monotonic_ns() - start_ns);
+    }
+    uint64_t elapsed_ns = monotonic_ns() - run_start_ns;
+    close_device(handle);
+
+    I2cStats counters = get_transaction_stats();
+    FaultStats faults = fault_get_stats();
+    stats_print(stdout, &stats, title, elapsed_ns);
+    printf("Injected: %llu nacks, %llu hangs, %llu stuck bus, %llu transfers on the stuck bus\n",
+           (unsigned long long)faults.nacks, (unsigned long long)faults.hangs,
+           (unsigned long long)faults.stuck, (unsigned long long)faults.stuck_transfers);
+    print_transaction_stats(stdout, &counters);
+    stats_free(&stats);
+    return errors;
+}
+
+int run_fault_benchmark(int transactions, const FaultConfig *config, const I2cPolicy *policy, bool verbose)
+{
+    const I2cPolicy unbounded = {
+        .timeout_ms = 0,
+        .retries = 0,
+        .backoff_us = 0,
+        .recover = false,
+    };
+
+    set_transport(&fault_transport);
+    printf("Simulated device at %d Hz, message %s, nack %.2f%%, hang %.2f%% for %u ms, stuck bus %.2f%%\n",
+           BENCH_BUS_CLOCK_HZ, BENCH_MESSAGE, config->nack * 100, config->hang * 100, config->hang_ms, config->stuck * 100);
+    int unbounded_errors = run_faulted("Without deadline and retries", transactions, config, &unbounded, verbose);
+    char title[64];
+    snprintf(title, sizeof(title), "Deadline %u ms, %d retries", policy->timeout_ms, policy->retries);
+    int errors = run_faulted(title, transactions, config, policy, verbose);
+    set_transaction_policy(NULL);
+    set_transport(NULL);
+
+    printf("Failed transactions: %d without the policy, %d with the policy\n", unbounded_errors, errors);
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+#include "fault.h"
+
+#define BENCH_BUS_CLOCK_HZ 400000 // Simulated i2c clock, 9 bit times per byte
+#define BENCH_MESSAGE "run:A+100,500"
+#define BENCH_EMULATOR_COMMAND "run:A10,1:B-10,1" // Runs 20 ticks, about 6 ms at the default tick rate
+#define BENCH_FAULT_TRANSACTIONS 2000
+
+/**
+ * function: run_benchmark()
+ * 
+ * Sends the same message to a simulated device with the blocking send_get_data() and then with the
+ * asynchronous API, and prints the sustained requests/s and latency distribution of both.
+ * The simulated device answers OK after the bus time of the write and of the response read.
+ * Returns 0 if every request was answered, 1 otherwise.
+ * @parameter requests - requests sent by each run
+ * @parameter depth - requests in flight on each bus with the asynchronous API
+ * @parameter buses - asynchronous buses, each with its own worker
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int run_benchmark(int requests, int depth, int buses, bool verbose);
+
+/**
+ * function: run_emulator_benchmark()
+ * 
+ * Streams run commands to the emulated board (emulator.h) one per write, packed in writes, and packed with
+ * sequence numbers, and prints the commands/s and transaction latency in virtual time for each, with the
+ * board underruns and the speedup over real time. No hardware or real sleeps are needed.
+ * Returns 0 if every command was accepted, 1 otherwise.
+ * @parameter commands - commands sent by each run
+ * @parameter bus_clock_hz - emulated i2c clock
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int run_emulator_benchmark(int commands, uint32_t bus_clock_hz, bool verbose);
+
+/**
+ * function: run_fault_benchmark()
+ * 
+ * Sends the same message over one session to the simulated device through the fault injecting transport
+ * (fault.h), first without deadline, retries or bus recovery and then with the transaction policy, drawing
+ * the faults from the same seed in both runs. Prints the latency distribution, the failed transactions and the transaction
+ * counters of each run, showing the tail latency the policy keeps bounded.
+ * Returns 0 if every transaction with the policy was answered, 1 otherwise.
+ * @parameter transactions - transactions sent by each run
+ * @parameter config - fault probabilities
+ * @parameter policy - transaction policy of the second run
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int run_fault_benchmark(int transactions, const FaultConfig *config, const I2cPolicy *policy, bool verbose);
+
+#endif /* BENCH_H_ */
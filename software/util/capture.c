@@ -0,0 +1,122 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "capture.h"
+#include "stats.h"
+
+static FILE *capture_file = NULL;
+static uint64_t capture_start_ns = 0;
+
+bool capture_start(const char *path)
+{
+    capture_stop();
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    uint16_t version = CAPTURE_VERSION;
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE ||
+        fwrite(&version, sizeof(version), 1, file) != 1)
+    {
+        fclose(file);
+        return false;
+    }
+
+    capture_file = file;
+    capture_start_ns = monotonic_ns();
+    return true;
+}
+
+void capture_stop()
+{
+    if (capture_file != NULL)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+bool capture_is_active()
+{
+    return capture_file != NULL;
+}
+
+void capture_transaction(uint8_t address, const char *request, const char *response,
+                         uint64_t start_ns, uint64_t end_ns, bool is_error)
+{
+    if (capture_file == NULL)
+    {
+        return;
+    }
+
+    size_t request_length = strnlen(request, MAX_BUFFER_SIZE - 1);
+    size_t response_length = is_error ? 0 : strnlen(response, MAX_BUFFER_SIZE - 1);
+    CaptureRecord record = {
+        .timestamp_ns = start_ns > capture_start_ns ? start_ns - capture_start_ns : 0,
+        .latency_ns = end_ns - start_ns > UINT32_MAX ? UINT32_MAX : end_ns - start_ns,
+        .address = address,
+        .status = is_error ? CAPTURE_STATUS_ERROR : CAPTURE_STATUS_OK,
+        .request_length = request_length,
+        .response_length = response_length,
+    };
+
+    // Async workers capture concurrently, the record and its payload are written under one stream lock
+    flockfile(capture_file);
+    fwrite(&record, sizeof(record), 1, capture_file);
+    fwrite(request, 1, request_length, capture_file);
+    fwrite(response, 1, response_length, capture_file);
+    funlockfile(capture_file);
+}
+
+FILE *capture_open(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    char magic[CAPTURE_MAGIC_SIZE];
+    uint16_t version = 0;
+    if (fread(magic, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 ||
+        version != CAPTURE_VERSION)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+int capture_read(FILE *file, CaptureEntry *entry)
+{
+    if (fread(&entry->record, sizeof(entry->record), 1, file) != 1)
+    {
+        return feof(file) ? 0 : -1;
+    }
+
+    CaptureRecord *record = &entry->record;
+    if (record->request_length >= MAX_BUFFER_SIZE || record->response_length >= MAX_BUFFER_SIZE ||
+        fread(entry->request, 1, record->request_length, file) != record->request_length ||
+        fread(entry->response, 1, record->response_length, file) != record->response_length)
+    {
+        return -1;
+    }
+
+    entry->request[record->request_length] = '\0';
+    entry->response[record->response_length] = '\0';
+    return 1;
+}
@@ -0,0 +1,105 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+
+// Capture file: magic and version header followed by one record per transaction,
+// each record is followed by the request and response text without null terminators.
+// Values are stored in the host byte order.
+#define CAPTURE_MAGIC "FBSCAP"
+#define CAPTURE_MAGIC_SIZE 6
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_STATUS_OK 0
+#define CAPTURE_STATUS_ERROR 1
+
+typedef struct __attribute__((packed))
+{
+    uint64_t timestamp_ns; // Transaction start, monotonic time since the capture was opened
+    uint32_t latency_ns; // Time spent in the transaction
+    uint8_t address; // Board I2C address
+    uint8_t status; // CAPTURE_STATUS_OK or CAPTURE_STATUS_ERROR
+    uint8_t request_length;
+    uint8_t response_length;
+} CaptureRecord;
+
+typedef struct
+{
+    CaptureRecord record;
+    char request[MAX_BUFFER_SIZE];
+    char response[MAX_BUFFER_SIZE];
+} CaptureEntry;
+
+/**
+ * function: capture_start()
+ * 
+ * Starts recording every send_get_data() transaction to a capture file, the file is overwritten.
+ * Returns false if the file couldn't be created.
+ * @parameter path - capture file path
+ * 
+ */
+extern bool capture_start(const char *path);
+
+/**
+ * function: capture_stop()
+ * 
+ * Stops recording and closes the capture file. No effect if capture is not active.
+ * 
+ */
+extern void capture_stop();
+
+/**
+ * function: capture_is_active()
+ * 
+ * Returns true while transactions are recorded.
+ * 
+ */
+extern bool capture_is_active();
+
+/**
+ * function: capture_transaction()
+ * 
+ * Appends a transaction to the capture file if capture is active.
+ * @parameter address - i2c device address
+ * @parameter request - the message sent to the device
+ * @parameter response - the response read, ignored if is_error is set
+ * @parameter start_ns - monotonic time when the transaction started
+ * @parameter end_ns - monotonic time when the transaction ended
+ * @parameter is_error - the transaction failed with lib error
+ * 
+ */
+extern void capture_transaction(uint8_t address, const char *request, const char *response,
+                                uint64_t start_ns, uint64_t end_ns, bool is_error);
+
+/**
+ * function: capture_open()
+ * 
+ * Opens a capture file for reading and validates the header. Returns NULL if the file is not a valid capture.
+ * @parameter path - capture file path
+ * 
+ */
+extern FILE *capture_open(const char *path);
+
+/**
+ * function: capture_read()
+ * 
+ * Reads the next transaction from a capture file, request and response are null terminated.
+ * Returns 1 if an entry was read, 0 at the end of the file and -1 if the file is truncated.
+ * @parameter file - capture file opened with capture_open()
+ * @parameter entry - the entry to fill
+ * 
+ */
+extern int capture_read(FILE *file, CaptureEntry *entry);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,1158 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "emulator.h"
+
+#define EMULATOR_VERSION "FBSMC01_A002"
+#define TICK_RATE_MIN 50
+#define TICK_RATE_MAX 20000
+
+typedef struct
+{
+    uint32_t steps[EMULATOR_DEVICES];
+    uint16_t speeds[EMULATOR_DEVICES];
+    uint8_t dirs; // Direction bit per device, 1 - clockwise
+    uint8_t mask; // Devices with steps
+} EmulatedCommand;
+
+// Command running on one device, like RunCommand of the firmware
+typedef struct
+{
+    uint32_t steps;
+    uint16_t speed;
+    uint16_t counter;
+    uint8_t dir;
+} EmulatedDevice;
+
+// Continuous velocity of a jogging device, like JogState of the firmware
+typedef struct
+{
+    int32_t rate; // Step pin toggles per tick in 8.24 fixed point, negative counter clockwise
+    int32_t target;
+    int32_t acceleration; // Rate change per tick
+    uint32_t phase;
+} EmulatedJog;
+
+static struct
+{
+    uint8_t address;
+    uint32_t bus_clock_hz;
+    bool wall_clock;
+    uint64_t last_wall_ns;
+    uint64_t time_ns;
+    uint64_t pending_ns; // Virtual time not run as a whole tick yet
+    uint16_t tick_rate;
+    EmulatedCommand queue[EMULATOR_QUEUE_MAX];
+    int queue_head;
+    int queue_count;
+    int queue_bytes;
+    int last_command_size; // Bytes of the last queued command, the capacity counts free bytes in commands of this size
+    EmulatedDevice active[EMULATOR_DEVICES];
+    bool is_loaded; // A queued command was loaded and didn't finish yet
+    EmulatedDevice move;
+    int move_device_id; // EMULATOR_DEVICES when no move command runs
+    bool is_paused;
+    uint8_t step_pins; // Step pin level bit per device
+    uint8_t dir_pins; // Direction pin level bit per device
+    uint16_t step_counts[EMULATOR_DEVICES]; // Steps since the reset, wrapping like the firmware counters
+    uint8_t step_toggle_mask; // Bit per device whose step pin toggled in the current tick, followers step from it
+    uint8_t gear_mask; // Bit per geared follower device
+    uint8_t gear_inverts; // Bit per follower turning opposite to its leader
+    uint8_t gear_leaders[EMULATOR_DEVICES];
+    uint8_t gear_numerators[EMULATOR_DEVICES];
+    uint8_t gear_denominators[EMULATOR_DEVICES];
+    uint8_t gear_errors[EMULATOR_DEVICES];
+    uint8_t jog_mask; // Bit per jogging device
+    EmulatedJog jogs[EMULATOR_DEVICES];
+    EmulatorTraceCallback trace;
+    void *trace_context;
+    uint16_t sequence_history[MULTI_COMMAND_MAX];
+    int sequence_index;
+    uint16_t last_sequence;
+    char response[MAX_BUFFER_SIZE];
+    EmulatorStats stats;
+} board;
+
+/**
+ * Toggles the step pin of a device, returns true on the falling edge, where the firmware counts a step.
+ */
+static bool toggle_step_pin(int device_id, uint8_t dir)
+{
+    uint8_t device_mask = 1 << device_id;
+    board.dir_pins = dir ? board.dir_pins | device_mask : board.dir_pins & ~device_mask;
+    board.step_pins ^= device_mask;
+    if (board.step_pins & device_mask)
+    {
+        return false;
+    }
+    board.step_counts[device_id]++;
+    if (board.trace != NULL)
+    {
+        board.trace(board.stats.ticks, device_id, dir, board.trace_context);
+    }
+    return true;
+}
+
+/**
+ * Runs one tick of the command on a device, the step pin toggles when the counter reaches the speed.
+ */
+static void run_device(EmulatedDevice *device, int device_id)
+{
+    if (device->steps == 0)
+    {
+        return;
+    }
+    device->counter++;
+    if (device->counter >= device->speed)
+    {
+        board.step_toggle_mask |= 1 << device_id;
+        if (toggle_step_pin(device_id, device->dir))
+        {
+            device->steps--;
+        }
+        device->counter = 0;
+    }
+}
+
+/**
+ * Runs one tick of a geared follower, it toggles when the error accumulator of the leader toggles reaches
+ * the denominator, like the firmware.
+ */
+static void run_gear(int device_id)
+{
+    int leader_id = board.gear_leaders[device_id];
+    if (!(board.gear_mask & (1 << device_id)) || !(board.step_toggle_mask & (1 << leader_id)))
+    {
+        return;
+    }
+    uint16_t error = board.gear_errors[device_id] + board.gear_numerators[device_id];
+    if (error >= board.gear_denominators[device_id])
+    {
+        error -= board.gear_denominators[device_id];
+        toggle_step_pin(device_id, ((board.dir_pins >> leader_id) ^ (board.gear_inverts >> device_id)) & 1);
+    }
+    board.gear_errors[device_id] = error;
+}
+
+/**
+ * Runs one tick of a jogging device, the rate ramps to the target by the acceleration like the firmware.
+ * The device is released once it stopped with a zero target.
+ */
+static void run_jog(int device_id)
+{
+    uint8_t device_mask = 1 << device_id;
+    if (!(board.jog_mask & device_mask))
+    {
+        return;
+    }
+
+    EmulatedJog *jog = &board.jogs[device_id];
+    if (jog->rate < jog->target)
+    {
+        jog->rate = jog->rate + jog->acceleration < jog->target ? jog->rate + jog->acceleration : jog->target;
+    }
+    else if (jog->rate > jog->target)
+    {
+        jog->rate = jog->rate - jog->acceleration > jog->target ? jog->rate - jog->acceleration : jog->target;
+    }
+    if (jog->rate == 0)
+    {
+        if (jog->target == 0)
+        {
+            board.jog_mask &= ~device_mask;
+        }
+        return;
+    }
+
+    jog->phase += jog->rate > 0 ? jog->rate : -jog->rate;
+    if (jog->phase >= EMULATOR_RATE_ONE)
+    {
+        jog->phase -= EMULATOR_RATE_ONE;
+        board.step_toggle_mask |= device_mask;
+        toggle_step_pin(device_id, jog->rate > 0);
+    }
+}
+
+/**
+ * Returns the ticks until the step pin of the device toggles, 0 if the device has no steps.
+ */
+static uint64_t ticks_to_toggle(const EmulatedDevice *device)
+{
+    if (device->steps == 0)
+    {
+        return 0;
+    }
+    return device->speed > device->counter ? device->speed - device->counter : 1;
+}
+
+static bool is_active_running()
+{
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        if (board.active[device_id].steps > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the bytes a value takes in the queue of the board, 7 bits per byte.
+ */
+static int queued_value_size(uint32_t value)
+{
+    int size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static int queued_size(const EmulatedCommand *command)
+{
+    int size = 1;
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        if (command->mask & (1 << device_id))
+        {
+            size += queued_value_size(command->steps[device_id]) + queued_value_size(command->speeds[device_id]);
+        }
+    }
+    return size;
+}
+
+/**
+ * Loads the next queued command into the active commands, devices without steps are cleared.
+ */
+static bool load_next_command()
+{
+    if (board.queue_count == 0)
+    {
+        return false;
+    }
+    EmulatedCommand *command = &board.queue[board.queue_head];
+    board.queue_head = (board.queue_head + 1) % EMULATOR_QUEUE_MAX;
+    board.queue_count--;
+    board.queue_bytes -= queued_size(command);
+    memset(board.active, 0, sizeof(board.active));
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        if (command->mask & (1 << device_id))
+        {
+            EmulatedDevice *device = &board.active[device_id];
+            device->steps = command->steps[device_id];
+            device->speed = command->speeds[device_id];
+            device->dir = (command->dirs >> device_id) & 1;
+        }
+    }
+    return true;
+}
+
+static int queue_depth()
+{
+    return board.queue_count + (is_active_running() ? 1 : 0);
+}
+
+static int queue_capacity()
+{
+    int free_commands = (EMULATOR_QUEUE_BUDGET - board.queue_bytes) / board.last_command_size;
+    if (free_commands > EMULATOR_QUEUE_MAX - board.queue_count)
+    {
+        free_commands = EMULATOR_QUEUE_MAX - board.queue_count;
+    }
+    return queue_depth() + free_commands;
+}
+
+/**
+ * Runs one timer tick like the timer interrupt of the firmware.
+ */
+static void run_tick()
+{
+    board.stats.ticks++;
+    board.step_toggle_mask = 0;
+    if (!board.is_paused && board.move_device_id == EMULATOR_DEVICES)
+    {
+        for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+        {
+            run_device(&board.active[device_id], device_id);
+        }
+        if (!is_active_running())
+        {
+            // The next command is loaded on the tick the last step was made
+            if (board.is_loaded)
+            {
+                board.stats.completed++;
+            }
+            if (load_next_command())
+            {
+                board.is_loaded = true;
+            }
+            else if (board.is_loaded)
+            {
+                board.is_loaded = false;
+                board.stats.underruns++;
+            }
+            else
+            {
+                board.stats.idle_ticks++;
+            }
+        }
+    }
+    else if (board.move_device_id < EMULATOR_DEVICES && board.move.steps > 0)
+    {
+        // Move command takes precedence over the queued commands
+        run_device(&board.move, board.move_device_id);
+    }
+    else if (board.move_device_id < EMULATOR_DEVICES)
+    {
+        // Commands are paused once the move command finished
+        board.move_device_id = EMULATOR_DEVICES;
+        board.is_paused = true;
+    }
+
+    for (int device_id = 0; device_id < EMULATOR_DEVICES && board.jog_mask; device_id++)
+    {
+        run_jog(device_id);
+    }
+
+    // Followers step from the toggles of their leaders in this tick
+    for (int device_id = 0; device_id < EMULATOR_DEVICES && board.gear_mask; device_id++)
+    {
+        run_gear(device_id);
+    }
+}
+
+/**
+ * Runs the ticks before the next step pin toggle or command load at once, up to the given ticks.
+ * Returns the ticks run, 0 when the next tick must be run on its own.
+ */
+static uint64_t fast_forward(uint64_t ticks)
+{
+    EmulatedDevice *devices = board.active;
+    int device_count = EMULATOR_DEVICES;
+    bool is_idle = false;
+    uint64_t skip = ticks;
+
+    if (board.jog_mask)
+    {
+        // Jogging devices change their rate on every tick
+        return 0;
+    }
+    if (board.move_device_id < EMULATOR_DEVICES)
+    {
+        if (board.move.steps == 0)
+        {
+            return 0;
+        }
+        devices = &board.move;
+        device_count = 1;
+    }
+    else if (board.is_paused)
+    {
+        device_count = 0;
+    }
+    else if (!is_active_running())
+    {
+        if (board.queue_count > 0 || board.is_loaded)
+        {
+            return 0;
+        }
+        is_idle = true;
+        device_count = 0;
+    }
+
+    for (int i = 0; i < device_count; i++)
+    {
+        uint64_t next = ticks_to_toggle(&devices[i]);
+        if (next > 0 && next - 1 < skip)
+        {
+            skip = next - 1;
+        }
+    }
+    for (int i = 0; i < device_count; i++)
+    {
+        if (devices[i].steps > 0)
+        {
+            devices[i].counter += skip;
+        }
+    }
+    board.stats.ticks += skip;
+    if (is_idle)
+    {
+        board.stats.idle_ticks += skip;
+    }
+    return skip;
+}
+
+/**
+ * Runs timer ticks, the ticks without a step pin toggle are run at once.
+ */
+static void run_ticks(uint64_t ticks)
+{
+    while (ticks > 0)
+    {
+        uint64_t skipped = fast_forward(ticks);
+        ticks -= skipped;
+        if (ticks > 0)
+        {
+            run_tick();
+            ticks--;
+        }
+    }
+}
+
+void emulator_advance(uint64_t duration_ns)
+{
+    board.time_ns += duration_ns;
+    board.pending_ns += duration_ns;
+    uint64_t ticks = board.pending_ns * board.tick_rate / 1000000000ULL;
+    board.pending_ns -= ticks * 1000000000ULL / board.tick_rate;
+    run_ticks(ticks);
+}
+
+uint64_t emulator_time_ns()
+{
+    return board.time_ns;
+}
+
+bool emulator_is_idle()
+{
+    return board.move_device_id == EMULATOR_DEVICES && queue_depth() == 0;
+}
+
+EmulatorStats emulator_get_stats()
+{
+    return board.stats;
+}
+
+void emulator_reset(uint8_t address, uint32_t bus_clock_hz, bool wall_clock)
+{
+    memset(&board, 0, sizeof(board));
+    board.address = address;
+    board.bus_clock_hz = bus_clock_hz;
+    board.wall_clock = wall_clock;
+    board.last_wall_ns = monotonic_ns();
+    board.tick_rate = EMULATOR_TICK_RATE;
+    board.move_device_id = EMULATOR_DEVICES;
+    board.last_command_size = EMULATOR_QUEUED_COMMAND_MAX_SIZE;
+    // Pins are set high at start-up
+    board.step_pins = (1 << EMULATOR_DEVICES) - 1;
+    board.dir_pins = (1 << EMULATOR_DEVICES) - 1;
+}
+
+void emulator_set_trace(EmulatorTraceCallback callback, void *context)
+{
+    board.trace = callback;
+    board.trace_context = context;
+}
+
+/**
+ * Advances the virtual clock by the real time since the last transaction, when enabled, and by the bus time.
+ */
+static void advance_transaction(int length)
+{
+    if (board.wall_clock)
+    {
+        uint64_t now_ns = monotonic_ns();
+        emulator_advance(now_ns - board.last_wall_ns);
+        board.last_wall_ns = now_ns;
+    }
+    // Address byte and data bytes, 8 bits and an acknowledge bit each
+    emulator_advance((uint64_t)(length + 1) * 9 * 1000000000ULL / board.bus_clock_hz);
+}
+
+static bool is_delimiter(char c)
+{
+    return c == ':' || c == ';' || c == ',';
+}
+
+static void skip_delimiters(const char **cursor)
+{
+    while (is_delimiter(**cursor))
+    {
+        (*cursor)++;
+    }
+}
+
+static bool match_keyword(const char **cursor, const char *keyword)
+{
+    size_t length = strlen(keyword);
+    if (strncmp(*cursor, keyword, length) != 0 || ((*cursor)[length] != '\0' && !is_delimiter((*cursor)[length])))
+    {
+        return false;
+    }
+    *cursor += length;
+    skip_delimiters(cursor);
+    return true;
+}
+
+static bool parse_number(const char **cursor, uint64_t max_value, uint64_t *value)
+{
+    const char *position = *cursor;
+    uint64_t result = 0;
+
+    if (*position < '0' || *position > '9')
+    {
+        return false;
+    }
+    while (*position >= '0' && *position <= '9')
+    {
+        result = result * 10 + (*position - '0');
+        if (result > max_value)
+        {
+            return false;
+        }
+        position++;
+    }
+    if (*position != '\0' && !is_delimiter(*position))
+    {
+        return false;
+    }
+
+    skip_delimiters(&position);
+    *cursor = position;
+    *value = result;
+    return true;
+}
+
+/**
+ * Parses one device value of a run or move command, returns the device id or -1 with the status code set.
+ */
+static int parse_device_command(const char **cursor, EmulatedCommand *command, int *code)
+{
+    int device_id = (**cursor | 0x20) - 'a';
+    if (device_id < 0 || device_id >= EMULATOR_DEVICES)
+    {
+        *code = COMMAND_STATUS_INVALID_DEVICE;
+        return -1;
+    }
+    if ((board.gear_mask | board.jog_mask) & (1 << device_id))
+    {
+        // Geared followers and jogging devices don't run commands, the device is busy
+        *code = COMMAND_STATUS_INVALID;
+        return -1;
+    }
+    (*cursor)++;
+
+    uint8_t dir = **cursor == '-' ? 0 : 1;
+    if (**cursor == '-' || **cursor == '+')
+    {
+        (*cursor)++;
+    }
+
+    uint64_t steps;
+    uint64_t speed;
+    if (!parse_number(cursor, 0xFFFFFFFFULL, &steps))
+    {
+        *code = COMMAND_STATUS_INVALID_STEPS;
+        return -1;
+    }
+    if (!parse_number(cursor, 0xFFFF, &speed))
+    {
+        *code = COMMAND_STATUS_INVALID_SPEED;
+        return -1;
+    }
+
+    uint8_t device_mask = 1 << device_id;
+    command->steps[device_id] = steps;
+    command->speeds[device_id] = speed;
+    command->dirs = dir ? command->dirs | device_mask : command->dirs & ~device_mask;
+    command->mask = steps > 0 ? command->mask | device_mask : command->mask & ~device_mask;
+    return device_id;
+}
+
+static int process_run(const char *cursor, bool *is_buffer_full)
+{
+    EmulatedCommand command;
+    int code = COMMAND_STATUS_OK;
+
+    memset(&command, 0, sizeof(command));
+    while (*cursor != '\0')
+    {
+        if (parse_device_command(&cursor, &command, &code) < 0)
+        {
+            return code;
+        }
+    }
+
+    if (command.mask == 0 && !*is_buffer_full)
+    {
+        // Accepted without queueing anything
+        return COMMAND_STATUS_OK;
+    }
+    int size = queued_size(&command);
+    if (*is_buffer_full || board.queue_count >= EMULATOR_QUEUE_MAX || board.queue_bytes + size > EMULATOR_QUEUE_BUDGET)
+    {
+        *is_buffer_full = true;
+        return COMMAND_STATUS_BUFFER_FULL;
+    }
+
+    board.queue[(board.queue_head + board.queue_count) % EMULATOR_QUEUE_MAX] = command;
+    board.queue_count++;
+    board.queue_bytes += size;
+    board.last_command_size = size;
+    return COMMAND_STATUS_OK;
+}
+
+static int process_move(const char *cursor)
+{
+    EmulatedCommand command;
+    int code = COMMAND_STATUS_OK;
+
+    memset(&command, 0, sizeof(command));
+    int device_id = parse_device_command(&cursor, &command, &code);
+    if (device_id < 0)
+    {
+        memset(&board.move, 0, sizeof(board.move));
+        board.move_device_id = EMULATOR_DEVICES;
+        return code;
+    }
+
+    // The move command runs even without steps, then pauses the commands
+    board.move.steps = command.steps[device_id];
+    board.move.speed = command.speeds[device_id];
+    board.move.dir = (command.dirs >> device_id) & 1;
+    board.move.counter = 0;
+    board.move_device_id = device_id;
+    return COMMAND_STATUS_OK;
+}
+
+/**
+ * Engages a follower to a leader like the firmware, while no command runs. Followers can't lead and
+ * leaders can't follow. Returns false if the gear is not valid.
+ */
+static bool set_gear(int follower_id, int leader_id, uint8_t numerator, uint8_t denominator, bool is_inverted)
+{
+    if (follower_id == leader_id || (board.gear_mask & (1 << leader_id)) || (board.jog_mask & (1 << follower_id))
+        || board.queue_count > 0
+        || is_active_running() || board.move_device_id < EMULATOR_DEVICES)
+    {
+        return false;
+    }
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        if ((board.gear_mask & (1 << device_id)) && board.gear_leaders[device_id] == follower_id)
+        {
+            return false;
+        }
+    }
+
+    uint8_t follower_mask = 1 << follower_id;
+    board.gear_leaders[follower_id] = leader_id;
+    board.gear_numerators[follower_id] = numerator;
+    board.gear_denominators[follower_id] = denominator;
+    board.gear_errors[follower_id] = 0;
+    board.gear_inverts = is_inverted ? board.gear_inverts | follower_mask : board.gear_inverts & ~follower_mask;
+    board.gear_mask |= follower_mask;
+    return true;
+}
+
+/**
+ * Processes the gear command, format: gear:<follower_id>[:<leader_id>:<+/-numerator/denominator>].
+ * Without a leader the follower is released.
+ */
+static int process_gear(const char *cursor)
+{
+    int follower_id = (*cursor | 0x20) - 'a';
+    if (follower_id < 0 || follower_id >= EMULATOR_DEVICES)
+    {
+        return COMMAND_STATUS_INVALID_DEVICE;
+    }
+    cursor++;
+    skip_delimiters(&cursor);
+    if (*cursor == '\0')
+    {
+        board.gear_mask &= ~(1 << follower_id);
+        return COMMAND_STATUS_OK;
+    }
+
+    int leader_id = (*cursor | 0x20) - 'a';
+    if (leader_id < 0 || leader_id >= EMULATOR_DEVICES)
+    {
+        return COMMAND_STATUS_INVALID_DEVICE;
+    }
+    cursor++;
+    skip_delimiters(&cursor);
+
+    bool is_inverted = *cursor == '-';
+    if (*cursor == '-' || *cursor == '+')
+    {
+        cursor++;
+    }
+
+    // The numerator has to end at the slash, parsed as a delimiter like the firmware does
+    char ratio[MAX_BUFFER_SIZE];
+    const char *position = ratio;
+    uint64_t numerator;
+    uint64_t denominator;
+    snprintf(ratio, sizeof(ratio), "%s", cursor);
+    char *slash = strchr(ratio, '/');
+    if (slash == NULL)
+    {
+        return COMMAND_STATUS_INVALID;
+    }
+    *slash = ':';
+    if (!parse_number(&position, EMULATOR_GEAR_RATIO_MAX, &numerator) || position != slash + 1
+        || !parse_number(&position, EMULATOR_GEAR_RATIO_MAX, &denominator) || *position != '\0'
+        || numerator == 0 || numerator > denominator
+        || !set_gear(follower_id, leader_id, numerator, denominator, is_inverted))
+    {
+        return COMMAND_STATUS_INVALID;
+    }
+    return COMMAND_STATUS_OK;
+}
+
+/**
+ * Converts a velocity in steps per second to a rate in toggles per tick, truncated like the firmware
+ */
+static int32_t velocity_to_rate(uint16_t velocity)
+{
+    uint32_t rate = ((uint32_t)velocity << 16) / board.tick_rate;
+    return rate >= (EMULATOR_RATE_ONE >> 9) ? EMULATOR_RATE_ONE : rate << 9;
+}
+
+/**
+ * Converts a rate in toggles per tick to a velocity in steps per second, rounded like the firmware
+ */
+static uint16_t rate_to_velocity(int32_t rate)
+{
+    uint32_t magnitude = rate < 0 ? -rate : rate;
+    return ((magnitude >> 9) * board.tick_rate + 0x8000) >> 16;
+}
+
+/**
+ * Sets the target velocity of a jogging device like the firmware, starting the jog if the device is stopped.
+ * Returns false if the device is geared or has a running, queued or move command.
+ */
+static bool set_jog(int device_id, bool dir, uint16_t velocity, uint16_t acceleration)
+{
+    uint8_t device_mask = 1 << device_id;
+    if (board.gear_mask & device_mask)
+    {
+        return false;
+    }
+    if (!(board.jog_mask & device_mask))
+    {
+        if (velocity == 0)
+        {
+            return true;
+        }
+        bool is_queued = false;
+        for (int i = 0; i < board.queue_count; i++)
+        {
+            is_queued |= (board.queue[(board.queue_head + i) % EMULATOR_QUEUE_MAX].mask & device_mask) != 0;
+        }
+        if (board.active[device_id].steps > 0 || board.move_device_id == device_id || is_queued)
+        {
+            return false;
+        }
+        board.jogs[device_id].rate = 0;
+        board.jogs[device_id].phase = 0;
+    }
+
+    int32_t target = velocity_to_rate(velocity);
+    uint32_t delta = ((uint64_t)acceleration << 25) / ((uint32_t)board.tick_rate * board.tick_rate);
+    board.jogs[device_id].target = dir ? target : -target;
+    board.jogs[device_id].acceleration = acceleration == 0 ? 2 * EMULATOR_RATE_ONE : delta > 0 ? delta : 1;
+    board.jog_mask |= device_mask;
+    return true;
+}
+
+/**
+ * Processes the jog command, format: jog:<device_id>:<+/-velocity>[,<acceleration>]
+ */
+static int process_jog(const char *cursor)
+{
+    int device_id = (*cursor | 0x20) - 'a';
+    if (device_id < 0 || device_id >= EMULATOR_DEVICES)
+    {
+        return COMMAND_STATUS_INVALID_DEVICE;
+    }
+    cursor++;
+    skip_delimiters(&cursor);
+
+    bool dir = *cursor != '-';
+    if (*cursor == '-' || *cursor == '+')
+    {
+        cursor++;
+    }
+    uint64_t velocity;
+    uint64_t acceleration = EMULATOR_JOG_ACCELERATION;
+    if (!parse_number(&cursor, 0xFFFF, &velocity) || (*cursor != '\0' && !parse_number(&cursor, 0xFFFF, &acceleration)))
+    {
+        return COMMAND_STATUS_INVALID_SPEED;
+    }
+    return set_jog(device_id, dir, velocity, acceleration) ? COMMAND_STATUS_OK : COMMAND_STATUS_INVALID;
+}
+
+static uint16_t rescale_speed(uint16_t speed, uint16_t from_rate, uint16_t to_rate)
+{
+    uint32_t scaled = ((uint32_t)speed * to_rate + from_rate / 2) / from_rate;
+    return scaled > 0xFFFF ? 0xFFFF : scaled;
+}
+
+static void rescale_command(EmulatedCommand *command, uint16_t from_rate, uint16_t to_rate)
+{
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        command->speeds[device_id] = rescale_speed(command->speeds[device_id], from_rate, to_rate);
+    }
+}
+
+static void rescale_device(EmulatedDevice *device, uint16_t from_rate, uint16_t to_rate)
+{
+    device->speed = rescale_speed(device->speed, from_rate, to_rate);
+    device->counter = rescale_speed(device->counter, from_rate, to_rate);
+}
+
+static int process_tick(const char *cursor)
+{
+    uint64_t rate;
+    // Rejected while a device jogs, its step rate depends on the tick rate
+    if (board.jog_mask || !parse_number(&cursor, TICK_RATE_MAX, &rate) || rate < TICK_RATE_MIN)
+    {
+        return COMMAND_STATUS_INVALID;
+    }
+
+    // Rescaled speeds may take more bytes, the tick rate is rejected if the commands don't fit the queue
+    int bytes = 0;
+    for (int i = 0; i < board.queue_count; i++)
+    {
+        EmulatedCommand command = board.queue[(board.queue_head + i) % EMULATOR_QUEUE_MAX];
+        rescale_command(&command, board.tick_rate, rate);
+        bytes += queued_size(&command);
+    }
+    if (bytes > EMULATOR_QUEUE_BUDGET)
+    {
+        return COMMAND_STATUS_INVALID;
+    }
+    board.queue_bytes = bytes;
+
+    // Running commands continue from their remaining steps with the rescaled speeds and counters
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        rescale_device(&board.active[device_id], board.tick_rate, rate);
+    }
+    rescale_device(&board.move, board.tick_rate, rate);
+    for (int i = 0; i < board.queue_count; i++)
+    {
+        rescale_command(&board.queue[(board.queue_head + i) % EMULATOR_QUEUE_MAX], board.tick_rate, rate);
+    }
+    board.tick_rate = rate;
+    return COMMAND_STATUS_OK;
+}
+
+static void append_device(char *status, const EmulatedDevice *device, int device_id)
+{
+    char values[32];
+    if (board.gear_mask & (1 << device_id))
+    {
+        // Geared follower, format: G<leader_id><+/-><numerator>/<denominator>
+        snprintf(values, sizeof(values), "\n%c:G%c%c%u/%u", 'A' + device_id, 'A' + board.gear_leaders[device_id],
+                 board.gear_inverts & (1 << device_id) ? '-' : '+', board.gear_numerators[device_id],
+                 board.gear_denominators[device_id]);
+        strcat(status, values);
+        return;
+    }
+    if (board.jog_mask & (1 << device_id))
+    {
+        // Jogging device, format: J<current velocity[+/-]>,<target velocity[+/-]>
+        const EmulatedJog *jog = &board.jogs[device_id];
+        snprintf(values, sizeof(values), "\n%c:J%s%u,%s%u", 'A' + device_id, jog->rate < 0 ? "-" : "",
+                 rate_to_velocity(jog->rate), jog->target < 0 ? "-" : "", rate_to_velocity(jog->target));
+        strcat(status, values);
+        return;
+    }
+    // An idle device has no direction
+    snprintf(values, sizeof(values), "\n%c:%s%u,%u", 'A' + device_id, device->dir || device->steps == 0 ? "" : "-",
+             device->steps, device->speed);
+    strcat(status, values);
+}
+
+static void process_status()
+{
+    char status[MAX_BUFFER_SIZE * 2];
+    char values[64];
+
+    status[0] = '\0';
+    if (board.move_device_id < EMULATOR_DEVICES)
+    {
+        strcat(status, "\nMOVE");
+        append_device(status, &board.move, board.move_device_id);
+        for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+        {
+            // Geared followers and jogging devices keep stepping
+            if ((board.gear_mask | board.jog_mask) & (1 << device_id))
+            {
+                append_device(status, &board.active[device_id], device_id);
+            }
+        }
+    }
+    else
+    {
+        strcat(status, board.is_paused ? "\nPAUSED" : "\nRUN");
+        for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+        {
+            append_device(status, &board.active[device_id], device_id);
+        }
+    }
+    snprintf(values, sizeof(values), "\nSW:NONE\nBUFF:%d/%d\nTICK:%u\nCLK:%u",
+             queue_depth(), queue_capacity(), board.tick_rate, (uint32_t)board.stats.ticks);
+    strcat(status, values);
+    // Like the firmware, the step counters are left out when they and the acknowledgement don't fit the buffer
+    if (strlen(status) + EMULATOR_STATUS_COUNTS_MAX_SIZE + EMULATOR_ACK_MAX_SIZE < MAX_BUFFER_SIZE)
+    {
+        snprintf(values, sizeof(values), "\nCNT:%u,%u,%u,%u", board.step_counts[0], board.step_counts[1],
+                 board.step_counts[2], board.step_counts[3]);
+        strcat(status, values);
+    }
+    strncpy(board.response, status, MAX_BUFFER_SIZE - 1);
+}
+
+/**
+ * Forgets the accepted sequence numbers, like the board on the reset and session commands.
+ */
+static void clear_sequences()
+{
+    memset(board.sequence_history, 0, sizeof(board.sequence_history));
+    board.sequence_index = 0;
+    board.last_sequence = 0;
+}
+
+static bool find_sequence(uint16_t sequence)
+{
+    for (int i = 0; i < MULTI_COMMAND_MAX; i++)
+    {
+        if (board.sequence_history[i] == sequence)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Processes one command like the board, sets the response and returns the status code.
+ */
+static int process_command(const char *command, bool *is_buffer_full, bool *is_sequenced)
+{
+    const char *cursor = command;
+    int code = COMMAND_STATUS_INVALID;
+    bool is_read_command = false;
+    bool has_response = false; // Response set by the command itself
+    uint16_t sequence = 0;
+
+    if (*cursor == SEQUENCE_PREFIX)
+    {
+        uint64_t value;
+        cursor++;
+        *is_sequenced = true;
+        if (!parse_number(&cursor, SEQUENCE_MAX, &value) || value == 0)
+        {
+            strcpy(board.response, RESPONSE_INVALID);
+            return COMMAND_STATUS_INVALID;
+        }
+        sequence = value;
+        if (find_sequence(sequence))
+        {
+            // Already accepted, acknowledged without running it again
+            strcpy(board.response, RESPONSE_OK);
+            return COMMAND_STATUS_OK;
+        }
+    }
+
+    if (match_keyword(&cursor, "version"))
+    {
+        code = COMMAND_STATUS_OK;
+        is_read_command = true;
+        has_response = true;
+        strcpy(board.response, EMULATOR_VERSION);
+    }
+    else if (match_keyword(&cursor, "status"))
+    {
+        code = COMMAND_STATUS_OK;
+        is_read_command = true;
+        has_response = true;
+        process_status();
+    }
+    else if (match_keyword(&cursor, "session"))
+    {
+        code = COMMAND_STATUS_OK;
+        clear_sequences();
+    }
+    else if (match_keyword(&cursor, "setaddr"))
+    {
+        uint64_t address;
+        if (parse_number(&cursor, I2C_ADDRESS_MAX, &address) && address >= I2C_ADDRESS_MIN)
+        {
+            // The board clears its buffer, the response is empty
+            code = COMMAND_STATUS_OK;
+            has_response = true;
+            board.address = address;
+            board.response[0] = '\0';
+        }
+    }
+    else if (match_keyword(&cursor, "run"))
+    {
+        code = process_run(cursor, is_buffer_full);
+    }
+    else if (match_keyword(&cursor, "resume"))
+    {
+        code = COMMAND_STATUS_OK;
+        board.is_paused = false;
+    }
+    else if (match_keyword(&cursor, "reset"))
+    {
+        code = COMMAND_STATUS_OK;
+        board.move_device_id = EMULATOR_DEVICES;
+        memset(&board.move, 0, sizeof(board.move));
+        memset(board.active, 0, sizeof(board.active));
+        board.is_loaded = false;
+        board.queue_count = 0;
+        board.queue_bytes = 0;
+        board.is_paused = false;
+        board.gear_mask = 0;
+        board.jog_mask = 0;
+        clear_sequences();
+    }
+    else if (match_keyword(&cursor, "move"))
+    {
+        code = process_move(cursor);
+    }
+    else if (match_keyword(&cursor, "tick"))
+    {
+        code = process_tick(cursor);
+    }
+    else if (match_keyword(&cursor, "gear"))
+    {
+        code = process_gear(cursor);
+    }
+    else if (match_keyword(&cursor, "jog"))
+    {
+        code = process_jog(cursor);
+    }
+    else if (match_keyword(&cursor, "pause"))
+    {
+        code = COMMAND_STATUS_OK;
+        board.is_paused = true;
+    }
+
+    if (code != COMMAND_STATUS_OK)
+    {
+        strcpy(board.response, response_for_code(code));
+    }
+    else if (!has_response)
+    {
+        strcpy(board.response, RESPONSE_OK);
+    }
+
+    if (sequence > 0)
+    {
+        board.last_sequence = sequence;
+        if (code == COMMAND_STATUS_OK && !is_read_command)
+        {
+            board.sequence_history[board.sequence_index] = sequence;
+            board.sequence_index = (board.sequence_index + 1) % MULTI_COMMAND_MAX;
+        }
+    }
+    return code;
+}
+
+/**
+ * Processes the null terminated commands of one write, like the board's TWI interrupt.
+ */
+static void process_write(const char *data, int length)
+{
+    char command[MAX_BUFFER_SIZE];
+    char codes[MULTI_COMMAND_MAX + 1];
+    int count = 0;
+    int command_length = 0;
+    bool is_buffer_full = false;
+    bool is_sequenced = false;
+
+    for (int i = 0; i < length; i++)
+    {
+        if (command_length < MAX_BUFFER_SIZE)
+        {
+            command[command_length] = data[i];
+        }
+        if (data[i] != '\0')
+        {
+            command_length++;
+            continue;
+        }
+        if (command_length > 0 && command_length < MAX_BUFFER_SIZE && count < MULTI_COMMAND_MAX)
+        {
+            codes[count++] = '0' + process_command(command, &is_buffer_full, &is_sequenced);
+        }
+        command_length = 0;
+    }
+
+    if (count > 1)
+    {
+        codes[count] = '\0';
+        snprintf(board.response, MAX_BUFFER_SIZE, "%s%s", RESPONSE_MULTI_PREFIX, codes);
+    }
+    if (is_sequenced)
+    {
+        char ack[32];
+        snprintf(ack, sizeof(ack), "%s%u,%d", RESPONSE_ACK, board.last_sequence, queue_depth());
+        strncat(board.response, ack, MAX_BUFFER_SIZE - strlen(board.response) - 1);
+    }
+}
+
+static int emulator_open(uint8_t address, bool verbose)
+{
+    // The handle is the address written to, the board only answers its own address
+    return address;
+}
+
+static int emulator_write(int handle, const char *data, int length)
+{
+    advance_transaction(length);
+    if (handle != board.address)
+    {
+        return -1;
+    }
+    board.stats.transactions++;
+    process_write(data, length);
+    return length;
+}
+
+static int emulator_read(int handle, char *data, int length)
+{
+    advance_transaction(length);
+    if (handle != board.address)
+    {
+        return -1;
+    }
+    memset(data, '\0', length);
+    strncpy(data, board.response, length - 1);
+    return length;
+}
+
+static void emulator_close(int handle)
+{
+}
+
+const I2cTransport emulator_transport = {
+    .name = "board emulator",
+    .open = emulator_open,
+    .write = emulator_write,
+    .read = emulator_read,
+    .close = emulator_close,
+};
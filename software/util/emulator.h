@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef EMULATOR_H_
+#define EMULATOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+
+// Board defaults, see motors.h and tca.h of the firmware
+#define EMULATOR_DEVICES 4
+#define EMULATOR_QUEUE_BUDGET 270 // Bytes of the packed command queue
+#define EMULATOR_QUEUED_COMMAND_MIN_SIZE 3 // Header, steps and speed of one device, 7 bits of a value per byte
+#define EMULATOR_QUEUED_COMMAND_MAX_SIZE 33
+#define EMULATOR_QUEUE_MAX (EMULATOR_QUEUE_BUDGET / EMULATOR_QUEUED_COMMAND_MIN_SIZE)
+#define EMULATOR_TICK_RATE 3333
+#define EMULATOR_BUS_CLOCK_HZ 100000 // Default i2c clock of the Raspberry Pi
+#define EMULATOR_STATUS_COUNTS_MAX_SIZE (5 + 6 * EMULATOR_DEVICES - 1) // Longest step counters line of the status
+#define EMULATOR_ACK_MAX_SIZE 14 // Longest acknowledgement of a sequenced reply
+#define EMULATOR_GEAR_RATIO_MAX 255 // Largest numerator and denominator of a gear ratio
+#define EMULATOR_JOG_ACCELERATION 1000 // Steps per second squared, when the jog command has no acceleration
+#define EMULATOR_RATE_ONE 0x1000000 // Jog rate of one step pin toggle per tick, 8.24 fixed point
+
+typedef struct
+{
+    uint64_t ticks; // Timer ticks run
+    uint64_t idle_ticks; // Ticks without a command to run, not counting pauses
+    uint32_t completed; // Run commands completed
+    uint32_t underruns; // Times the queue ran empty after a command completed
+    uint32_t transactions;
+} EmulatorStats;
+
+// Called for every step of the emulated board, on the falling edge of the step pin where the firmware counts it
+typedef void (*EmulatorTraceCallback)(uint64_t tick, int device_id, bool is_clockwise, void *context);
+
+// Transport of the emulated board, runs in virtual time
+extern const I2cTransport emulator_transport;
+
+/**
+ * function: emulator_reset()
+ * 
+ * Powers up the emulated board with an empty queue and the virtual clock at zero.
+ * @parameter address - i2c address of the board
+ * @parameter bus_clock_hz - i2c clock used for the time of a transaction
+ * @parameter wall_clock - also advance the virtual clock by the real time between transactions,
+ *                         so a host waiting with sleeps sees the board run commands
+ * 
+ */
+extern void emulator_reset(uint8_t address, uint32_t bus_clock_hz, bool wall_clock);
+
+/**
+ * function: emulator_advance()
+ * 
+ * Advances the virtual clock, the board runs the timer ticks of the interval.
+ * @parameter duration_ns - interval in nanoseconds
+ * 
+ */
+extern void emulator_advance(uint64_t duration_ns);
+
+/**
+ * function: emulator_time_ns()
+ * 
+ * Returns the virtual clock in nanoseconds.
+ * 
+ */
+extern uint64_t emulator_time_ns();
+
+/**
+ * function: emulator_is_idle()
+ * 
+ * Returns true when the board has no command to run.
+ * 
+ */
+extern bool emulator_is_idle();
+
+/**
+ * function: emulator_get_stats()
+ * 
+ * Returns the counters of the emulated board since the last reset.
+ * 
+ */
+extern EmulatorStats emulator_get_stats();
+
+/**
+ * function: emulator_set_trace()
+ * 
+ * Calls the callback for every step of the emulated board, with the tick and the direction of the step.
+ * The trace is kept until the next emulator_reset().
+ * @parameter callback - called for each step, NULL to stop tracing
+ * @parameter context - passed to the callback
+ * 
+ */
+extern void emulator_set_trace(EmulatorTraceCallback callback, void *context);
+
+#endif /* EMULATOR_H_ */
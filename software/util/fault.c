@@ -0,0 +1,147 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include "i2clib.h"
+#include "fault.h"
+
+static const I2cTransport *inner_transport = NULL;
+static FaultConfig fault_config;
+static FaultStats fault_stats;
+static unsigned int fault_seed = 1;
+static uint32_t transfer_timeout_ms = 0; // Limit of a hung transfer, 0 - hangs for hang_ms
+static bool is_stuck = false;
+
+static bool draw(double probability)
+{
+    return probability > 0 && rand_r(&fault_seed) < probability * RAND_MAX;
+}
+
+static void hang()
+{
+    uint64_t duration_ms = transfer_timeout_ms > 0 && transfer_timeout_ms < fault_config.hang_ms ?
+                           transfer_timeout_ms : fault_config.hang_ms;
+    struct timespec duration = {
+        .tv_sec = duration_ms / 1000,
+        .tv_nsec = (duration_ms % 1000) * 1000000L,
+    };
+    nanosleep(&duration, NULL);
+}
+
+/**
+ * Returns the error of the transfer, 0 if it runs without a fault.
+ */
+static int inject_fault(bool is_write)
+{
+    if (is_stuck)
+    {
+        // A device holds the data line low, the adapter can't start a transfer
+        fault_stats.stuck_transfers++;
+        return EBUSY;
+    }
+    if (draw(fault_config.hang))
+    {
+        fault_stats.hangs++;
+        hang();
+        return ETIMEDOUT;
+    }
+    if (is_write && draw(fault_config.stuck))
+    {
+        // The transfer is cut in the middle of a byte and the bus stays busy
+        fault_stats.stuck++;
+        is_stuck = true;
+        hang();
+        return ETIMEDOUT;
+    }
+    if (draw(fault_config.nack))
+    {
+        fault_stats.nacks++;
+        return EREMOTEIO;
+    }
+    return 0;
+}
+
+void fault_configure(const I2cTransport *inner, const FaultConfig *config)
+{
+    inner_transport = inner;
+    fault_config = *config;
+    fault_seed = config->seed;
+    fault_stats = (FaultStats){0};
+    is_stuck = false;
+}
+
+FaultStats fault_get_stats()
+{
+    return fault_stats;
+}
+
+static int fault_open(uint8_t address, bool verbose)
+{
+    transfer_timeout_ms = 0;
+    return inner_transport->open(address, verbose);
+}
+
+static int fault_write(int handle, const char *data, int length)
+{
+    fault_stats.writes++;
+    int error = inject_fault(true);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return inner_transport->write(handle, data, length);
+}
+
+static int fault_read(int handle, char *data, int length)
+{
+    fault_stats.reads++;
+    int error = inject_fault(false);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return inner_transport->read(handle, data, length);
+}
+
+static void fault_close(int handle)
+{
+    inner_transport->close(handle);
+}
+
+static void fault_set_timeout(int handle, uint32_t timeout_ms)
+{
+    transfer_timeout_ms = timeout_ms;
+    if (inner_transport->set_timeout != NULL)
+    {
+        inner_transport->set_timeout(handle, timeout_ms);
+    }
+}
+
+static bool fault_recover(int handle, uint8_t address)
+{
+    // Clocking the bus releases the device holding the data line
+    fault_stats.recoveries++;
+    is_stuck = false;
+    return inner_transport->recover == NULL || inner_transport->recover(handle, address);
+}
+
+const I2cTransport fault_transport = {
+    .name = "fault injection",
+    .open = fault_open,
+    .write = fault_write,
+    .read = fault_read,
+    .close = fault_close,
+    .set_timeout = fault_set_timeout,
+    .recover = fault_recover,
+};
@@ -0,0 +1,61 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef FAULT_H_
+#define FAULT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+
+#define FAULT_HANG_MS 200 // Time a hung transfer blocks without a transfer timeout
+
+typedef struct
+{
+    double nack; // Probability a write or read isn't acknowledged
+    double hang; // Probability a write or read hangs until the transfer timeout
+    double stuck; // Probability a write leaves the bus stuck until it is recovered
+    uint32_t hang_ms; // Time a hung transfer blocks without a transfer timeout
+    unsigned int seed; // Seed of the fault sequence, the same seed injects the same faults
+} FaultConfig;
+
+typedef struct
+{
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t nacks;
+    uint64_t hangs;
+    uint64_t stuck; // Times the bus got stuck
+    uint64_t stuck_transfers; // Transfers failed on the stuck bus
+    uint64_t recoveries;
+} FaultStats;
+
+// Transport injecting faults into the transfers of another transport
+extern const I2cTransport fault_transport;
+
+/**
+ * function: fault_configure()
+ * 
+ * Sets the transport the faults are injected into and the fault probabilities, and clears the counters.
+ * A failed transfer sets errno like the Linux i2c driver: EREMOTEIO when it isn't acknowledged, ETIMEDOUT
+ * when it timed out and EBUSY on a stuck bus.
+ * @parameter inner - transport doing the transfers without faults
+ * @parameter config - fault probabilities
+ * 
+ */
+extern void fault_configure(const I2cTransport *inner, const FaultConfig *config);
+
+/**
+ * function: fault_get_stats()
+ * 
+ * Returns the counters of the transfers and the injected faults since the last configuration.
+ * 
+ */
+extern FaultStats fault_get_stats();
+
+#endif /* FAULT_H_ */
@@ -15,7 +15,93 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "i2clib.h"
+#include "capture.h"
+#include "stats.h"
+
+static int dev_write(int handle, const char *data, int length)
+{
+    return write(handle, data, length);
+}
+
+static int dev_read(int handle, char *data, int length)
+{
+    return read(handle, data, length);
+}
+
+static void dev_close(int handle)
+{
+    close(handle);
+}
+
+static void dev_set_timeout(int handle, uint32_t timeout_ms)
+{
+    // The adapter timeout is set in units of 10 ms, without a limit the adapter keeps its own timeout
+    if (timeout_ms > 0)
+    {
+        ioctl(handle, I2C_TIMEOUT, (timeout_ms + 9) / 10);
+    }
+}
+
+const I2cTransport i2c_dev_transport = {
+    .name = "/dev/i2c-1",
+    .open = get_slave_access,
+    .write = dev_write,
+    .read = dev_read,
+    .close = dev_close,
+    .set_timeout = dev_set_timeout,
+    .recover = NULL, // No access to the bus lines, see i2clib.h
+    .is_timeout_shared = true,
+};
+
+static const I2cTransport *transport = &i2c_dev_transport;
+
+static const I2cPolicy default_policy = {
+    .timeout_ms = I2C_POLICY_TIMEOUT_MS,
+    .retries = I2C_POLICY_RETRIES,
+    .backoff_us = I2C_POLICY_BACKOFF_US,
+    .recover = true,
+    .retry_writes = false,
+    .shared_timeout = false,
+};
+
+static I2cPolicy policy = {
+    .timeout_ms = I2C_POLICY_TIMEOUT_MS,
+    .retries = I2C_POLICY_RETRIES,
+    .backoff_us = I2C_POLICY_BACKOFF_US,
+    .recover = true,
+    .retry_writes = false,
+    .shared_timeout = false,
+};
+
+// Read by the bus threads of the asynchronous API, each transaction works with a copy taken under the lock
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters of all threads, the asynchronous API transfers from its bus threads
+static I2cStats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reason of the last failed transaction of the thread
+static __thread int last_error = I2C_ERROR_NONE;
+static __thread int last_errno = 0;
+static __thread char last_error_text[96];
+static __thread unsigned int jitter_seed = 0;
+
+static const char *error_names[I2C_ERROR_COUNT] = {
+    "no error",
+    "device open failed",
+    "write not acknowledged",
+    "read failed",
+    "timed out",
+    "bus busy",
+};
+
+void set_transport(const I2cTransport *new_transport)
+{
+    transport = new_transport != NULL ? new_transport : &i2c_dev_transport;
+}
 
 int get_slave_access(uint8_t address, bool verbose)
 {
@@ -41,66 +127,475 @@ int get_slave_access(uint8_t address, bool verbose)
         {
             printf("Failed to acquire buss access: %s\n", strerror(errno));
         }
+        int error_number = errno;
+        close(file_id);
+        errno = error_number;
         return -1;
     }
 
     return file_id;
 }
 
-char *send_get_data(uint8_t address, char *message, bool verbose)
+/**
+ * Returns a copy of the policy, set_transaction_policy() may change it from another thread.
+ */
+static I2cPolicy copy_policy()
+{
+    pthread_mutex_lock(&policy_lock);
+    I2cPolicy copy = policy;
+    pthread_mutex_unlock(&policy_lock);
+    return copy;
+}
+
+/**
+ * Returns the timeout of one write or read, the deadline is shared by the attempts of a transaction.
+ */
+static uint32_t attempt_timeout_ms(const I2cPolicy *current)
+{
+    uint32_t timeout_ms = current->timeout_ms / (current->retries + 1);
+    return timeout_ms > 0 ? timeout_ms : 1;
+}
+
+/**
+ * Limits the time of the next writes and reads, unless the timeout of the transport is shared by the whole
+ * adapter and the policy doesn't allow changing it.
+ */
+static void set_transfer_timeout(const I2cPolicy *current, int handle, uint32_t timeout_ms)
+{
+    if (transport->set_timeout != NULL && (!transport->is_timeout_shared || current->shared_timeout))
+    {
+        transport->set_timeout(handle, timeout_ms);
+    }
+}
+
+int open_device(uint8_t address, bool verbose)
+{
+    I2cPolicy current = copy_policy();
+    int handle = transport->open(address, verbose);
+    if (handle >= 0 && current.timeout_ms > 0)
+    {
+        set_transfer_timeout(&current, handle, attempt_timeout_ms(&current));
+    }
+    return handle;
+}
+
+void close_device(int handle)
+{
+    if (handle >= 0)
+    {
+        transport->close(handle);
+    }
+}
+
+/**
+ * Returns the reason of a failed write or read from the system error.
+ */
+static int classify_error(int error_number, int reason)
+{
+    switch (error_number)
+    {
+    case ETIMEDOUT: return I2C_ERROR_TIMEOUT;
+    case EBUSY:
+    case EAGAIN: return I2C_ERROR_BUS_BUSY; // Busy bus or lost arbitration
+    default: return reason;
+    }
+}
+
+static void sleep_us(uint64_t duration_us)
+{
+    struct timespec duration = {
+        .tv_sec = duration_us / 1000000ULL,
+        .tv_nsec = (duration_us % 1000000ULL) * 1000ULL,
+    };
+    nanosleep(&duration, NULL);
+}
+
+/**
+ * Returns the backoff before the retry, doubled on every retry and reduced by a random jitter of up to a half,
+ * so retries of several hosts on a shared bus don't collide again.
+ */
+static uint64_t retry_backoff_us(const I2cPolicy *current, int retry)
+{
+    if (jitter_seed == 0)
+    {
+        jitter_seed = (unsigned int)monotonic_ns() | 1;
+    }
+    uint64_t backoff_us = (uint64_t)current->backoff_us << (retry < 20 ? retry : 20);
+    return backoff_us - (backoff_us / 2) * rand_r(&jitter_seed) / RAND_MAX;
+}
+
+static void record_transaction(uint64_t latency_ns, int error, int retries, int recoveries)
+{
+    int bucket = 0;
+    for (uint64_t limit_ns = I2C_LATENCY_BUCKET_US * 1000ULL; latency_ns >= limit_ns && bucket < I2C_LATENCY_BUCKETS - 1; limit_ns *= 2)
+    {
+        bucket++;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    stats.transactions++;
+    stats.failures += error != I2C_ERROR_NONE;
+    stats.retries += retries;
+    stats.recoveries += recoveries;
+    stats.latency_buckets[bucket]++;
+    if (latency_ns > stats.max_latency_ns)
+    {
+        stats.max_latency_ns = latency_ns;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void record_error(int error)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.errors[error]++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Checks if a failed write can be written again. A write that failed after the address was acknowledged
+ * may have reached the board, which would run it twice, unless it is sequenced or the policy allows it.
+ * Only ENXIO tells that the address wasn't acknowledged. EREMOTEIO is also a NACK in the middle of the write on
+ * the bcm2835 controller of the Raspberry Pi, where the board may have received the command.
+ */
+static bool can_retry_write(const I2cPolicy *current, const char *data, int error_number)
+{
+    return error_number == ENXIO || data[0] == SEQUENCE_PREFIX || current->retry_writes;
+}
+
+/**
+ * Writes the null terminated commands to an open device and reads back the response, retrying a failed
+ * write or read following the policy. The message is the text recorded by the capture.
+ */
+static bool transfer_buffer(int handle, uint8_t address, const char *message, const char *write_buffer, int length,
+                            char *response, bool verbose)
 {
     char read_buffer[MAX_BUFFER_SIZE];
-    char *result = malloc(sizeof(char) * MAX_BUFFER_SIZE);
-    int file_id = get_slave_access(address, verbose);
-    int length = strlen(message) + 1;
-    bool is_lib_error = true;
+    I2cPolicy current = copy_policy();
+    uint64_t start_ns = monotonic_ns();
+    uint64_t deadline_ns = current.timeout_ms > 0 ? start_ns + current.timeout_ms * 1000000ULL : 0;
+    bool is_written = false;
+    int error = handle >= 0 ? I2C_ERROR_NONE : I2C_ERROR_OPEN;
+    int error_number = handle >= 0 ? 0 : errno;
+    int retries = 0;
+    int recoveries = 0;
 
-    if (verbose)
+    if (handle < 0)
     {
-        printf("send_get_data()\n");
-        printf("Address: %d\n", address);
-        printf("Message: %s\n", message);
+        record_error(I2C_ERROR_OPEN);
     }
 
-    if (file_id >= 0)
+    while (handle >= 0)
     {
-        if (write(file_id, message, length) != length)
+        if (!is_written)
         {
-            if (verbose)
+            if (transport->write(handle, write_buffer, length) != length)
             {
-                printf("Failed to write to the i2c bus: %s\n", strerror(errno));
+                error_number = errno;
+                error = classify_error(error_number, I2C_ERROR_WRITE);
+                if (verbose)
+                {
+                    printf("Failed to write to the i2c bus: %s\n", strerror(error_number));
+                }
             }
-        }
-        else
-        {
-            if (verbose)
+            else
             {
-                printf("Message sent\n");
+                is_written = true;
+                if (verbose)
+                {
+                    printf("Message sent\n");
+                }
             }
+        }
 
-            int bytes_read = read(file_id, read_buffer, MAX_BUFFER_SIZE);
+        if (is_written)
+        {
+            // A failed read is read again, the board keeps the response of the last write
+            int bytes_read = transport->read(handle, read_buffer, MAX_BUFFER_SIZE);
             if (bytes_read > 0)
             {
-                is_lib_error = false;
-                strcpy(result, read_buffer);
-                close(file_id);
+                error = I2C_ERROR_NONE;
+                read_buffer[MAX_BUFFER_SIZE - 1] = '\0';
+                strcpy(response, read_buffer);
                 if (verbose)
                 {
-                    printf("Message read: %s\n", result);
+                    printf("Message read: %s\n", response);
                 }
+                break;
             }
-            else if (verbose)
+            error_number = errno;
+            error = classify_error(error_number, I2C_ERROR_READ);
+            if (verbose)
+            {
+                printf("Failed to read bytes: %s\n", strerror(error_number));
+            }
+        }
+
+        record_error(error);
+        if ((error == I2C_ERROR_TIMEOUT || error == I2C_ERROR_BUS_BUSY) && current.recover && transport->recover != NULL)
+        {
+            // A timed out transfer may leave a device holding the bus
+            bool is_recovered = transport->recover(handle, address);
+            recoveries++;
+            if (verbose)
             {
+                printf("Bus recovery %s\n", is_recovered ? "done" : "failed");
+            }
+        }
 
-                printf("Failed to read bytes: %s\n", strerror(errno));
+        if (retries >= current.retries)
+        {
+            break;
+        }
+        if (!is_written && !can_retry_write(&current, write_buffer, error_number))
+        {
+            if (verbose)
+            {
+                printf("Write not retried, the device may have received it\n");
             }
+            break;
+        }
+        uint64_t backoff_us = retry_backoff_us(&current, retries);
+        if (deadline_ns > 0 && monotonic_ns() + backoff_us * 1000ULL + 1000000ULL >= deadline_ns)
+        {
+            // No time left for a retry
+            error = I2C_ERROR_TIMEOUT;
+            error_number = ETIMEDOUT;
+            break;
+        }
+        sleep_us(backoff_us);
+        if (deadline_ns > 0)
+        {
+            // The transfers of the retry end by the deadline
+            uint64_t remaining_ms = (deadline_ns - monotonic_ns()) / 1000000ULL;
+            remaining_ms = remaining_ms < attempt_timeout_ms(&current) ? remaining_ms : attempt_timeout_ms(&current);
+            set_transfer_timeout(&current, handle, remaining_ms > 0 ? remaining_ms : 1);
+        }
+        retries++;
+        if (verbose)
+        {
+            printf("Retry %d after %llu us\n", retries, (unsigned long long)backoff_us);
         }
     }
 
+    if (retries > 0 && deadline_ns > 0)
+    {
+        set_transfer_timeout(&current, handle, attempt_timeout_ms(&current));
+    }
+
+    bool is_lib_error = error != I2C_ERROR_NONE;
+    uint64_t end_ns = monotonic_ns();
+    record_transaction(end_ns - start_ns, error, retries, recoveries);
+
+    if (message != NULL)
+    {
+        capture_transaction(address, message, response, start_ns, end_ns, is_lib_error);
+    }
+
+    last_error = error;
+    last_errno = error_number;
     if (is_lib_error)
     {
-        strcpy(result, LIB_ERROR_MSG);
+        strcpy(response, LIB_ERROR_MSG);
+    }
+
+    return !is_lib_error;
+}
+
+bool transfer_data(int handle, uint8_t address, const char *message, char *response, bool verbose)
+{
+    int length = strlen(message) + 1;
+    char write_buffer[length];
+
+    // Commands separated by new lines are sent null terminated in one write
+    for (int i = 0; i < length; i++)
+    {
+        write_buffer[i] = message[i] == '\n' ? '\0' : message[i];
     }
 
+    if (verbose)
+    {
+        printf("transfer_data()\n");
+        printf("Address: %d\n", address);
+        printf("Message: %s\n", message);
+    }
+
+    return transfer_buffer(handle, address, message, write_buffer, length, response, verbose);
+}
+
+bool transfer_frame(int handle, uint8_t address, const char *frame, int length, char *response, bool verbose)
+{
+    char message[length > 0 ? length : 1];
+
+    if (verbose)
+    {
+        printf("transfer_frame()\n");
+        printf("Address: %d\n", address);
+        printf("Frame: %d bytes\n", length);
+    }
+
+    if (!capture_is_active())
+    {
+        return transfer_buffer(handle, address, NULL, frame, length, response, verbose);
+    }
+
+    // The capture records the commands separated by new lines
+    for (int i = 0; i < length; i++)
+    {
+        message[i] = frame[i] == '\0' && i < length - 1 ? '\n' : frame[i];
+    }
+    message[length > 0 ? length - 1 : 0] = '\0';
+    return transfer_buffer(handle, address, message, frame, length, response, verbose);
+}
+
+char *send_get_data(uint8_t address, char *message, bool verbose)
+{
+    char *result = malloc(sizeof(char) * MAX_BUFFER_SIZE);
+    int file_id = open_device(address, verbose);
+
+    if (verbose)
+    {
+        printf("send_get_data()\n");
+    }
+
+    transfer_data(file_id, address, message, result, verbose);
+    close_device(file_id);
+
+    return result;
+}
+
+void set_transaction_policy(const I2cPolicy *new_policy)
+{
+    pthread_mutex_lock(&policy_lock);
+    policy = new_policy != NULL ? *new_policy : default_policy;
+    pthread_mutex_unlock(&policy_lock);
+}
+
+I2cPolicy get_transaction_policy()
+{
+    return copy_policy();
+}
+
+I2cStats get_transaction_stats()
+{
+    pthread_mutex_lock(&stats_lock);
+    I2cStats result = stats;
+    pthread_mutex_unlock(&stats_lock);
     return result;
 }
+
+void reset_transaction_stats()
+{
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void print_transaction_stats(FILE *out, const I2cStats *stats)
+{
+    fprintf(out, "Transactions: %llu, failed: %llu, retries: %llu, bus recoveries: %llu, max latency: %.1f us\n",
+            (unsigned long long)stats->transactions, (unsigned long long)stats->failures,
+            (unsigned long long)stats->retries, (unsigned long long)stats->recoveries, stats->max_latency_ns / 1000.0);
+    for (int i = I2C_ERROR_NONE + 1; i < I2C_ERROR_COUNT; i++)
+    {
+        if (stats->errors[i] > 0)
+        {
+            fprintf(out, "  %s: %llu\n", error_names[i], (unsigned long long)stats->errors[i]);
+        }
+    }
+    uint64_t limit_us = I2C_LATENCY_BUCKET_US;
+    for (int i = 0; i < I2C_LATENCY_BUCKETS; i++, limit_us *= 2)
+    {
+        if (stats->latency_buckets[i] == 0)
+        {
+            continue;
+        }
+        if (i < I2C_LATENCY_BUCKETS - 1)
+        {
+            fprintf(out, "  < %llu us: %llu\n", (unsigned long long)limit_us, (unsigned long long)stats->latency_buckets[i]);
+        }
+        else
+        {
+            fprintf(out, "  >= %llu us: %llu\n", (unsigned long long)limit_us / 2, (unsigned long long)stats->latency_buckets[i]);
+        }
+    }
+}
+
+int get_transaction_error()
+{
+    return last_error;
+}
+
+const char *get_transaction_error_text()
+{
+    if (last_error == I2C_ERROR_NONE || last_errno == 0)
+    {
+        return error_names[last_error];
+    }
+    snprintf(last_error_text, sizeof(last_error_text), "%s: %s", error_names[last_error], strerror(last_errno));
+    return last_error_text;
+}
+
+/**
+ * Compares the response with a text, ignoring the acknowledgement of sequenced commands.
+ */
+static bool is_response(const char *response, const char *text)
+{
+    size_t length = strlen(text);
+    return strncmp(response, text, length) == 0 &&
+           (response[length] == '\0' || strncmp(response + length, RESPONSE_ACK, strlen(RESPONSE_ACK)) == 0);
+}
+
+int classify_response(const char *response)
+{
+    if (is_response(response, LIB_ERROR_MSG))
+    {
+        return RESPONSE_LIB_ERROR;
+    }
+    if (strncmp(response, RESPONSE_INVALID, strlen(RESPONSE_INVALID)) == 0 ||
+        is_response(response, RESPONSE_BUFFER_FULL))
+    {
+        return RESPONSE_REJECTED;
+    }
+    return RESPONSE_ACCEPTED;
+}
+
+bool parse_ack(char *response, int *sequence, int *depth)
+{
+    char *ack = strstr(response, RESPONSE_ACK);
+    if (ack == NULL || sscanf(ack + strlen(RESPONSE_ACK), "%d,%d", sequence, depth) != 2)
+    {
+        return false;
+    }
+    *ack = '\0';
+    return true;
+}
+
+int parse_multi_response(const char *response, char *codes)
+{
+    size_t prefix_length = strlen(RESPONSE_MULTI_PREFIX);
+    if (strncmp(response, RESPONSE_MULTI_PREFIX, prefix_length) != 0)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    for (const char *code = response + prefix_length; *code >= '0' && *code <= '9' && count < MULTI_COMMAND_MAX; code++)
+    {
+        codes[count++] = *code - '0';
+    }
+    return count;
+}
+
+const char *response_for_code(int code)
+{
+    switch (code)
+    {
+    case COMMAND_STATUS_OK: return RESPONSE_OK;
+    case COMMAND_STATUS_BUFFER_FULL: return RESPONSE_BUFFER_FULL;
+    case COMMAND_STATUS_INVALID_DEVICE: return "INVALID DEVICE ID";
+    case COMMAND_STATUS_INVALID_STEPS: return "INVALID STEPS VALUE";
+    case COMMAND_STATUS_INVALID_SPEED: return "INVALID SPEED VALUE";
+    default: return RESPONSE_INVALID;
+    }
+}
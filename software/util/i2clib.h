@@ -9,12 +9,111 @@
 #ifndef I2CLIB_H_
 #define I2CLIB_H_
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 #define RESPONSE_INVALID "INVALID"
+#define RESPONSE_BUFFER_FULL "BUFFER FULL"
+#define RESPONSE_OK "OK"
+#define RESPONSE_MULTI_PREFIX "R:"
 #define LIB_ERROR_MSG "lib error"
 #define I2C_ADDRESS_MIN 0x03
 #define I2C_ADDRESS_MAX 0x77
 #define MAX_BUFFER_SIZE 150
 
+// Maximum commands the board processes in one write, see transfer_data()
+#define MULTI_COMMAND_MAX 16
+
+// Optional command prefix @<sequence>:, the board acknowledges a retried command without running it again
+#define SEQUENCE_PREFIX '@'
+#define SEQUENCE_MAX 65535
+// Response suffix of sequenced commands, format: ACK:<last_sequence>,<queue_depth>
+#define RESPONSE_ACK "\nACK:"
+
+// Status codes of the aggregated response to multiple commands
+#define COMMAND_STATUS_OK 0
+#define COMMAND_STATUS_BUFFER_FULL 1
+#define COMMAND_STATUS_INVALID_DEVICE 2
+#define COMMAND_STATUS_INVALID_STEPS 3
+#define COMMAND_STATUS_INVALID_SPEED 4
+#define COMMAND_STATUS_INVALID 5
+
+// Response classes returned by classify_response()
+#define RESPONSE_ACCEPTED 0
+#define RESPONSE_REJECTED 1
+#define RESPONSE_LIB_ERROR 2
+
+// Reasons of a failed transaction, see get_transaction_error()
+#define I2C_ERROR_NONE 0
+#define I2C_ERROR_OPEN 1 // The device couldn't be opened
+#define I2C_ERROR_WRITE 2 // The write wasn't acknowledged
+#define I2C_ERROR_READ 3 // The response couldn't be read
+#define I2C_ERROR_TIMEOUT 4 // A transfer or the transaction deadline timed out
+#define I2C_ERROR_BUS_BUSY 5 // The bus is held by another master or a stuck device
+#define I2C_ERROR_COUNT 6
+
+// Default transaction policy, see set_transaction_policy()
+#define I2C_POLICY_TIMEOUT_MS 100
+#define I2C_POLICY_RETRIES 2
+#define I2C_POLICY_BACKOFF_US 500
+
+// Latency histogram, bucket 0 counts latencies below I2C_LATENCY_BUCKET_US, each next bucket doubles the limit
+// and the last bucket counts the rest
+#define I2C_LATENCY_BUCKETS 16
+#define I2C_LATENCY_BUCKET_US 16
+
+typedef struct
+{
+    uint32_t timeout_ms; // Deadline of a transaction with its retries, 0 - no deadline
+    int retries; // Attempts after a failed write or read
+    uint32_t backoff_us; // Wait before the first retry, doubled on every retry, with random jitter
+    bool recover; // Recover the bus after a timeout or a busy bus, with transports that can
+    bool retry_writes; // Also retry writes the device may have received, it may run them twice
+    bool shared_timeout; // Also set the transfer timeout of transports where it applies to the whole adapter
+} I2cPolicy;
+
+typedef struct
+{
+    uint64_t transactions;
+    uint64_t failures; // Transactions answered with "lib error"
+    uint64_t retries;
+    uint64_t recoveries;
+    uint64_t errors[I2C_ERROR_COUNT]; // Failed attempts per I2C_ERROR_* reason
+    uint64_t latency_buckets[I2C_LATENCY_BUCKETS];
+    uint64_t max_latency_ns;
+} I2cStats;
+
+typedef struct
+{
+    const char *name;
+    // Opens access to the device, returns a handle or -1 if an error occured
+    int (*open)(uint8_t address, bool verbose);
+    // Writes bytes to the device, returns the number of bytes written or -1
+    int (*write)(int handle, const char *data, int length);
+    // Reads bytes from the device, returns the number of bytes read or -1
+    int (*read)(int handle, char *data, int length);
+    // Closes the device access
+    void (*close)(int handle);
+    // Optional, limits the time of the next writes and reads, 0 - no limit
+    void (*set_timeout)(int handle, uint32_t timeout_ms);
+    // Optional, brings the bus back to idle keeping the handle valid, returns false if it failed
+    bool (*recover)(int handle, uint8_t address);
+    // The timeout applies to every user of the adapter, it is set only with the shared_timeout policy
+    bool is_timeout_shared;
+} I2cTransport;
+
+// Transport using the Linux i2c device /dev/i2c-1.
+// It has no bus recovery, i2c-dev gives no access to the bus lines; the adapter driver clocks a stuck bus free
+// with nine SCL pulses and a STOP itself, where the controller supports it.
+// Its timeout is the I2C_TIMEOUT of the whole adapter, so it is only set with the shared_timeout policy: the value
+// applies to every driver and process using the adapter, and it is kept after the device is closed, as the previous
+// value can't be read back to restore it. Without it a write or read is bounded by the timeout of the adapter
+// driver, one second on most controllers, and the bcm2835 controller also ends a clock stretch after 35 ms.
+// The transaction deadline is still checked before every retry, a transaction ends within the deadline
+// and one adapter timeout.
+extern const I2cTransport i2c_dev_transport;
+
 /**
  * function: get_slave_access()
  * 
@@ -26,12 +125,22 @@
  */
 extern int get_slave_access(uint8_t address, bool verbose);
 
+/**
+ * function: set_transport()
+ * 
+ * Sets the transport used by send_get_data(), the default is i2c_dev_transport.
+ * @parameter transport - the transport to use, NULL restores the default
+ * 
+ */
+extern void set_transport(const I2cTransport *transport);
+
 /**
  * function: send_get_data()
  * 
  * Writes the message to the i2c device address file and reads back the response.
- * Returns the string read or "lib error" if the file couldn't be read
+ * Returns the string read or "lib error" if the file couldn't be read, see get_transaction_error()
  * This function will open and close the i2c access file.
+ * The transaction is recorded if a capture is active, see capture.h.
  * @parameter address - i2c device address
  * @parameter message - the message to be sent to the device
  * @parameter verbose - print additional details
@@ -39,4 +148,173 @@ extern int get_slave_access(uint8_t address, bool verbose);
  */
 extern char *send_get_data(uint8_t address, char *message, bool verbose);
 
+/**
+ * function: open_device()
+ * 
+ * Opens access to the device through the active transport, to send several messages in one session.
+ * With a transaction deadline, each write and read of the session times out after its share of the deadline.
+ * Returns the device handle or -1 if an error occured.
+ * @parameter address - i2c device address
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int open_device(uint8_t address, bool verbose);
+
+/**
+ * function: close_device()
+ * 
+ * Closes the device access opened with open_device(). No effect if the handle is negative.
+ * @parameter handle - device handle
+ * 
+ */
+extern void close_device(int handle);
+
+/**
+ * function: transfer_data()
+ * 
+ * Writes the message to an open device and reads back the response, without allocating memory.
+ * The message may hold up to MULTI_COMMAND_MAX commands separated by new lines, they are sent in
+ * one write and the board replies with one status code per command, see parse_multi_response().
+ * A failed write or read is retried following the transaction policy, see set_transaction_policy().
+ * The response is set to "lib error" if the device couldn't be written or read.
+ * Returns true if a response was read.
+ * @parameter handle - device handle returned by open_device()
+ * @parameter address - i2c device address, used for the capture
+ * @parameter message - the message to be sent to the device
+ * @parameter response - buffer of MAX_BUFFER_SIZE bytes for the response
+ * @parameter verbose - print additional details
+ * 
+ */
+extern bool transfer_data(int handle, uint8_t address, const char *message, char *response, bool verbose);
+
+/**
+ * function: transfer_frame()
+ * 
+ * Writes a frame of null terminated commands to an open device as is and reads back the response,
+ * like transfer_data() without converting the message.
+ * The response is set to "lib error" if the device couldn't be written or read.
+ * Returns true if a response was read.
+ * @parameter handle - device handle returned by open_device()
+ * @parameter address - i2c device address, used for the capture
+ * @parameter frame - up to MULTI_COMMAND_MAX commands, each null terminated
+ * @parameter length - bytes of the frame
+ * @parameter response - buffer of MAX_BUFFER_SIZE bytes for the response
+ * @parameter verbose - print additional details
+ * 
+ */
+extern bool transfer_frame(int handle, uint8_t address, const char *frame, int length, char *response, bool verbose);
+
+/**
+ * function: set_transaction_policy()
+ * 
+ * Sets the deadline and the retries of the transactions. A failed read is read again without writing the
+ * message twice, after a backoff of backoff_us doubled on every retry and reduced by a random jitter of up
+ * to a half. A failed write is written again only when the address wasn't acknowledged (ENXIO) or the
+ * message is sequenced, as the board may have received it and would run it twice; retry_writes retries every
+ * failed write. The bcm2835 controller of the Raspberry Pi reports every NACK as EREMOTEIO, there only sequenced
+ * writes are written again. A write or read times out after the deadline divided by the attempts,
+ * no retry starts past the deadline and the transfers of a retry time out by the deadline. The transfer
+ * timeout of a transport shared by the whole adapter is only set with shared_timeout.
+ * A timeout or a busy bus recovers the bus before the retry, with transports that can. The handles opened
+ * before keep the transfer timeout they were opened with. Each transaction uses the policy set when it started,
+ * the policy can be changed while the asynchronous API transfers from its bus threads.
+ * @parameter policy - the policy to use, NULL restores the default
+ * 
+ */
+extern void set_transaction_policy(const I2cPolicy *policy);
+
+/**
+ * function: get_transaction_policy()
+ * 
+ * Returns the active transaction policy.
+ * 
+ */
+extern I2cPolicy get_transaction_policy();
+
+/**
+ * function: get_transaction_stats()
+ * 
+ * Returns the counters of the transactions of all threads since the start or the last reset.
+ * 
+ */
+extern I2cStats get_transaction_stats();
+
+/**
+ * function: reset_transaction_stats()
+ * 
+ * Clears the transaction counters.
+ * 
+ */
+extern void reset_transaction_stats();
+
+/**
+ * function: print_transaction_stats()
+ * 
+ * Prints the transaction counters, the failed attempts per reason and the non empty latency buckets.
+ * @parameter out - output stream
+ * @parameter stats - counters returned by get_transaction_stats()
+ * 
+ */
+extern void print_transaction_stats(FILE *out, const I2cStats *stats);
+
+/**
+ * function: get_transaction_error()
+ * 
+ * Returns the I2C_ERROR_* reason of the last failed transaction of the calling thread,
+ * I2C_ERROR_NONE if its last transaction succeeded.
+ * 
+ */
+extern int get_transaction_error();
+
+/**
+ * function: get_transaction_error_text()
+ * 
+ * Returns the reason and the system error of the last failed transaction of the calling thread.
+ * 
+ */
+extern const char *get_transaction_error_text();
+
+/**
+ * function: classify_response()
+ * 
+ * Returns RESPONSE_LIB_ERROR for "lib error", RESPONSE_REJECTED when the board rejected
+ * the command (INVALID or BUFFER FULL responses), and RESPONSE_ACCEPTED otherwise.
+ * An acknowledgement at the end of the response is ignored.
+ * @parameter response - response returned by the board
+ * 
+ */
+extern int classify_response(const char *response);
+
+/**
+ * function: parse_ack()
+ * 
+ * Parses and removes the acknowledgement at the end of the response to sequenced commands.
+ * Returns false if the response has no acknowledgement.
+ * @parameter response - response returned by the board, truncated before the acknowledgement
+ * @parameter sequence - sequence number of the last command processed by the board
+ * @parameter depth - commands in the board buffer
+ * 
+ */
+extern bool parse_ack(char *response, int *sequence, int *depth);
+
+/**
+ * function: parse_multi_response()
+ * 
+ * Parses the aggregated response to multiple commands sent in one write, format R:<codes>.
+ * Returns the number of status codes, COMMAND_STATUS_* values, or -1 if the response is not aggregated.
+ * @parameter response - response returned by the board
+ * @parameter codes - buffer of MULTI_COMMAND_MAX status codes
+ * 
+ */
+extern int parse_multi_response(const char *response, char *codes);
+
+/**
+ * function: response_for_code()
+ * 
+ * Returns the single command response text for a command status code.
+ * @parameter code - COMMAND_STATUS_* value
+ * 
+ */
+extern const char *response_for_code(int code);
+
 #endif /* I2CLIB_H_ */
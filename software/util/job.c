@@ -0,0 +1,433 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "batch.h"
+#include "optimize.h"
+#include "job.h"
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} JobBuffer;
+
+typedef struct
+{
+    JobBuffer index;
+    JobBuffer data;
+    CommandFrame frame; // Frame being packed, see frame_add()
+    uint32_t frame_count;
+    uint32_t command_count;
+} JobBuilder;
+
+static bool buffer_append(JobBuffer *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->size + size)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+        {
+            return false;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+/**
+ * Appends the pending frame to the job data and its entry to the index.
+ */
+static bool finish_frame(JobBuilder *builder)
+{
+    if (builder->frame.commands == 0)
+    {
+        return true;
+    }
+
+    JobFrame frame = {
+        .offset = builder->data.size,
+        .length = builder->frame.length,
+        .commands = builder->frame.commands,
+        .flags = builder->frame.is_run ? JOB_FRAME_RUN : 0,
+    };
+    bool is_added = buffer_append(&builder->data, builder->frame.data, builder->frame.length) &&
+                    buffer_append(&builder->index, &frame, sizeof(frame));
+    builder->frame_count++;
+    frame_clear(&builder->frame);
+    return is_added;
+}
+
+/**
+ * Adds a command to the pending frame, consecutive run commands share a frame as long as they fit the device buffer.
+ */
+static bool add_command(JobBuilder *builder, const char *command)
+{
+    if (!frame_add(&builder->frame, command))
+    {
+        if (!finish_frame(builder))
+        {
+            return false;
+        }
+        frame_add(&builder->frame, command);
+    }
+    builder->command_count++;
+    return builder->frame.is_run || finish_frame(builder);
+}
+
+/**
+ * Adds a frame packed by the optimizer as it is.
+ */
+static bool add_frame(JobBuilder *builder, const CommandFrame *frame)
+{
+    if (!finish_frame(builder))
+    {
+        return false;
+    }
+    builder->frame = *frame;
+    builder->command_count += frame->commands;
+    return finish_frame(builder);
+}
+
+static bool write_job(JobBuilder *builder, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    JobHeader header = {
+        .version = JOB_VERSION,
+        .frame_count = builder->frame_count,
+        .command_count = builder->command_count,
+        .index_offset = sizeof(JobHeader),
+        .data_offset = sizeof(JobHeader) + builder->index.size,
+        .data_size = builder->data.size,
+    };
+    memcpy(header.magic, JOB_MAGIC, JOB_MAGIC_SIZE);
+
+    bool is_written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                      fwrite(builder->index.data, 1, builder->index.size, file) == builder->index.size &&
+                      fwrite(builder->data.data, 1, builder->data.size, file) == builder->data.size;
+    return fclose(file) == 0 && is_written;
+}
+
+int job_compile(FILE *input, const char *path, bool optimize)
+{
+    char line[MAX_BUFFER_SIZE + 2];
+    CommandFrame frames[OPTIMIZE_OUTPUT_MAX];
+    Optimizer optimizer;
+    JobBuilder builder;
+    RunSegment segment;
+    int line_number = 0;
+    int errors = 0;
+    bool is_built = true;
+
+    memset(&builder, 0, sizeof(builder));
+    optimizer_init(&optimizer);
+
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        line_number++;
+        if (strchr(line, '\n') == NULL && !feof(input))
+        {
+            // Skip the rest of a line longer than the device buffer
+            int c;
+            while ((c = fgetc(input)) != '\n' && c != EOF)
+            {
+            }
+            fprintf(stderr, "Line %d: command too long\n", line_number);
+            errors++;
+            continue;
+        }
+
+        char *command = trim_line(line);
+        if (command[0] == '#')
+        {
+            continue;
+        }
+
+        // Several commands of a line are separated by spaces, like the frames printed by util optimize
+        char *context;
+        for (command = strtok_r(command, " \t", &context); command != NULL; command = strtok_r(NULL, " \t", &context))
+        {
+            if (strncmp(command, "run", 3) == 0 && !parse_run_segment(command, &segment))
+            {
+                // Validated once here, the board would reject it on every run of the job
+                fprintf(stderr, "Line %d: invalid run command: %s\n", line_number, command);
+                errors++;
+                continue;
+            }
+
+            if (optimize)
+            {
+                int count = optimizer_add(&optimizer, command, frames);
+                for (int i = 0; i < count; i++)
+                {
+                    is_built = is_built && add_frame(&builder, &frames[i]);
+                }
+            }
+            else
+            {
+                is_built = is_built && add_command(&builder, command);
+            }
+        }
+    }
+    if (optimize)
+    {
+        int count = optimizer_flush(&optimizer, frames);
+        for (int i = 0; i < count; i++)
+        {
+            is_built = is_built && add_frame(&builder, &frames[i]);
+        }
+    }
+    is_built = is_built && finish_frame(&builder);
+
+    if (errors == 0 && is_built)
+    {
+        if (optimize)
+        {
+            optimizer_print_report(stderr, &optimizer);
+        }
+        is_built = write_job(&builder, path);
+        if (is_built)
+        {
+            fprintf(stderr, "Job: %u commands in %u frames, %zu bytes\n",
+                    builder.command_count, builder.frame_count, sizeof(JobHeader) + builder.index.size + builder.data.size);
+        }
+        else
+        {
+            fprintf(stderr, "Failed to write the job file: %s\n", path);
+        }
+    }
+
+    free(builder.index.data);
+    free(builder.data.data);
+    return errors == 0 && is_built ? 0 : 1;
+}
+
+/**
+ * Checks that the header, the index and every frame are inside the file, so frames are sent without checks.
+ */
+static bool is_valid_job(const uint8_t *data, size_t size)
+{
+    const JobHeader *header = (const JobHeader *)data;
+    if (size < sizeof(JobHeader) || memcmp(header->magic, JOB_MAGIC, JOB_MAGIC_SIZE) != 0 ||
+        header->version != JOB_VERSION ||
+        (uint64_t)header->index_offset + (uint64_t)header->frame_count * sizeof(JobFrame) > size ||
+        (uint64_t)header->data_offset + header->data_size > size)
+    {
+        return false;
+    }
+
+    const JobFrame *frames = (const JobFrame *)(data + header->index_offset);
+    const char *frame_data = (const char *)(data + header->data_offset);
+    for (uint32_t i = 0; i < header->frame_count; i++)
+    {
+        if (frames[i].length == 0 || frames[i].length > MAX_BUFFER_SIZE ||
+            frames[i].commands == 0 || frames[i].commands > MULTI_COMMAND_MAX ||
+            (uint64_t)frames[i].offset + frames[i].length > header->data_size ||
+            frame_data[frames[i].offset + frames[i].length - 1] != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+Job *job_open(const char *path)
+{
+    uint64_t start_ns = monotonic_ns();
+    struct stat file_stat;
+
+    int file_id = open(path, O_RDONLY);
+    if (file_id < 0)
+    {
+        return NULL;
+    }
+    if (fstat(file_id, &file_stat) < 0 || file_stat.st_size < (off_t)sizeof(JobHeader))
+    {
+        close(file_id);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file_id, 0);
+    // The mapping stays valid after the file is closed
+    close(file_id);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+
+    Job *job = malloc(sizeof(Job));
+    if (job == NULL || !is_valid_job(data, file_stat.st_size))
+    {
+        free(job);
+        munmap(data, file_stat.st_size);
+        return NULL;
+    }
+
+    job->data = data;
+    job->size = file_stat.st_size;
+    job->header = data;
+    job->frames = (const JobFrame *)(job->data + job->header->index_offset);
+    job->frame_data = (const char *)(job->data + job->header->data_offset);
+    job->open_ns = monotonic_ns() - start_ns;
+    return job;
+}
+
+void job_close(Job *job)
+{
+    if (job != NULL)
+    {
+        munmap((void *)job->data, job->size);
+        free(job);
+    }
+}
+
+int job_run(Job *job, uint8_t address, bool verbose)
+{
+    char response[MAX_BUFFER_SIZE];
+    char codes[MULTI_COMMAND_MAX];
+    LatencyStats stats;
+    uint32_t backoff_us = BACKOFF_MIN_US;
+    uint64_t first_write_ns = 0;
+    int worst_status = RESPONSE_ACCEPTED;
+    int rejected = 0;
+    int retries = 0;
+    int transactions = 0;
+
+    uint64_t run_start_ns = monotonic_ns();
+    int handle = open_device(address, verbose);
+    if (handle < 0)
+    {
+        fprintf(stderr, "Failed to open the device at address 0x%02x: %s\n", address, strerror(errno));
+        return RESPONSE_LIB_ERROR;
+    }
+
+    stats_init(&stats);
+    uint64_t cpu_start_ns = process_cpu_ns();
+
+    for (uint32_t frame_index = 0; frame_index < job->header->frame_count; frame_index++)
+    {
+        const JobFrame *frame = &job->frames[frame_index];
+        const char *data = job->frame_data + frame->offset;
+        int length = frame->length;
+        int count = frame->commands;
+        uint64_t waited_us = 0;
+
+        while (count > 0)
+        {
+            uint64_t start_ns = monotonic_ns();
+            transfer_frame(handle, address, data, length, response, verbose);
+            stats_add(&stats, monotonic_ns() - start_ns);
+            first_write_ns = first_write_ns > 0 ? first_write_ns : start_ns - run_start_ns;
+            transactions++;
+
+            if (count == 1)
+            {
+                codes[0] = strcmp(response, RESPONSE_BUFFER_FULL) == 0 ? COMMAND_STATUS_BUFFER_FULL :
+                           classify_response(response) == RESPONSE_ACCEPTED ? COMMAND_STATUS_OK : COMMAND_STATUS_INVALID;
+            }
+            else if (parse_multi_response(response, codes) != count)
+            {
+                // Not an aggregated response, every remaining command failed with it
+                int status = classify_response(response);
+                worst_status = status > worst_status ? status : worst_status;
+                rejected += count;
+                printf("%s\n", response);
+                break;
+            }
+
+            // The board rejects every run command after the first buffer full one in the same write
+            int accepted = 0;
+            while (accepted < count && codes[accepted] != COMMAND_STATUS_BUFFER_FULL)
+            {
+                if (codes[accepted] != COMMAND_STATUS_OK)
+                {
+                    rejected++;
+                    worst_status = worst_status > RESPONSE_REJECTED ? worst_status : RESPONSE_REJECTED;
+                    printf("%s\n", count == 1 ? response : response_for_code(codes[accepted]));
+                }
+                else if (!(frame->flags & JOB_FRAME_RUN))
+                {
+                    // Other commands are sent alone, their replies are printed like batch mode does
+                    printf("%s\n", response);
+                }
+                accepted++;
+            }
+            if (accepted == count)
+            {
+                if (waited_us == 0 && backoff_us > BACKOFF_MIN_US)
+                {
+                    backoff_us /= 2;
+                }
+                break;
+            }
+
+            // Send the rest of the frame again once the board ran queued commands
+            for (int i = 0; i < accepted; i++)
+            {
+                const char *next = memchr(data, '\0', length) + 1;
+                length -= next - data;
+                data = next;
+            }
+            count -= accepted;
+
+            if (!(frame->flags & JOB_FRAME_RUN) || waited_us >= BACKOFF_TIMEOUT_MS * 1000ULL)
+            {
+                rejected += count;
+                worst_status = worst_status > RESPONSE_REJECTED ? worst_status : RESPONSE_REJECTED;
+                for (int i = 0; i < count; i++)
+                {
+                    printf("%s\n", RESPONSE_BUFFER_FULL);
+                }
+                break;
+            }
+            usleep(backoff_us);
+            waited_us += backoff_us;
+            retries++;
+            backoff_us = backoff_us * 2 < BACKOFF_MAX_US ? backoff_us * 2 : BACKOFF_MAX_US;
+        }
+    }
+
+    uint64_t cpu_ns = process_cpu_ns() - cpu_start_ns;
+    uint64_t elapsed_ns = monotonic_ns() - run_start_ns;
+    close_device(handle);
+
+    stats_print(stderr, &stats, "Job", elapsed_ns);
+    fprintf(stderr, "Commands: %u, failed: %d, frames: %u, transactions: %d, buffer full retries: %d\n",
+            job->header->command_count, rejected, job->header->frame_count, transactions, retries);
+    fprintf(stderr, "Job start: open %.1f us, first write after %.1f us, host CPU %.2f us per frame\n",
+            job->open_ns / 1e3, first_write_ns / 1e3,
+            job->header->frame_count > 0 ? cpu_ns / 1e3 / job->header->frame_count : 0.0);
+    stats_free(&stats);
+
+    return worst_status;
+}
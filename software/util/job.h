@@ -0,0 +1,102 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef JOB_H_
+#define JOB_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Job file: JobHeader, the JobFrame index and the frame bytes. A frame holds the null terminated
+// commands of one write, ready to be sent to the board. Values are stored in the host byte order.
+#define JOB_MAGIC "FBSJOB"
+#define JOB_MAGIC_SIZE 6
+#define JOB_VERSION 1
+
+#define JOB_FRAME_RUN 0x01 // Frame with run commands only, a BUFFER FULL command is retried
+
+typedef struct __attribute__((packed))
+{
+    char magic[JOB_MAGIC_SIZE];
+    uint16_t version;
+    uint32_t frame_count;
+    uint32_t command_count;
+    uint32_t index_offset; // File offset of the frame index
+    uint32_t data_offset; // File offset of the frame bytes
+    uint32_t data_size;
+} JobHeader;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t offset; // Frame bytes offset from data_offset
+    uint8_t length; // Bytes of the write, up to MAX_BUFFER_SIZE
+    uint8_t commands; // Commands in the frame, up to MULTI_COMMAND_MAX
+    uint8_t flags; // JOB_FRAME_* values
+    uint8_t reserved;
+} JobFrame;
+
+typedef struct
+{
+    const uint8_t *data; // The mapped file
+    size_t size;
+    const JobHeader *header;
+    const JobFrame *frames;
+    const char *frame_data;
+    uint64_t open_ns; // Time spent mapping and validating the file
+} Job;
+
+/**
+ * function: job_compile()
+ * 
+ * Compiles a command list, one command per line or several separated by spaces, into a job file. Empty lines
+ * and lines starting with '#' are skipped. Consecutive run commands are packed in frames with frame_add(),
+ * like run_batch() sends them.
+ * Returns 0 if the job file was written, 1 if a run command is invalid or the file couldn't be written.
+ * @parameter input - stream with the commands
+ * @parameter path - job file path, the file is overwritten
+ * @parameter optimize - merge the run commands with the optimizer first, see optimize.h
+ * 
+ */
+extern int job_compile(FILE *input, const char *path, bool optimize);
+
+/**
+ * function: job_open()
+ * 
+ * Maps a job file to memory and validates the header and the index. Returns NULL if the file is not a valid job.
+ * @parameter path - job file path
+ * 
+ */
+extern Job *job_open(const char *path);
+
+/**
+ * function: job_close()
+ * 
+ * Unmaps the job file. No effect if the job is NULL.
+ * @parameter job - job returned by job_open()
+ * 
+ */
+extern void job_close(Job *job);
+
+/**
+ * function: job_run()
+ * 
+ * Sends the frames of the job over one device session as they are stored, without formatting or parsing
+ * the commands. Commands rejected with BUFFER FULL are retried with the batch backoff, the responses
+ * of rejected commands and the replies of other commands than run, like status, are printed. Prints the job
+ * start time, the host CPU time per frame and the latency statistics of the transactions to stderr.
+ * Returns RESPONSE_ACCEPTED if every command was accepted, otherwise the worst response class.
+ * @parameter job - job returned by job_open()
+ * @parameter address - i2c device address
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int job_run(Job *job, uint8_t address, bool verbose);
+
+#endif /* JOB_H_ */
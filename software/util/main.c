@@ -9,18 +9,320 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include "i2clib.h"
+#include "capture.h"
+#include "replay.h"
+#include "batch.h"
+#include "bench.h"
+#include "optimize.h"
+#include "emulator.h"
+#include "watch.h"
+#include "job.h"
+#include "fault.h"
 
+#define DEFAULT_ADDRESS 0x50 // Default board I2C address
+#define EXIT_USAGE 64
+
+void print_usage()
+{
+	printf("Usage: util [-a <address>] [--capture <file>] [--emulator] [--timeout <ms>] [--retries <count>] [--shared-timeout] <message>\n");
+	printf("       util [-a <address>] [--capture <file>] [--emulator] [--timeout <ms>] [--retries <count>] [--shared-timeout] batch [--seq] [<file>|-]\n");
+	printf("       util [-a <address>] [--emulator] watch [--rate <hz>] [--count <samples>] [--binary] [<file>|-]\n");
+	printf("       util [-a <address>] [--capture <file>] [--emulator] job <job file>\n");
+	printf("       util compile [--optimize] <file>|- <job file>\n");
+	printf("       util replay <file> [--fast] [--sim]\n");
+	printf("       util optimize [<file>|-]\n");
+	printf("       util bench [--requests <count>] [--depth <count>] [--buses <count>]\n");
+	printf("       util emubench [--commands <count>] [--bus <hz>]\n");
+	printf("       util faultbench [--count <transactions>] [--nack <%%>] [--hang <%%>] [--stuck <%%>] [--timeout <ms>]\n");
+	printf("Exit status: 0 - accepted, 1 - rejected by the board, 2 - communication error\n");
+}
 
 int main(int argc, char **argv){
 	
-	if (argc > 1) {
-		// The board I2C address is hardcoded, change it if you use different address
-		char* result = send_get_data(0x50, argv[1], false);
-		printf("%s\n",result);
-	} else {
+	uint8_t address = DEFAULT_ADDRESS;
+	bool emulated = false;
+	int arg_index = 1;
+	
+	if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+		// Replay a capture file: replay <file> [--fast] [--sim]
+		bool fast = false;
+		bool simulated = false;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "--fast") == 0) {
+				fast = true;
+			} else if (strcmp(argv[i], "--sim") == 0) {
+				simulated = true;
+			}
+		}
+		return replay_capture(argv[2], fast, simulated, false);
+	}
+	
+	if (argc > 1 && strcmp(argv[1], "optimize") == 0) {
+		// Optimize a command list, the result is written to the standard output: optimize [<file>|-]
+		FILE *input = stdin;
+		if (argc > 2 && strcmp(argv[2], "-") != 0) {
+			input = fopen(argv[2], "r");
+			if (input == NULL) {
+				printf("Failed to open file: %s\n", argv[2]);
+				return EXIT_USAGE;
+			}
+		}
+		int status = run_optimize(input, stdout);
+		if (input != stdin) {
+			fclose(input);
+		}
+		return status;
+	}
+	
+	if (argc > 3 && strcmp(argv[1], "compile") == 0) {
+		// Compile a command list to a job file: compile [--optimize] <file>|- <job file>
+		bool optimize = strcmp(argv[2], "--optimize") == 0;
+		int file_index = optimize ? 3 : 2;
+		if (file_index + 1 >= argc) {
+			print_usage();
+			return EXIT_USAGE;
+		}
+		FILE *input = stdin;
+		if (strcmp(argv[file_index], "-") != 0) {
+			input = fopen(argv[file_index], "r");
+			if (input == NULL) {
+				printf("Failed to open file: %s\n", argv[file_index]);
+				return EXIT_USAGE;
+			}
+		}
+		int status = job_compile(input, argv[file_index + 1], optimize);
+		if (input != stdin) {
+			fclose(input);
+		}
+		return status;
+	}
+	
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		// Benchmark against a simulated device: bench [--requests <count>] [--depth <count>] [--buses <count>]
+		int requests = 1000;
+		int depth = 8;
+		int buses = 1;
+		for (int i = 2; i < argc - 1; i += 2) {
+			int value = atoi(argv[i + 1]);
+			if (value < 1) {
+				printf("Invalid value: %s\n", argv[i + 1]);
+				return EXIT_USAGE;
+			}
+			if (strcmp(argv[i], "--requests") == 0) {
+				requests = value;
+			} else if (strcmp(argv[i], "--depth") == 0) {
+				depth = value;
+			} else if (strcmp(argv[i], "--buses") == 0) {
+				buses = value;
+			}
+		}
+		return run_benchmark(requests, depth, buses, false);
+	}
+	
+	if (argc > 1 && strcmp(argv[1], "emubench") == 0) {
+		// Benchmark against the emulated board in virtual time: emubench [--commands <count>] [--bus <hz>]
+		int commands = 10000;
+		int bus_clock_hz = EMULATOR_BUS_CLOCK_HZ;
+		for (int i = 2; i < argc - 1; i += 2) {
+			int value = atoi(argv[i + 1]);
+			if (value < 1) {
+				printf("Invalid value: %s\n", argv[i + 1]);
+				return EXIT_USAGE;
+			}
+			if (strcmp(argv[i], "--commands") == 0) {
+				commands = value;
+			} else if (strcmp(argv[i], "--bus") == 0) {
+				bus_clock_hz = value;
+			}
+		}
+		return run_emulator_benchmark(commands, bus_clock_hz, false);
+	}
+	
+	if (argc > 1 && strcmp(argv[1], "faultbench") == 0) {
+		// Benchmark the transaction policy under injected faults:
+		// faultbench [--count <transactions>] [--nack <%>] [--hang <%>] [--stuck <%>] [--timeout <ms>]
+		int transactions = BENCH_FAULT_TRANSACTIONS;
+		FaultConfig config = {
+			.nack = 0.02,
+			.hang = 0.005,
+			.stuck = 0.001,
+			.hang_ms = FAULT_HANG_MS,
+			.seed = 1,
+		};
+		I2cPolicy policy = get_transaction_policy();
+		for (int i = 2; i < argc - 1; i += 2) {
+			double value = atof(argv[i + 1]);
+			if (value <= 0) {
+				printf("Invalid value: %s\n", argv[i + 1]);
+				return EXIT_USAGE;
+			}
+			if (strcmp(argv[i], "--count") == 0) {
+				transactions = value;
+			} else if (strcmp(argv[i], "--nack") == 0) {
+				config.nack = value / 100;
+			} else if (strcmp(argv[i], "--hang") == 0) {
+				config.hang = value / 100;
+			} else if (strcmp(argv[i], "--stuck") == 0) {
+				config.stuck = value / 100;
+			} else if (strcmp(argv[i], "--timeout") == 0) {
+				policy.timeout_ms = value;
+			}
+		}
+		// The simulated device doesn't run the commands, a write it received twice is harmless
+		policy.retry_writes = true;
+		return run_fault_benchmark(transactions, &config, &policy, false);
+	}
+	
+	// Options
+	while (arg_index < argc - 1 && argv[arg_index][0] == '-') {
+		if (strcmp(argv[arg_index], "-a") == 0) {
+			char *end;
+			long value = strtol(argv[arg_index + 1], &end, 0);
+			if (*end != '\0' || value < I2C_ADDRESS_MIN || value > I2C_ADDRESS_MAX) {
+				printf("Invalid address: %s\n", argv[arg_index + 1]);
+				return EXIT_USAGE;
+			}
+			address = value;
+		} else if (strcmp(argv[arg_index], "--capture") == 0) {
+			// Record the transactions to a capture file
+			if (!capture_start(argv[arg_index + 1])) {
+				printf("Failed to create capture file: %s\n", argv[arg_index + 1]);
+				return EXIT_USAGE;
+			}
+		} else if (strcmp(argv[arg_index], "--timeout") == 0 || strcmp(argv[arg_index], "--retries") == 0) {
+			// Deadline of a transaction, 0 for none, and retries of a failed write or read
+			char *end;
+			long value = strtol(argv[arg_index + 1], &end, 10);
+			if (*end != '\0' || value < 0) {
+				printf("Invalid value: %s\n", argv[arg_index + 1]);
+				return EXIT_USAGE;
+			}
+			I2cPolicy policy = get_transaction_policy();
+			if (argv[arg_index][2] == 't') {
+				policy.timeout_ms = value;
+			} else {
+				policy.retries = value;
+			}
+			set_transaction_policy(&policy);
+		} else if (strcmp(argv[arg_index], "--shared-timeout") == 0) {
+			// Bound each write and read by setting the timeout of the whole i2c adapter, see i2clib.h
+			I2cPolicy policy = get_transaction_policy();
+			policy.shared_timeout = true;
+			set_transaction_policy(&policy);
+			arg_index++;
+			continue;
+		} else if (strcmp(argv[arg_index], "--emulator") == 0) {
+			// Talk to the emulated board instead of the i2c bus
+			emulated = true;
+			arg_index++;
+			continue;
+		} else {
+			break;
+		}
+		arg_index += 2;
+	}
+	
+	if (emulated) {
+		emulator_reset(address, EMULATOR_BUS_CLOCK_HZ, true);
+		set_transport(&emulator_transport);
+	}
+	
+	if (arg_index >= argc) {
 		printf("Message argument was not provided.\n");
+		print_usage();
+		return EXIT_USAGE;
+	}
+	
+	int status;
+	if (strcmp(argv[arg_index], "batch") == 0) {
+		// Commands from a file or the standard input, one per line
+		FILE *input = stdin;
+		bool sequenced = false;
+		if (arg_index + 1 < argc && strcmp(argv[arg_index + 1], "--seq") == 0) {
+			// Number the commands, lost replies are retried without running a command twice
+			sequenced = true;
+			arg_index++;
+		}
+		if (arg_index + 1 < argc && strcmp(argv[arg_index + 1], "-") != 0) {
+			input = fopen(argv[arg_index + 1], "r");
+			if (input == NULL) {
+				printf("Failed to open file: %s\n", argv[arg_index + 1]);
+				capture_stop();
+				return EXIT_USAGE;
+			}
+		}
+		status = run_batch(input, address, sequenced, false);
+		if (input != stdin) {
+			fclose(input);
+		}
+	} else if (strcmp(argv[arg_index], "job") == 0 && arg_index + 1 < argc) {
+		// Stream a compiled job file
+		Job *job = job_open(argv[arg_index + 1]);
+		if (job == NULL) {
+			printf("Invalid job file: %s\n", argv[arg_index + 1]);
+			capture_stop();
+			return EXIT_USAGE;
+		}
+		status = job_run(job, address, false);
+		job_close(job);
+	} else if (strcmp(argv[arg_index], "watch") == 0) {
+		// Sample the status at a fixed rate, CSV or binary samples to a file or the standard output
+		FILE *output = stdout;
+		int rate_hz = WATCH_RATE_HZ;
+		int count = 0;
+		int format = WATCH_FORMAT_CSV;
+		int i = arg_index + 1;
+		for (; i < argc; i++) {
+			if (strcmp(argv[i], "--binary") == 0) {
+				format = WATCH_FORMAT_BINARY;
+			} else if (i + 1 < argc && (strcmp(argv[i], "--rate") == 0 || strcmp(argv[i], "--count") == 0)) {
+				int value = atoi(argv[i + 1]);
+				if (value < 1) {
+					printf("Invalid value: %s\n", argv[i + 1]);
+					capture_stop();
+					return EXIT_USAGE;
+				}
+				if (argv[i][2] == 'r') {
+					rate_hz = value;
+				} else {
+					count = value;
+				}
+				i++;
+			} else {
+				break;
+			}
+		}
+		if (i < argc && strcmp(argv[i], "-") != 0) {
+			output = fopen(argv[i], format == WATCH_FORMAT_BINARY ? "wb" : "w");
+			if (output == NULL) {
+				printf("Failed to create file: %s\n", argv[i]);
+				capture_stop();
+				return EXIT_USAGE;
+			}
+		}
+		status = run_watch(address, rate_hz, count, format, output, false);
+		if (output != stdout) {
+			fclose(output);
+		}
+	} else {
+		char* result = send_get_data(address, argv[arg_index], false);
+		printf("%s\n",result);
+		status = classify_response(result);
+		if (status == RESPONSE_LIB_ERROR) {
+			fprintf(stderr, "Transaction failed: %s\n", get_transaction_error_text());
+		}
+		free(result);
+	}
+	
+	I2cStats counters = get_transaction_stats();
+	if (counters.retries > 0 || counters.failures > 0) {
+		// Report the bus faults behind retried or failed transactions
+		print_transaction_stats(stderr, &counters);
 	}
 	
-	return 1;
+	capture_stop();
+	return status;
 }
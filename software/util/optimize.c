@@ -0,0 +1,470 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+#include "batch.h"
+#include "optimize.h"
+
+#define DIGEST_OFFSET 0xcbf29ce484222325ULL // FNV-1a 64-bit
+#define DIGEST_PRIME 0x100000001b3ULL
+
+static bool is_delimiter(char c)
+{
+    return c == ':' || c == ';' || c == ',';
+}
+
+static void skip_delimiters(const char **cursor)
+{
+    while (is_delimiter(**cursor))
+    {
+        (*cursor)++;
+    }
+}
+
+/**
+ * Parses a number up to the next delimiter, same rules as the board parser.
+ */
+static bool parse_value(const char **cursor, uint64_t max_value, uint64_t *value)
+{
+    const char *position = *cursor;
+    uint64_t result = 0;
+
+    if (*position < '0' || *position > '9')
+    {
+        return false;
+    }
+    while (*position >= '0' && *position <= '9')
+    {
+        result = result * 10 + (*position - '0');
+        if (result > max_value)
+        {
+            return false;
+        }
+        position++;
+    }
+    if (*position != '\0' && !is_delimiter(*position))
+    {
+        return false;
+    }
+
+    skip_delimiters(&position);
+    *cursor = position;
+    *value = result;
+    return true;
+}
+
+bool parse_run_segment(const char *command, RunSegment *segment)
+{
+    if (strncmp(command, "run", 3) != 0 || (command[3] != '\0' && !is_delimiter(command[3])))
+    {
+        return false;
+    }
+
+    const char *cursor = command + 3;
+    skip_delimiters(&cursor);
+    memset(segment, 0, sizeof(RunSegment));
+
+    while (*cursor != '\0')
+    {
+        int device_id = (*cursor | 0x20) - 'a';
+        if (device_id < 0 || device_id >= OPTIMIZE_DEVICES)
+        {
+            return false;
+        }
+        cursor++;
+
+        uint8_t dir = *cursor == '-' ? 0 : 1;
+        if (*cursor == '-' || *cursor == '+')
+        {
+            cursor++;
+        }
+
+        uint64_t steps;
+        uint64_t speed;
+        if (!parse_value(&cursor, OPTIMIZE_MAX_STEPS, &steps) || !parse_value(&cursor, 0xFFFF, &speed))
+        {
+            return false;
+        }
+
+        uint8_t device_mask = 1 << device_id;
+        segment->steps[device_id] = steps;
+        segment->speeds[device_id] = speed;
+        segment->dirs = dir ? segment->dirs | device_mask : segment->dirs & ~device_mask;
+        segment->mask = steps > 0 ? segment->mask | device_mask : segment->mask & ~device_mask;
+    }
+    // Directions of devices without steps have no effect
+    segment->dirs &= segment->mask;
+
+    return true;
+}
+
+void format_run_segment(const RunSegment *segment, char *command)
+{
+    int length = sprintf(command, "run");
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        if (segment->mask & (1 << device_id))
+        {
+            length += sprintf(command + length, ":%c%s%u,%u", 'A' + device_id,
+                              segment->dirs & (1 << device_id) ? "" : "-",
+                              segment->steps[device_id], segment->speeds[device_id]);
+        }
+    }
+}
+
+/**
+ * Checks that every device of the run command finishes at the same tick. A device toggles its step pin every
+ * speed ticks, at least every tick, and steps when the pin goes low, so a pin starting high takes one toggle less.
+ * Several devices are only synchronized when the start level of every pin is known to be low.
+ */
+static bool is_synchronized(const RunSegment *segment, uint8_t low_mask)
+{
+    if ((segment->mask & (segment->mask - 1)) == 0)
+    {
+        // One device
+        return true;
+    }
+    if ((segment->mask & ~low_mask) != 0)
+    {
+        return false;
+    }
+
+    uint64_t duration = 0;
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        if (segment->mask & (1 << device_id))
+        {
+            uint16_t interval = segment->speeds[device_id] > 0 ? segment->speeds[device_id] : 1;
+            uint64_t device_duration = (uint64_t)segment->steps[device_id] * interval;
+            if (duration != 0 && device_duration != duration)
+            {
+                return false;
+            }
+            duration = device_duration;
+        }
+    }
+    return true;
+}
+
+/**
+ * Checks that the next run command continues every device of the pending one, so both can run as one command.
+ * The pending command leaves the step pins of its devices low, where the next one starts.
+ */
+static bool can_merge(const Optimizer *optimizer, const RunSegment *next)
+{
+    const RunSegment *first = &optimizer->pending;
+    if (first->mask != next->mask || first->dirs != next->dirs)
+    {
+        return false;
+    }
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        if ((first->mask & (1 << device_id)) &&
+            (first->speeds[device_id] != next->speeds[device_id] ||
+             (uint64_t)first->steps[device_id] + next->steps[device_id] > OPTIMIZE_MAX_STEPS))
+        {
+            return false;
+        }
+    }
+    return is_synchronized(first, optimizer->pending_low_mask) && is_synchronized(next, first->mask);
+}
+
+static uint64_t digest_value(uint64_t digest, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        digest ^= (value >> (i * 8)) & 0xFF;
+        digest *= DIGEST_PRIME;
+    }
+    return digest;
+}
+
+/**
+ * Folds the current run of same direction and speed steps into the digest.
+ */
+static void trace_finish_run(StepTrace *trace)
+{
+    if (trace->steps > 0)
+    {
+        trace->digest = digest_value(trace->digest, trace->dir);
+        trace->digest = digest_value(trace->digest, trace->speed);
+        trace->digest = digest_value(trace->digest, trace->steps);
+        trace->steps = 0;
+    }
+}
+
+static void trace_segment(StepTrace *traces, const RunSegment *segment)
+{
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        if (segment->mask & (1 << device_id))
+        {
+            StepTrace *trace = &traces[device_id];
+            uint8_t dir = (segment->dirs >> device_id) & 1;
+            if (trace->dir != dir || trace->speed != segment->speeds[device_id])
+            {
+                trace_finish_run(trace);
+                trace->dir = dir;
+                trace->speed = segment->speeds[device_id];
+            }
+            trace->steps += segment->steps[device_id];
+        }
+    }
+}
+
+/**
+ * Checks for a run command, after the sequence number prefix if there is one.
+ */
+static bool is_run_command(const char *command)
+{
+    if (*command == SEQUENCE_PREFIX)
+    {
+        command = strchr(command, ':');
+        if (command == NULL)
+        {
+            return false;
+        }
+        command++;
+    }
+    return strncmp(command, "run:", 4) == 0;
+}
+
+void frame_clear(CommandFrame *frame)
+{
+    frame->length = 0;
+    frame->commands = 0;
+    frame->is_run = false;
+}
+
+bool frame_add(CommandFrame *frame, const char *command)
+{
+    int length = strlen(command) + 1;
+    bool is_run = is_run_command(command);
+
+    if (frame->length + length > MAX_BUFFER_SIZE ||
+        (frame->commands > 0 && (!is_run || !frame->is_run || frame->commands == MULTI_COMMAND_MAX)))
+    {
+        return false;
+    }
+    memcpy(frame->data + frame->length, command, length);
+    frame->length += length;
+    frame->commands++;
+    frame->is_run = is_run;
+    return true;
+}
+
+/**
+ * Counts a command in the frame it is sent with.
+ */
+static void count_frame(FrameCount *count, CommandFrame *frame, const char *command)
+{
+    count->commands++;
+    count->bytes += strlen(command) + 1;
+    if (!frame_add(frame, command))
+    {
+        count->frames++;
+        frame_clear(frame);
+        frame_add(frame, command);
+    }
+}
+
+void optimizer_init(Optimizer *optimizer)
+{
+    memset(optimizer, 0, sizeof(Optimizer));
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        optimizer->input_traces[device_id].digest = DIGEST_OFFSET;
+        optimizer->output_traces[device_id].digest = DIGEST_OFFSET;
+    }
+}
+
+/**
+ * Packs a command in the output frame, a full frame is written to the output first.
+ */
+static void emit_command(Optimizer *optimizer, const char *command, CommandFrame *output, int *count)
+{
+    optimizer->output.commands++;
+    optimizer->output.bytes += strlen(command) + 1;
+    if (!frame_add(&optimizer->frame, command))
+    {
+        optimizer->output.frames++;
+        output[(*count)++] = optimizer->frame;
+        frame_clear(&optimizer->frame);
+        frame_add(&optimizer->frame, command);
+    }
+}
+
+/**
+ * Emits the pending run command.
+ */
+static void emit_pending(Optimizer *optimizer, CommandFrame *output, int *count)
+{
+    if (!optimizer->has_pending)
+    {
+        return;
+    }
+
+    char command[MAX_BUFFER_SIZE];
+    RunSegment emitted;
+    format_run_segment(&optimizer->pending, command);
+    // Traced from the text that is sent
+    parse_run_segment(command, &emitted);
+    trace_segment(optimizer->output_traces, &emitted);
+    emit_command(optimizer, command, output, count);
+    optimizer->has_pending = false;
+}
+
+int optimizer_flush(Optimizer *optimizer, CommandFrame *output)
+{
+    int count = 0;
+    emit_pending(optimizer, output, &count);
+    if (optimizer->frame.commands > 0)
+    {
+        optimizer->output.frames++;
+        output[count++] = optimizer->frame;
+        frame_clear(&optimizer->frame);
+    }
+    return count;
+}
+
+int optimizer_add(Optimizer *optimizer, const char *command, CommandFrame *output)
+{
+    RunSegment segment;
+    int count = 0;
+
+    count_frame(&optimizer->input, &optimizer->input_frame, command);
+    if (!parse_run_segment(command, &segment))
+    {
+        // Not a run command, or rejected by the board, sent unchanged after the pending run command.
+        // The levels of the step pins are not known after it.
+        emit_pending(optimizer, output, &count);
+        emit_command(optimizer, command, output, &count);
+        optimizer->low_mask = 0;
+        return count;
+    }
+
+    trace_segment(optimizer->input_traces, &segment);
+    if (segment.mask == 0)
+    {
+        // Accepted by the board without queueing anything
+        optimizer->dropped++;
+        return 0;
+    }
+
+    if (optimizer->has_pending && can_merge(optimizer, &segment))
+    {
+        for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+        {
+            optimizer->pending.steps[device_id] += segment.steps[device_id];
+        }
+        optimizer->merged++;
+        return 0;
+    }
+
+    emit_pending(optimizer, output, &count);
+    optimizer->pending = segment;
+    optimizer->has_pending = true;
+    // Every device of a run command ends with its step pin low
+    optimizer->pending_low_mask = optimizer->low_mask;
+    optimizer->low_mask |= segment.mask;
+    return count;
+}
+
+bool optimizer_verify(Optimizer *optimizer)
+{
+    for (int device_id = 0; device_id < OPTIMIZE_DEVICES; device_id++)
+    {
+        trace_finish_run(&optimizer->input_traces[device_id]);
+        trace_finish_run(&optimizer->output_traces[device_id]);
+        if (optimizer->input_traces[device_id].digest != optimizer->output_traces[device_id].digest)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void optimizer_print_report(FILE *out, Optimizer *optimizer)
+{
+    if (optimizer->input_frame.commands > 0)
+    {
+        optimizer->input.frames++;
+        frame_clear(&optimizer->input_frame);
+    }
+
+    FrameCount *input = &optimizer->input;
+    FrameCount *output = &optimizer->output;
+    fprintf(out, "Commands: %d -> %d, merged: %d, dropped: %d\n",
+            input->commands, output->commands, optimizer->merged, optimizer->dropped);
+    fprintf(out, "Bytes: %d -> %d, saved %d\n", input->bytes, output->bytes, input->bytes - output->bytes);
+    fprintf(out, "Transactions: %d -> %d, saved %d\n", input->frames, output->frames, input->frames - output->frames);
+}
+
+/**
+ * Writes the commands of a frame on one line, separated by spaces.
+ */
+static void print_frame(FILE *output, const CommandFrame *frame)
+{
+    for (int offset = 0; offset < frame->length; offset += strlen(frame->data + offset) + 1)
+    {
+        fprintf(output, offset > 0 ? " %s" : "%s", frame->data + offset);
+    }
+    fprintf(output, "\n");
+}
+
+int run_optimize(FILE *input, FILE *output)
+{
+    char line[MAX_BUFFER_SIZE + 2];
+    CommandFrame frames[OPTIMIZE_OUTPUT_MAX];
+    Optimizer optimizer;
+
+    optimizer_init(&optimizer);
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        if (strchr(line, '\n') == NULL && !feof(input))
+        {
+            // Skip the rest of a line longer than the device buffer
+            int c;
+            while ((c = fgetc(input)) != '\n' && c != EOF)
+            {
+            }
+            fprintf(stderr, "Command too long, skipped\n");
+            continue;
+        }
+
+        char *command = trim_line(line);
+        if (command[0] == '#')
+        {
+            continue;
+        }
+
+        char *context;
+        for (command = strtok_r(command, " \t", &context); command != NULL; command = strtok_r(NULL, " \t", &context))
+        {
+            int count = optimizer_add(&optimizer, command, frames);
+            for (int i = 0; i < count; i++)
+            {
+                print_frame(output, &frames[i]);
+            }
+        }
+    }
+    int count = optimizer_flush(&optimizer, frames);
+    for (int i = 0; i < count; i++)
+    {
+        print_frame(output, &frames[i]);
+    }
+
+    bool is_verified = optimizer_verify(&optimizer);
+    optimizer_print_report(stderr, &optimizer);
+    fprintf(stderr, "Step sequence: %s\n", is_verified ? "identical" : "MISMATCH");
+
+    return is_verified ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef OPTIMIZE_H_
+#define OPTIMIZE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+
+#define OPTIMIZE_DEVICES 4 // Devices of the board, A to D
+#define OPTIMIZE_MAX_STEPS 0xFFFFFFFFUL // Largest steps value of one device in a run command
+#define OPTIMIZE_OUTPUT_MAX 2 // Frames returned by one optimizer_add() or optimizer_flush() call
+
+// Values of a run command, devices without steps are not in the mask
+typedef struct
+{
+    uint8_t mask;
+    uint8_t dirs; // Direction bit per device, 1 - clockwise
+    uint32_t steps[OPTIMIZE_DEVICES];
+    uint16_t speeds[OPTIMIZE_DEVICES];
+} RunSegment;
+
+// Run length encoded step sequence of one device, reduced to a digest
+typedef struct
+{
+    uint8_t dir;
+    uint16_t speed;
+    uint64_t steps;
+    uint64_t digest;
+} StepTrace;
+
+// Null terminated commands of one write. Consecutive run commands share a frame while they fit the board
+// buffer, up to MULTI_COMMAND_MAX commands, any other command is sent alone.
+typedef struct
+{
+    char data[MAX_BUFFER_SIZE];
+    int length;
+    int commands;
+    bool is_run;
+} CommandFrame;
+
+// Commands, bytes and transactions needed to send a command list
+typedef struct
+{
+    int commands;
+    int bytes;
+    int frames;
+} FrameCount;
+
+typedef struct
+{
+    RunSegment pending; // Run command being merged, not emitted yet
+    bool has_pending;
+    uint8_t pending_low_mask; // Devices with the step pin low when the pending command starts
+    uint8_t low_mask; // Devices with the step pin low after the pending command
+    int merged;
+    int dropped;
+    FrameCount input;
+    FrameCount output;
+    CommandFrame input_frame; // Frame the added command would be sent in, only counted
+    CommandFrame frame; // Frame being packed with the emitted commands
+    StepTrace input_traces[OPTIMIZE_DEVICES];
+    StepTrace output_traces[OPTIMIZE_DEVICES];
+} Optimizer;
+
+/**
+ * function: parse_run_segment()
+ * 
+ * Parses a run command like the board does, a later value of the same device overrides the earlier one.
+ * Returns false if the command is not a valid run command.
+ * @parameter command - the command text
+ * @parameter segment - the parsed values
+ * 
+ */
+extern bool parse_run_segment(const char *command, RunSegment *segment);
+
+/**
+ * function: format_run_segment()
+ * 
+ * Writes the shortest run command text for the values, the '+' direction is omitted.
+ * @parameter segment - run command values
+ * @parameter command - buffer of MAX_BUFFER_SIZE bytes
+ * 
+ */
+extern void format_run_segment(const RunSegment *segment, char *command);
+
+/**
+ * function: frame_clear()
+ * 
+ * Empties the frame.
+ * @parameter frame - command frame
+ * 
+ */
+extern void frame_clear(CommandFrame *frame);
+
+/**
+ * function: frame_add()
+ * 
+ * Appends a command to the frame. Run commands, also with a sequence number, are packed together while
+ * they fit MAX_BUFFER_SIZE bytes and MULTI_COMMAND_MAX commands, any other command needs an empty frame.
+ * Returns false if the command doesn't fit, the frame is then sent and cleared before adding it again.
+ * An empty frame takes any command shorter than MAX_BUFFER_SIZE.
+ * @parameter frame - command frame
+ * @parameter command - the command text, without line ending
+ * 
+ */
+extern bool frame_add(CommandFrame *frame, const char *command);
+
+/**
+ * function: optimizer_init()
+ * 
+ * Starts an empty command list.
+ * @parameter optimizer - optimizer state
+ * 
+ */
+extern void optimizer_init(Optimizer *optimizer);
+
+/**
+ * function: optimizer_add()
+ * 
+ * Adds the next command of the list. Run commands without steps are dropped, consecutive run commands
+ * with the same devices, directions and speeds are merged while the devices of both commands finish at the same
+ * tick and the steps fit 32 bits, so the step sequence and timing of every device is kept. A device takes one
+ * more step pin toggle for its first step when the pin starts high, so commands are only merged when the
+ * finishing tick is known from the steps before them. Other commands end the merge and are passed through
+ * unchanged. The emitted commands are packed in frames with frame_add().
+ * Returns the number of frames ready to be sent, written to the output.
+ * @parameter optimizer - optimizer state
+ * @parameter command - the command text, without line ending
+ * @parameter output - OPTIMIZE_OUTPUT_MAX frames
+ * 
+ */
+extern int optimizer_add(Optimizer *optimizer, const char *command, CommandFrame *output);
+
+/**
+ * function: optimizer_flush()
+ * 
+ * Ends the command list, emits the pending run command and the last frame.
+ * Returns the number of frames written to the output.
+ * @parameter optimizer - optimizer state
+ * @parameter output - OPTIMIZE_OUTPUT_MAX frames
+ * 
+ */
+extern int optimizer_flush(Optimizer *optimizer, CommandFrame *output);
+
+/**
+ * function: optimizer_verify()
+ * 
+ * Compares the step sequence of every device in the added and emitted commands, call after optimizer_flush().
+ * Returns true if they are identical.
+ * @parameter optimizer - optimizer state
+ * 
+ */
+extern bool optimizer_verify(Optimizer *optimizer);
+
+/**
+ * function: optimizer_print_report()
+ * 
+ * Prints the commands, bytes and transactions before and after the optimization.
+ * @parameter out - output stream
+ * @parameter optimizer - optimizer state, after optimizer_flush()
+ * 
+ */
+extern void optimizer_print_report(FILE *out, Optimizer *optimizer);
+
+/**
+ * function: run_optimize()
+ * 
+ * Reads the commands, one per line or several separated by spaces, writes the optimized command list
+ * with the commands of one frame per line, separated by spaces, and prints the report to stderr.
+ * Empty lines and lines starting with '#' are skipped.
+ * Returns 0 if the step sequences were verified identical, 1 otherwise.
+ * @parameter input - stream with the commands
+ * @parameter output - stream for the optimized commands
+ * 
+ */
+extern int run_optimize(FILE *input, FILE *output);
+
+#endif /* OPTIMIZE_H_ */
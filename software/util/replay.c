@@ -0,0 +1,151 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "i2clib.h"
+#include "capture.h"
+#include "stats.h"
+#include "replay.h"
+
+// Simulated device answering with the entry currently replayed
+static const CaptureEntry *playback_entry = NULL;
+static bool playback_delay = false;
+
+static void sleep_ns(uint64_t duration_ns)
+{
+    struct timespec duration = {
+        .tv_sec = duration_ns / 1000000000ULL,
+        .tv_nsec = duration_ns % 1000000000ULL,
+    };
+    nanosleep(&duration, NULL);
+}
+
+static int playback_open(uint8_t address, bool verbose)
+{
+    return 0;
+}
+
+static int playback_write(int handle, const char *data, int length)
+{
+    if (playback_delay)
+    {
+        sleep_ns(playback_entry->record.latency_ns);
+    }
+    return length;
+}
+
+static int playback_read(int handle, char *data, int length)
+{
+    if (playback_entry->record.status != CAPTURE_STATUS_OK)
+    {
+        return -1;
+    }
+    memset(data, '\0', length);
+    strncpy(data, playback_entry->response, length - 1);
+    return length;
+}
+
+static void playback_close(int handle)
+{
+}
+
+static const I2cTransport playback_transport = {
+    .name = "capture playback",
+    .open = playback_open,
+    .write = playback_write,
+    .read = playback_read,
+    .close = playback_close,
+};
+
+int replay_capture(const char *path, bool fast, bool simulated, bool verbose)
+{
+    FILE *file = capture_open(path);
+    if (file == NULL)
+    {
+        printf("Invalid capture file: %s\n", path);
+        return 1;
+    }
+
+    CaptureEntry entry;
+    LatencyStats stats;
+    int mismatches = 0;
+    int errors = 0;
+    int result;
+
+    stats_init(&stats);
+    if (simulated)
+    {
+        // The captured responses are the outcome of the retries, the playback isn't retried
+        const I2cPolicy playback_policy = {
+            .timeout_ms = 0,
+            .retries = 0,
+            .backoff_us = 0,
+            .recover = false,
+        };
+        playback_entry = &entry;
+        playback_delay = !fast;
+        set_transaction_policy(&playback_policy);
+        set_transport(&playback_transport);
+    }
+
+    uint64_t replay_start_ns = monotonic_ns();
+    while ((result = capture_read(file, &entry)) > 0)
+    {
+        if (!fast)
+        {
+            // Keep the captured timing between requests
+            uint64_t elapsed_ns = monotonic_ns() - replay_start_ns;
+            if (entry.record.timestamp_ns > elapsed_ns)
+            {
+                sleep_ns(entry.record.timestamp_ns - elapsed_ns);
+            }
+        }
+
+        uint64_t start_ns = monotonic_ns();
+        char *response = send_get_data(entry.record.address, entry.request, verbose);
+        stats_add(&stats, monotonic_ns() - start_ns);
+
+        const char *expected = entry.record.status == CAPTURE_STATUS_OK ? entry.response : LIB_ERROR_MSG;
+        if (strcmp(response, LIB_ERROR_MSG) == 0)
+        {
+            errors++;
+        }
+        if (strcmp(response, expected) != 0)
+        {
+            mismatches++;
+            if (verbose)
+            {
+                printf("Mismatch for %s: expected %s, got %s\n", entry.request, expected, response);
+            }
+        }
+        free(response);
+    }
+    uint64_t elapsed_ns = monotonic_ns() - replay_start_ns;
+
+    if (simulated)
+    {
+        set_transport(NULL);
+        set_transaction_policy(NULL);
+        playback_entry = NULL;
+    }
+    fclose(file);
+
+    if (result < 0)
+    {
+        printf("Capture file is truncated: %s\n", path);
+    }
+    stats_print(stdout, &stats, "Replay", elapsed_ns);
+    printf("Errors: %d, mismatched responses: %d\n", errors, mismatches);
+    stats_free(&stats);
+
+    return result < 0 || mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+/**
+ * function: replay_capture()
+ * 
+ * Sends every request of a capture file again and prints the latency distribution and
+ * the number of responses that differ from the captured ones.
+ * Returns 0 if every request was replayed with the captured response, 1 otherwise.
+ * @parameter path - capture file path
+ * @parameter fast - send requests back to back instead of the captured timing
+ * @parameter simulated - answer with the captured responses and latencies instead of the active transport
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int replay_capture(const char *path, bool fast, bool simulated, bool verbose);
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+
+uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t process_cpu_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_init(LatencyStats *stats)
+{
+    stats->samples = NULL;
+    stats->count = 0;
+    stats->capacity = 0;
+}
+
+void stats_add(LatencyStats *stats, uint64_t latency_ns)
+{
+    if (stats->count == stats->capacity)
+    {
+        size_t capacity = stats->capacity > 0 ? stats->capacity * 2 : 256;
+        uint64_t *samples = realloc(stats->samples, capacity * sizeof(uint64_t));
+        if (samples == NULL)
+        {
+            return;
+        }
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->count++] = latency_ns;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t value_a = *(const uint64_t *)a;
+    uint64_t value_b = *(const uint64_t *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+uint64_t stats_percentile(LatencyStats *stats, double percentile)
+{
+    if (stats->count == 0)
+    {
+        return 0;
+    }
+
+    qsort(stats->samples, stats->count, sizeof(uint64_t), compare_samples);
+    size_t index = (size_t)(percentile / 100.0 * (stats->count - 1) + 0.5);
+    return stats->samples[index < stats->count ? index : stats->count - 1];
+}
+
+void stats_print(FILE *out, LatencyStats *stats, const char *title, uint64_t elapsed_ns)
+{
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < stats->count; i++)
+    {
+        total_ns += stats->samples[i];
+    }
+
+    fprintf(out, "%s: %zu requests in %.3f s", title, stats->count, elapsed_ns / 1e9);
+    if (elapsed_ns > 0)
+    {
+        fprintf(out, ", %.1f requests/s", stats->count * 1e9 / elapsed_ns);
+    }
+    fprintf(out, "\n");
+
+    if (stats->count > 0)
+    {
+        fprintf(out, "Latency us: min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+               stats_percentile(stats, 0) / 1e3,
+               total_ns / 1e3 / stats->count,
+               stats_percentile(stats, 50) / 1e3,
+               stats_percentile(stats, 90) / 1e3,
+               stats_percentile(stats, 99) / 1e3,
+               stats_percentile(stats, 100) / 1e3);
+    }
+}
+
+void stats_free(LatencyStats *stats)
+{
+    free(stats->samples);
+    stats_init(stats);
+}
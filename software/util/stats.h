@@ -0,0 +1,89 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t *samples; // Latency samples in nanoseconds
+    size_t count;
+    size_t capacity;
+} LatencyStats;
+
+/**
+ * function: monotonic_ns()
+ * 
+ * Returns the monotonic clock time in nanoseconds.
+ * 
+ */
+extern uint64_t monotonic_ns();
+
+/**
+ * function: process_cpu_ns()
+ * 
+ * Returns the CPU time used by the process in nanoseconds.
+ * 
+ */
+extern uint64_t process_cpu_ns();
+
+/**
+ * function: stats_init()
+ * 
+ * Initializes an empty set of latency samples.
+ * @parameter stats - latency samples
+ * 
+ */
+extern void stats_init(LatencyStats *stats);
+
+/**
+ * function: stats_add()
+ * 
+ * Adds a latency sample.
+ * @parameter stats - latency samples
+ * @parameter latency_ns - latency in nanoseconds
+ * 
+ */
+extern void stats_add(LatencyStats *stats, uint64_t latency_ns);
+
+/**
+ * function: stats_percentile()
+ * 
+ * Returns the latency at the given percentile, sorting the samples. Returns 0 if there are no samples.
+ * @parameter stats - latency samples
+ * @parameter percentile - percentile between 0 and 100
+ * 
+ */
+extern uint64_t stats_percentile(LatencyStats *stats, double percentile);
+
+/**
+ * function: stats_print()
+ * 
+ * Prints the sample count, throughput and latency distribution in microseconds.
+ * @parameter out - output stream
+ * @parameter stats - latency samples
+ * @parameter title - title of the report
+ * @parameter elapsed_ns - total time used to compute the throughput
+ * 
+ */
+extern void stats_print(FILE *out, LatencyStats *stats, const char *title, uint64_t elapsed_ns);
+
+/**
+ * function: stats_free()
+ * 
+ * Releases the latency samples.
+ * @parameter stats - latency samples
+ * 
+ */
+extern void stats_free(LatencyStats *stats);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,307 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+*
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+// Runs command lists and their optimized frames on the emulated board and compares the tick and direction
+// of every step. Usage: test_optimize [<random lists> [<seed>]]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2clib.h"
+#include "emulator.h"
+#include "optimize.h"
+
+#define TEST_ADDRESS 0x50
+#define TEST_BUS_CLOCK_HZ 4000000000U // Transactions take a fraction of a tick, the queue doesn't run empty
+#define TEST_TICK_NS (1000000000ULL / EMULATOR_TICK_RATE)
+#define TEST_RANDOM_LISTS 200
+#define TEST_RANDOM_COMMANDS 300
+
+typedef struct
+{
+    uint64_t *steps; // Tick of the step shifted left by one, the low bit is set for clockwise steps
+    size_t count;
+    size_t capacity;
+} DeviceTrace;
+
+typedef struct
+{
+    DeviceTrace devices[EMULATOR_DEVICES];
+} Trace;
+
+static const char *fixed_lists[][2] = {
+    {"first step pin high", "run:A1,1\nrun:A5,2:B5,2\nrun:A5,2:B5,2\nrun:A5,2:B5,2\n"},
+    {"one device", "run:A3,2\nrun:A4,2\nrun:A0,2\nrun:A-2,2\nrun:A-2,2\nrun:A2,3\n"},
+    {"synchronized devices", "run:A2,1:B2,1\nrun:A2,1:B2,1\nrun:A4,2:B8,1\nrun:A4,2:B8,1\nrun:A4,2:B8,1\n"},
+    {"not synchronized", "run:A2,1:B2,1\nrun:A3,2:B3,1\nrun:A3,2:B3,1\n"},
+    {"speed zero", "run:A4,0:B4,1\nrun:A4,0:B4,1\nrun:A4,0:B4,1\n"},
+    {"other commands", "run:A2,1:B2,1\nstatus\nrun:A2,1:B2,1\nrun:A2,1:B2,1\nversion\nrun:E3,1\nrun:A3,1\n"},
+    {"full frames", "run:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\n"
+                    "run:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\n"
+                    "run:A1,1\nrun:B1,1\nrun:A1,1\nrun:B1,1\n"},
+};
+
+static unsigned int random_state = 1;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 8) & 0xFFFFFF;
+}
+
+static void record_step(uint64_t tick, int device_id, bool is_clockwise, void *context)
+{
+    DeviceTrace *trace = &((Trace *)context)->devices[device_id];
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = trace->capacity > 0 ? trace->capacity * 2 : 1024;
+        trace->steps = realloc(trace->steps, trace->capacity * sizeof(uint64_t));
+        if (trace->steps == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+    trace->steps[trace->count++] = tick << 1 | (is_clockwise ? 1 : 0);
+}
+
+static void free_trace(Trace *trace)
+{
+    for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+    {
+        free(trace->devices[device_id].steps);
+    }
+    memset(trace, 0, sizeof(Trace));
+}
+
+/**
+ * Sends the frames to a freshly reset emulated board, resending the commands rejected as buffer full
+ * a tick later, and runs the board until its queue is empty.
+ */
+static void run_frames(const CommandFrame *frames, int count, Trace *trace)
+{
+    char response[MAX_BUFFER_SIZE];
+    char codes[MULTI_COMMAND_MAX];
+
+    memset(trace, 0, sizeof(Trace));
+    emulator_reset(TEST_ADDRESS, TEST_BUS_CLOCK_HZ, false);
+    emulator_set_trace(record_step, trace);
+    int handle = open_device(TEST_ADDRESS, false);
+
+    for (int i = 0; i < count; i++)
+    {
+        const char *data = frames[i].data;
+        int length = frames[i].length;
+        int commands = frames[i].commands;
+        while (commands > 0)
+        {
+            transfer_frame(handle, TEST_ADDRESS, data, length, response, false);
+            if (commands == 1)
+            {
+                codes[0] = strcmp(response, RESPONSE_BUFFER_FULL) == 0 ? COMMAND_STATUS_BUFFER_FULL : COMMAND_STATUS_OK;
+            }
+            else if (parse_multi_response(response, codes) != commands)
+            {
+                break;
+            }
+
+            int accepted = 0;
+            while (accepted < commands && codes[accepted] != COMMAND_STATUS_BUFFER_FULL)
+            {
+                const char *next = memchr(data, '\0', length) + 1;
+                length -= next - data;
+                data = next;
+                accepted++;
+            }
+            commands -= accepted;
+            if (commands > 0)
+            {
+                emulator_advance(TEST_TICK_NS);
+            }
+        }
+    }
+    while (!emulator_is_idle())
+    {
+        emulator_advance(TEST_TICK_NS);
+    }
+
+    emulator_set_trace(NULL, NULL);
+    close_device(handle);
+}
+
+/**
+ * Checks that the frames fit one write of the board and other commands are sent alone.
+ */
+static bool is_valid_frame(const CommandFrame *frame)
+{
+    if (frame->commands < 1 || frame->commands > MULTI_COMMAND_MAX || frame->length > MAX_BUFFER_SIZE)
+    {
+        return false;
+    }
+    int commands = 0;
+    for (int offset = 0; offset < frame->length; offset += strlen(frame->data + offset) + 1)
+    {
+        if (frame->commands > 1 && strncmp(frame->data + offset, "run:", 4) != 0)
+        {
+            return false;
+        }
+        commands++;
+    }
+    return commands == frame->commands && frame->data[frame->length - 1] == '\0';
+}
+
+/**
+ * Optimizes the command list, runs the commands one per write and the optimized frames on the emulated board
+ * and compares the steps of every device. Returns true if the steps are identical.
+ */
+static bool test_list(const char *name, const char *list)
+{
+    size_t size = strlen(list) / 2 + 1; // Commands have a line ending, at least one character each
+    CommandFrame *input = malloc(size * sizeof(CommandFrame));
+    CommandFrame *output = malloc((size + OPTIMIZE_OUTPUT_MAX) * sizeof(CommandFrame));
+    Optimizer optimizer;
+    Trace input_trace;
+    Trace output_trace;
+    int inputs = 0;
+    int outputs = 0;
+    bool is_passed = true;
+
+    optimizer_init(&optimizer);
+    const char *line = list;
+    while (*line != '\0')
+    {
+        char command[MAX_BUFFER_SIZE];
+        int length = strcspn(line, "\n");
+        memcpy(command, line, length);
+        command[length] = '\0';
+        line += length + (line[length] == '\n' ? 1 : 0);
+
+        frame_clear(&input[inputs]);
+        frame_add(&input[inputs++], command);
+        outputs += optimizer_add(&optimizer, command, output + outputs);
+    }
+    outputs += optimizer_flush(&optimizer, output + outputs);
+
+    for (int i = 0; i < outputs; i++)
+    {
+        if (!is_valid_frame(&output[i]))
+        {
+            printf("FAIL %s: frame %d doesn't fit one write\n", name, i);
+            is_passed = false;
+        }
+    }
+    if (!optimizer_verify(&optimizer))
+    {
+        printf("FAIL %s: optimizer step sequence mismatch\n", name);
+        is_passed = false;
+    }
+
+    run_frames(input, inputs, &input_trace);
+    run_frames(output, outputs, &output_trace);
+    for (int device_id = 0; device_id < EMULATOR_DEVICES && is_passed; device_id++)
+    {
+        DeviceTrace *expected = &input_trace.devices[device_id];
+        DeviceTrace *actual = &output_trace.devices[device_id];
+        size_t count = expected->count < actual->count ? expected->count : actual->count;
+        size_t i = 0;
+        while (i < count && expected->steps[i] == actual->steps[i])
+        {
+            i++;
+        }
+        if (i < count || expected->count != actual->count)
+        {
+            printf("FAIL %s: device %c step %zu of %zu", name, 'A' + device_id, i, expected->count);
+            if (i < count)
+            {
+                printf(", tick %llu instead of %llu", (unsigned long long)(actual->steps[i] >> 1),
+                       (unsigned long long)(expected->steps[i] >> 1));
+            }
+            printf(", %zu steps after optimizing\n", actual->count);
+            is_passed = false;
+        }
+    }
+    if (is_passed)
+    {
+        printf("PASS %s: %d commands -> %d commands in %d transactions\n", name, inputs, optimizer.output.commands, outputs);
+    }
+
+    free_trace(&input_trace);
+    free_trace(&output_trace);
+    free(input);
+    free(output);
+    return is_passed;
+}
+
+/**
+ * Appends a random run command, often repeating the previous one or with synchronized devices so it can merge.
+ */
+static int append_random_command(char *list, int length, char *previous)
+{
+    char command[MAX_BUFFER_SIZE];
+    unsigned int choice = next_random() % 16;
+
+    if (choice < 6 && previous[0] != '\0')
+    {
+        strcpy(command, previous);
+    }
+    else if (choice == 6)
+    {
+        strcpy(command, next_random() % 2 ? "status" : "run:A0,1:C0,3");
+    }
+    else
+    {
+        // Devices with intervals of 1, 2 or 4 ticks, running the same duration when synchronized
+        bool is_synchronized = next_random() % 2;
+        unsigned int duration = 4 * (1 + next_random() % 5);
+        int command_length = sprintf(command, "run");
+        for (int device_id = 0; device_id < EMULATOR_DEVICES; device_id++)
+        {
+            if (next_random() % 2)
+            {
+                unsigned int speed = 1 << (next_random() % 3);
+                unsigned int steps = is_synchronized ? duration / speed : next_random() % 12;
+                command_length += sprintf(command + command_length, ":%c%s%u,%u", 'A' + device_id,
+                                          next_random() % 4 == 0 ? "-" : "", steps, speed);
+            }
+        }
+    }
+    strcpy(previous, strcmp(command, "status") == 0 ? "" : command);
+    return length + sprintf(list + length, "%s\n", command);
+}
+
+int main(int argc, char **argv)
+{
+    int lists = argc > 1 ? atoi(argv[1]) : TEST_RANDOM_LISTS;
+    random_state = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    char *list = malloc(TEST_RANDOM_COMMANDS * MAX_BUFFER_SIZE);
+    char previous[MAX_BUFFER_SIZE];
+    int failed = 0;
+
+    set_transport(&emulator_transport);
+    for (size_t i = 0; i < sizeof(fixed_lists) / sizeof(fixed_lists[0]); i++)
+    {
+        failed += test_list(fixed_lists[i][0], fixed_lists[i][1]) ? 0 : 1;
+    }
+    for (int i = 0; i < lists; i++)
+    {
+        char name[32];
+        int length = 0;
+        previous[0] = '\0';
+        for (int command = 0; command < TEST_RANDOM_COMMANDS; command++)
+        {
+            length = append_random_command(list, length, previous);
+        }
+        sprintf(name, "random list %d", i + 1);
+        failed += test_list(name, list) ? 0 : 1;
+    }
+
+    free(list);
+    printf("%d failed\n", failed);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include "i2clib.h"
+#include "stats.h"
+#include "watch.h"
+
+#define WATCH_COMMAND "status"
+
+static volatile sig_atomic_t is_interrupted = 0;
+
+static void handle_interrupt(int signal)
+{
+    is_interrupted = 1;
+}
+
+static bool starts_with(const char *line, const char *prefix)
+{
+    return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+static void parse_device(const char *line, WatchRecord *record)
+{
+    int device_id = line[0] - 'A';
+    const char *cursor = line + 2;
+    uint8_t device_mask = 1 << device_id;
+
+    record->dirs = *cursor == '-' ? record->dirs & ~device_mask : record->dirs | device_mask;
+    if (*cursor == '-')
+    {
+        cursor++;
+    }
+    // Geared followers and jogging devices list their gear or velocities instead of command values, parsed as idle
+    char *end;
+    record->steps[device_id] = strtoul(cursor, &end, 10);
+    record->speeds[device_id] = *end == ',' ? strtoul(end + 1, NULL, 10) : 0;
+    record->mask |= device_mask;
+}
+
+bool parse_status(const char *response, WatchRecord *record)
+{
+    char text[MAX_BUFFER_SIZE];
+    char *context;
+    bool has_mode = false;
+    bool has_buffer = false;
+
+    strncpy(text, response, MAX_BUFFER_SIZE - 1);
+    text[MAX_BUFFER_SIZE - 1] = '\0';
+    record->mask = 0;
+    record->dirs = 0;
+    record->flags = 0;
+    record->clk = 0;
+    record->tick_rate = 0;
+    memset(record->steps, 0, sizeof(record->steps));
+    memset(record->speeds, 0, sizeof(record->speeds));
+    memset(record->counts, 0, sizeof(record->counts));
+
+    for (char *line = strtok_r(text, "\n", &context); line != NULL; line = strtok_r(NULL, "\n", &context))
+    {
+        if (strcmp(line, "RUN") == 0 || strcmp(line, "PAUSED") == 0 || strcmp(line, "PVT") == 0 || strcmp(line, "MOVE") == 0)
+        {
+            has_mode = true;
+            record->mode = line[0] == 'R' ? WATCH_MODE_RUN :
+                           line[1] == 'A' ? WATCH_MODE_PAUSED :
+                           line[1] == 'V' ? WATCH_MODE_PVT : WATCH_MODE_MOVE;
+        }
+        else if (line[0] >= 'A' && line[0] < 'A' + WATCH_DEVICES && line[1] == ':')
+        {
+            parse_device(line, record);
+        }
+        else if (starts_with(line, "SW:"))
+        {
+            // SW<n> is the active limit switch
+            record->switches = strcmp(line + 3, "NONE") == 0 ? WATCH_SWITCHES_NONE :
+                               starts_with(line + 3, "SW") ? atoi(line + 5) + 1 : WATCH_SWITCHES_UNDEFINED;
+        }
+        else if (starts_with(line, "BUFF:"))
+        {
+            char *end;
+            has_buffer = true;
+            record->queue_depth = strtoul(line + 5, &end, 10);
+            record->queue_size = *end == '/' ? strtoul(end + 1, NULL, 10) : 0;
+        }
+        else if (starts_with(line, "TICK:"))
+        {
+            record->tick_rate = strtoul(line + 5, NULL, 10);
+        }
+        else if (starts_with(line, "CLK:"))
+        {
+            record->clk = strtoul(line + 4, NULL, 10);
+        }
+        else if (starts_with(line, "CNT:"))
+        {
+            // Left out by the board when the status is too long
+            char *cursor = line + 3;
+            record->flags |= WATCH_FLAG_COUNTS;
+            for (int device_id = 0; device_id < WATCH_DEVICES && *cursor != '\0'; device_id++)
+            {
+                record->counts[device_id] = strtoul(cursor + 1, &cursor, 10);
+            }
+        }
+    }
+
+    return has_mode && has_buffer;
+}
+
+/**
+ * Sets the steps/s achieved since the previous sample. The time is taken from the board tick counter,
+ * from the host timestamps when the board doesn't report it. The steps are the difference of the board step
+ * counters. Without them the steps come from the remaining steps: a device with more remaining steps than
+ * before started a new command and only the rest of the previous command is counted, and the sample is
+ * flagged when the queue depth dropped, as whole commands may have run in between.
+ */
+static void compute_rates(const WatchRecord *previous, WatchRecord *record)
+{
+    uint32_t ticks = record->clk - previous->clk;
+    double elapsed_s = ticks > 0 && record->tick_rate > 0 ? (double)ticks / record->tick_rate :
+                       (record->timestamp_ns - previous->timestamp_ns) / 1e9;
+    bool has_counts = (record->flags & previous->flags & WATCH_FLAG_COUNTS) != 0;
+
+    if (!has_counts && record->queue_depth < previous->queue_depth)
+    {
+        record->flags |= WATCH_FLAG_INCOMPLETE;
+    }
+    for (int device_id = 0; device_id < WATCH_DEVICES; device_id++)
+    {
+        uint8_t device_mask = 1 << device_id;
+        uint32_t done = 0;
+        if (has_counts)
+        {
+            done = (uint16_t)(record->counts[device_id] - previous->counts[device_id]);
+        }
+        else if (previous->mask & device_mask)
+        {
+            bool is_same_command = (record->mask & device_mask) &&
+                                   ((record->dirs ^ previous->dirs) & device_mask) == 0 &&
+                                   record->steps[device_id] <= previous->steps[device_id];
+            done = is_same_command ? previous->steps[device_id] - record->steps[device_id] : previous->steps[device_id];
+        }
+        record->rates[device_id] = elapsed_s > 0 ? done / elapsed_s : 0;
+    }
+}
+
+static void write_csv_header(FILE *output)
+{
+    fprintf(output, "time_ms,status,mode,clk,tick");
+    for (int device_id = 0; device_id < WATCH_DEVICES; device_id++)
+    {
+        fprintf(output, ",%c_steps,%c_speed,%c_rate", 'a' + device_id, 'a' + device_id, 'a' + device_id);
+    }
+    fprintf(output, ",switches,queue,incomplete,latency_us\n");
+}
+
+static void write_csv_record(FILE *output, const WatchRecord *record)
+{
+    static const char *modes[] = {"RUN", "PAUSED", "PVT", "MOVE"};
+
+    fprintf(output, "%.3f,%s", record->timestamp_ns / 1e6, record->status == WATCH_STATUS_OK ? "OK" : "ERROR");
+    if (record->status == WATCH_STATUS_OK)
+    {
+        fprintf(output, ",%s,%u,%u", modes[record->mode], record->clk, record->tick_rate);
+        for (int device_id = 0; device_id < WATCH_DEVICES; device_id++)
+        {
+            if (record->mask & (1 << device_id))
+            {
+                bool is_negative = !(record->dirs & (1 << device_id)) && record->steps[device_id] > 0;
+                fprintf(output, ",%s%u,%u,%.1f", is_negative ? "-" : "",
+                        record->steps[device_id], record->speeds[device_id], record->rates[device_id]);
+            }
+            else
+            {
+                fprintf(output, ",,,");
+            }
+        }
+        fprintf(output, ",%u,%u,%d", record->switches, record->queue_depth,
+                (record->flags & WATCH_FLAG_INCOMPLETE) != 0);
+    }
+    else
+    {
+        // Empty mode, clk, tick, device, switches, queue and incomplete columns
+        for (int i = 0; i < 6 + WATCH_DEVICES * 3; i++)
+        {
+            fputc(',', output);
+        }
+    }
+    fprintf(output, ",%.1f\n", record->latency_ns / 1e3);
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000ULL,
+        .tv_nsec = deadline_ns % 1000000000ULL,
+    };
+    // Returns early when interrupted
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+}
+
+int run_watch(uint8_t address, int rate_hz, int count, int format, FILE *output, bool verbose)
+{
+    char response[MAX_BUFFER_SIZE];
+    WatchRecord previous;
+    WatchRecord record;
+    LatencyStats stats;
+    uint64_t period_ns = 1000000000ULL / rate_hz;
+    uint64_t bus_ns = 0;
+    int samples = 0;
+    int errors = 0;
+    int missed = 0;
+
+    int handle = open_device(address, verbose);
+    if (handle < 0)
+    {
+        fprintf(stderr, "Failed to open the device at address 0x%02x: %s\n", address, strerror(errno));
+        return RESPONSE_LIB_ERROR;
+    }
+
+    if (format == WATCH_FORMAT_BINARY)
+    {
+        uint16_t version = WATCH_VERSION;
+        fwrite(WATCH_MAGIC, 1, WATCH_MAGIC_SIZE, output);
+        fwrite(&version, sizeof(version), 1, output);
+    }
+    else
+    {
+        write_csv_header(output);
+    }
+
+    struct sigaction action;
+    struct sigaction previous_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &action, &previous_action);
+    is_interrupted = 0;
+
+    stats_init(&stats);
+    memset(&previous, 0, sizeof(previous));
+    previous.status = WATCH_STATUS_ERROR;
+    uint64_t cpu_start_ns = process_cpu_ns();
+    uint64_t watch_start_ns = monotonic_ns();
+    uint64_t deadline_ns = watch_start_ns;
+
+    while (!is_interrupted && (count == 0 || samples < count))
+    {
+        sleep_until(deadline_ns);
+        if (is_interrupted)
+        {
+            break;
+        }
+
+        uint64_t start_ns = monotonic_ns();
+        bool is_read = transfer_data(handle, address, WATCH_COMMAND, response, verbose);
+        uint64_t latency_ns = monotonic_ns() - start_ns;
+        stats_add(&stats, latency_ns);
+        bus_ns += latency_ns;
+        samples++;
+
+        memset(&record, 0, sizeof(record));
+        record.timestamp_ns = start_ns - watch_start_ns;
+        record.latency_ns = latency_ns;
+        record.status = is_read && parse_status(response, &record) ? WATCH_STATUS_OK : WATCH_STATUS_ERROR;
+        if (record.status == WATCH_STATUS_OK && previous.status == WATCH_STATUS_OK)
+        {
+            compute_rates(&previous, &record);
+        }
+        if (record.status != WATCH_STATUS_OK)
+        {
+            errors++;
+        }
+
+        if (format == WATCH_FORMAT_BINARY)
+        {
+            fwrite(&record, sizeof(record), 1, output);
+        }
+        else
+        {
+            write_csv_record(output, &record);
+        }
+        previous = record;
+
+        // A sample that ended after the next deadline skips the deadlines it missed, the rate is kept
+        deadline_ns += period_ns;
+        uint64_t now_ns = monotonic_ns();
+        if (now_ns > deadline_ns)
+        {
+            uint64_t late = (now_ns - deadline_ns) / period_ns + 1;
+            missed += late;
+            deadline_ns += late * period_ns;
+        }
+    }
+
+    uint64_t elapsed_ns = monotonic_ns() - watch_start_ns;
+    uint64_t cpu_ns = process_cpu_ns() - cpu_start_ns;
+    sigaction(SIGINT, &previous_action, NULL);
+    fflush(output);
+    close_device(handle);
+
+    stats_print(stderr, &stats, "Watch", elapsed_ns);
+    fprintf(stderr, "Samples: %d, failed: %d, missed deadlines: %d\n", samples, errors, missed);
+    fprintf(stderr, "Overhead: bus %.1f%% of the time, host CPU %.1f us per sample\n",
+            elapsed_ns > 0 ? 100.0 * bus_ns / elapsed_ns : 0.0, samples > 0 ? cpu_ns / 1e3 / samples : 0.0);
+    stats_free(&stats);
+
+    return errors > 0 ? RESPONSE_LIB_ERROR : RESPONSE_ACCEPTED;
+}
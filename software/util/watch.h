@@ -0,0 +1,94 @@
+/*
+* Copyright (c) 2021, FibStack
+* All rights reserved.
+* 
+* This source code is licensed under the MIT license found in the
+* LICENSE file in the root directory of this source tree. 
+*/
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Binary watch file: magic and version header followed by one WatchRecord per sample.
+// Values are stored in the host byte order.
+#define WATCH_MAGIC "FBSWAT"
+#define WATCH_MAGIC_SIZE 6
+#define WATCH_VERSION 2
+
+#define WATCH_DEVICES 4
+#define WATCH_RATE_HZ 50 // Default samples per second
+
+#define WATCH_FORMAT_CSV 0
+#define WATCH_FORMAT_BINARY 1
+
+#define WATCH_STATUS_OK 0
+#define WATCH_STATUS_ERROR 1 // No response or not a status response, only the timestamp and latency are set
+
+#define WATCH_MODE_RUN 0
+#define WATCH_MODE_PAUSED 1
+#define WATCH_MODE_PVT 2
+#define WATCH_MODE_MOVE 3
+
+#define WATCH_SWITCHES_NONE 0 // Otherwise the active switch number + 1
+#define WATCH_SWITCHES_UNDEFINED 0xFF
+
+#define WATCH_FLAG_COUNTS 0x01 // The board reported its step counters
+#define WATCH_FLAG_INCOMPLETE 0x02 // Rates from the remaining steps while a queued command was loaded, may miss steps
+
+typedef struct __attribute__((packed))
+{
+    uint64_t timestamp_ns; // Sample start, monotonic time since the watch started
+    uint32_t latency_ns; // Time spent in the status transaction
+    uint32_t clk; // Board tick counter when the status was taken
+    uint32_t steps[WATCH_DEVICES]; // Remaining steps of the running command
+    uint16_t speeds[WATCH_DEVICES];
+    float rates[WATCH_DEVICES]; // Achieved steps/s since the previous sample
+    uint16_t counts[WATCH_DEVICES]; // Wrapping step counters of the board, valid with WATCH_FLAG_COUNTS
+    uint16_t tick_rate;
+    uint8_t mask; // Devices listed in the status, a move command lists only its device
+    uint8_t dirs; // Direction bit per device, 1 - clockwise
+    uint8_t mode; // WATCH_MODE_* value
+    uint8_t switches;
+    uint8_t queue_depth;
+    uint8_t queue_size;
+    uint8_t status; // WATCH_STATUS_OK or WATCH_STATUS_ERROR
+    uint8_t flags; // WATCH_FLAG_* bits
+} WatchRecord;
+
+/**
+ * function: parse_status()
+ * 
+ * Parses the response to the status command. The rates and WATCH_FLAG_INCOMPLETE are not set.
+ * Returns false if the response is not a status response.
+ * @parameter response - response returned by the board
+ * @parameter record - the parsed values
+ * 
+ */
+extern bool parse_status(const char *response, WatchRecord *record);
+
+/**
+ * function: run_watch()
+ * 
+ * Keeps the device open and samples its status at a fixed rate until the sample count is reached or
+ * the process is interrupted. Each sample is written as a CSV line or a binary WatchRecord, with the steps/s
+ * each device achieved since the previous sample, computed from the board step counters over the board tick
+ * counter. Without the counters the rates come from the drop of the remaining steps, and samples during which
+ * a queued command was loaded are flagged, as the commands that started and finished in between are missed.
+ * The latency distribution, the share of time spent sampling and the missed sampling deadlines are printed
+ * to stderr.
+ * Returns 0 if every sample was read, 2 if a sample failed.
+ * @parameter address - i2c device address
+ * @parameter rate_hz - samples per second
+ * @parameter count - samples to take, 0 to sample until interrupted
+ * @parameter format - WATCH_FORMAT_CSV or WATCH_FORMAT_BINARY
+ * @parameter output - stream for the samples
+ * @parameter verbose - print additional details
+ * 
+ */
+extern int run_watch(uint8_t address, int rate_hz, int count, int format, FILE *output, bool verbose);
+
+#endif /* WATCH_H_ */